@@ -150,6 +150,7 @@ void* arena_alloc(Arena* arena, size_t size)
         a->next->base = (u8*)malloc(new_arena_size * sizeof(u8));
         a->next->offset = 0;
         a->next->capacity = new_arena_size;
+        a->next->next = NULL;
     }
 
     void* ptr = a->base+a->offset;
@@ -518,16 +519,24 @@ typedef struct
     u8 suby; // position in larger image
     void* arena;
     bool scaled; // determine if image was scaled
+    int min_face; // settings.min_face in pixels of this image
     u32 frame_number; // used for video reconstruction
     u8* result;
 } Image;
 
-typedef struct {
-    u16 w;
-    u16 h;
-    u32 frame_count;
-    u8* data; // RGB
-} Video;
+// 8-bit planar YUV image, the chroma planes are subsampled by
+// chroma_shift_x/y (1,1 for 4:2:0). Plane memory belongs to whoever
+// filled this in, e.g. a decoded video frame.
+typedef struct
+{
+    u8* planes[3]; // Y, U, V
+    int stride[3];
+    int w;
+    int h;
+    int chroma_shift_x;
+    int chroma_shift_y;
+    bool full_range; // 0-255 (JPEG) instead of 16-235 (video)
+} PlanarImage;
 
 typedef struct
 {
@@ -572,14 +581,26 @@ typedef struct
     float block_scale;
 
     bool no_scale;
+    bool smart_render; // copy GOPs without detections instead of re-encoding them
+    int detect_interval; // video: run the CNN every n frames and track in between, 1 = every frame
+    int track_max_age;   // video: frames a track survives without a matching detection
+    int segment_count;   // video: split at key frames and run this many pipelines at once, 1 = off
+    int roi_interval;    // video: detect the full frame every n frames and around the last faces in between, 1 = off
+    int min_face;        // narrowest face worth finding in source pixels, lets the CNN skip its stride 8 branch, 0 = off
+    bool int8;           // run the CNN's point wise layers in 8-bit
+    bool fp16;           // store the CNN's activations as half floats
+    bool depth_first;    // run the CNN's first layers strip by strip
+    char isa[16];        // CNN build to use instead of the best the CPU supports, empty = pick
+    char model_path[256]; // CNN weights to map instead of the built in ones, empty = built in
     bool debug;
 } ProgramSettings;
 
-#define MAX_FRAMES 1500
 #define MAX_ARENAS 64
+#define DETECT_BUFFER_SIZE 0x9000 // result buffer handed to facedetect_cnn
+#define DETECT_MAX_FACES   1024   // most faces it holds
+#define DETECT_SCALED_SIZE 640
 
 extern ProgramSettings settings;
-extern pthread_t *threads;
 extern Timer timer;
 extern Arena* thread_arenas[MAX_ARENAS];
 extern Image texture_image;
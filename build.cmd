@@ -14,9 +14,16 @@ mkdir bin
 
 cd build
 
-set srcs=..\main.cpp ..\models\facedetectcnn-data.cpp ..\models\facedetectcnn-model.cpp ..\models\facedetectcnn.cpp
+set models=..\models\facedetectcnn-data.cpp ..\models\facedetectcnn-model.cpp ..\models\facedetectcnn.cpp
 set opts=/O2 /D "_CRT_SECURE_NO_WARNINGS" /nologo
 set includes=/I..\include
+
+echo Packing the model weights
+cl %opts% %includes% ..\models\facedetectcnn-pack.cpp %models% /Fe..\bin\facedetectcnn-pack.exe || exit /b 1
+..\bin\facedetectcnn-pack.exe ..\models\facedetectcnn-packed.cpp || exit /b 1
+
+set srcs=..\main.cpp %models% ..\models\facedetectcnn-packed.cpp
+set opts=%opts% /D "FACEDETECT_PACKED"
 set libs="kernel32.lib" "user32.lib" "gdi32.lib" "winspool.lib" "comdlg32.lib" "advapi32.lib" "shell32.lib" "ole32.lib" "oleaut32.lib" "uuid.lib" "odbc32.lib" "odbccp32.lib"
 
 echo Compiling project
@@ -8,10 +8,17 @@ rm -rf bin
 echo "Creating new bin directory"
 mkdir bin
 
-srcs="main.cpp models/facedetectcnn-data.cpp models/facedetectcnn-model.cpp models/facedetectcnn.cpp"
+models="models/facedetectcnn-data.cpp models/facedetectcnn-model.cpp models/facedetectcnn.cpp models/facedetectcnn-avx2.cpp models/facedetectcnn-avx512.cpp models/facedetectcnn-avx512vnni.cpp"
 opts="-march=native -Ofast"
 #-mavx2
 includes="-Iinclude -Iffmpeg/include"
+
+echo "Packing the model weights"
+g++ models/facedetectcnn-pack.cpp ${models} -Iinclude ${opts} -o ./bin/facedetectcnn-pack || exit 1
+./bin/facedetectcnn-pack models/facedetectcnn-packed.cpp || exit 1
+
+srcs="main.cpp ${models} models/facedetectcnn-packed.cpp"
+opts="${opts} -DFACEDETECT_PACKED"
 libs="-Lffmpeg/lib -lavformat -lavcodec -lavutil -lswscale -lm -lz -lva -lva-drm -lvdpau -lX11 -lva-x11 -lx264 -lpthread"
 #libs="-lm -lz"
 
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "base.h"
+#include "pipeline.h"
+
+// Detection sidecar cache
+//
+// The rects found in an input are written next to it as <input>.cmrects so
+// later runs with different transforms can skip detection entirely. The file
+// is keyed by a hash of the input's content and a hash of every setting that
+// changes what the detector returns, and is ignored if either doesn't match.
+//
+// Layout (native endianness, checked through the magic):
+//
+//   CacheHeader
+//   FrameDetections[frame_count]  indexed by frame number
+//   Rect[rect_count]
+
+#define CACHE_MAGIC         0x43524d43 // "CMRC"
+#define CACHE_VERSION       1
+#define CACHE_MODEL_VERSION 2          // bump when the model or the post-processing changes
+#define CACHE_EXTENSION     ".cmrects"
+
+typedef struct
+{
+    u64 content_hash;
+    u64 settings_hash;
+} CacheKey;
+
+typedef struct
+{
+    u32 magic;
+    u32 version;
+    u64 content_hash;
+    u64 settings_hash;
+    u32 frame_count;
+    u32 rect_count;
+} CacheHeader;
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+
+static inline u64 fnv1a(u64 hash, const void* data, u64 size)
+{
+    const u8* p = (const u8*)data;
+    for(u64 i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// Hashes the content of path into hash. Returns false if it can't be read
+static bool hash_file(const char* path, u64* hash)
+{
+    FILE* fp = fopen(path, "rb");
+    if(!fp)
+        return false;
+
+    u8 buffer[1 << 16];
+    u64 n;
+    while((n = fread(buffer, 1, sizeof(buffer), fp)) > 0)
+        *hash = fnv1a(*hash, buffer, n);
+    fclose(fp);
+    return true;
+}
+
+// Returns false if path can't be read
+bool cache_key(const char* path, AssetType asset_type, CacheKey* key)
+{
+    u64 hash = FNV_OFFSET_BASIS;
+    if(!hash_file(path, &hash))
+        return false;
+
+    key->content_hash = hash;
+
+    // everything that changes the rects, field by field so padding doesn't count
+    hash = FNV_OFFSET_BASIS;
+    u32 model_version = CACHE_MODEL_VERSION;
+    i32 scaled_size = settings.no_scale ? 0 : DETECT_SCALED_SIZE;
+    hash = fnv1a(hash, &model_version, sizeof(model_version));
+    if(settings.model_path[0] && !hash_file(settings.model_path, &hash))
+        return false;
+    hash = fnv1a(hash, &asset_type, sizeof(asset_type));
+    hash = fnv1a(hash, &settings.classification, sizeof(settings.classification));
+    hash = fnv1a(hash, &settings.confidence_threshold, sizeof(settings.confidence_threshold));
+    hash = fnv1a(hash, &settings.nms_iou_threshold, sizeof(settings.nms_iou_threshold));
+    hash = fnv1a(hash, &scaled_size, sizeof(scaled_size));
+    hash = fnv1a(hash, &settings.min_face, sizeof(settings.min_face));
+    hash = fnv1a(hash, &settings.int8, sizeof(settings.int8));
+    hash = fnv1a(hash, &settings.fp16, sizeof(settings.fp16));
+
+    if(asset_type == TYPE_IMAGE)
+    {
+        // images are split into one tile per thread
+        hash = fnv1a(hash, &settings.thread_count, sizeof(settings.thread_count));
+    }
+    else
+    {
+        // the tracker and the ROI windows start over in every segment
+        hash = fnv1a(hash, &settings.detect_interval, sizeof(settings.detect_interval));
+        hash = fnv1a(hash, &settings.track_max_age, sizeof(settings.track_max_age));
+        hash = fnv1a(hash, &settings.roi_interval, sizeof(settings.roi_interval));
+        if(settings.detect_interval > 1 || settings.roi_interval > 1)
+            hash = fnv1a(hash, &settings.segment_count, sizeof(settings.segment_count));
+    }
+
+    key->settings_hash = hash;
+    return true;
+}
+
+static void cache_path(const char* path, char* out, int out_size)
+{
+    snprintf(out, out_size, "%s%s", path, CACHE_EXTENSION);
+}
+
+// Fills detections from the sidecar of path if it matches key
+bool cache_load(const char* path, CacheKey* key, VideoDetections* detections)
+{
+    char file[512];
+    cache_path(path, file, sizeof(file));
+
+    FILE* fp = fopen(file, "rb");
+    if(!fp)
+        return false;
+
+    CacheHeader header = {};
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 &&
+              header.magic == CACHE_MAGIC &&
+              header.version == CACHE_VERSION &&
+              header.content_hash == key->content_hash &&
+              header.settings_hash == key->settings_hash;
+
+    if(ok)
+    {
+        memset(detections, 0, sizeof(VideoDetections));
+        detections->frame_cap = detections->frame_count = header.frame_count;
+        detections->rect_cap = detections->rect_count = header.rect_count;
+        detections->frames = (FrameDetections*)malloc(MAX(1, header.frame_count)*sizeof(FrameDetections));
+        detections->rects = (Rect*)malloc(MAX(1, header.rect_count)*sizeof(Rect));
+
+        ok = fread(detections->frames, sizeof(FrameDetections), header.frame_count, fp) == header.frame_count &&
+             fread(detections->rects, sizeof(Rect), header.rect_count, fp) == header.rect_count;
+
+        for(u32 i = 0; ok && i < header.frame_count; ++i)
+        {
+            FrameDetections* f = &detections->frames[i];
+            ok = f->first_rect >= 0 && f->num_rects >= 0 && (u32)(f->first_rect + f->num_rects) <= header.rect_count;
+        }
+
+        if(!ok)
+        {
+            LOGW("Detection cache %s is damaged, ignoring it", file);
+            video_detections_free(detections);
+        }
+    }
+
+    fclose(fp);
+
+    if(ok)
+        LOGI("Using cached detections from %s (%u frames, %u rects)", file, header.frame_count, header.rect_count);
+
+    return ok;
+}
+
+bool cache_save(const char* path, CacheKey* key, VideoDetections* detections)
+{
+    char file[512];
+    cache_path(path, file, sizeof(file));
+
+    FILE* fp = fopen(file, "wb");
+    if(!fp)
+    {
+        LOGW("Could not write detection cache %s", file);
+        return false;
+    }
+
+    CacheHeader header = {};
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.content_hash = key->content_hash;
+    header.settings_hash = key->settings_hash;
+    header.frame_count = detections->frame_count;
+    header.rect_count = detections->rect_count;
+
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(detections->frames, sizeof(FrameDetections), detections->frame_count, fp) == (u64)detections->frame_count &&
+              fwrite(detections->rects, sizeof(Rect), detections->rect_count, fp) == (u64)detections->rect_count;
+
+    fclose(fp);
+
+    if(!ok)
+    {
+        LOGW("Could not write detection cache %s", file);
+        remove(file);
+    }
+
+    return ok;
+}
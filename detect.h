@@ -1,51 +1,283 @@
+#pragma once
+
 #include "base.h"
+#include "threadpool.h"
 #include "transform.h"
 #include "util.h"
 #include "facedetectcnn.h"
 
-void detect_init()
+typedef struct
 {
-    facedetect_init(); // copies model data to be used
+    facedetect_task_func func;
+    void* arg;
+    int index;
+} DetectLayerTask;
+
+static void detect_layer_task(void* arg)
+{
+    DetectLayerTask* t = (DetectLayerTask*)arg;
+    t->func(t->arg, t->index);
 }
 
-void* detect_faces(void* arg)
+// Runs the tasks of one CNN layer on the worker pool. If the pool is already
+// backed up with frames or image tiles there's nobody to hand them to, so
+// they run right here instead of queueing behind that work.
+static void detect_parallel_for(void* ctx, facedetect_task_func func, void* arg, int count)
 {
-    Image* image = (Image*)arg;
+    ThreadPool* pool = (ThreadPool*)ctx;
+
+    if(__atomic_load_n(&pool->queued, __ATOMIC_RELAXED) >= pool->worker_count)
+    {
+        for(int i = 0; i < count; ++i)
+            func(arg, i);
+        return;
+    }
 
-    int *results = facedetect_cnn(image->detect_buffer,image->data,image->w,image->h,image->step); 
-    int num_faces = (results ? *results : 0);
+    DetectLayerTask tasks[count];
+    TaskGroup group = {};
 
-    image->result = (u8*)arena_alloc((Arena*)image->arena, sizeof(int) + num_faces*sizeof(Rect));
+    for(int i = 1; i < count; ++i)
+    {
+        tasks[i] = {func, arg, i};
+        threadpool_submit(pool, &group, detect_layer_task, &tasks[i]);
+    }
 
-    int offset = 0;
+    func(arg, 0);
+    threadpool_wait(pool, &group);
+}
 
-    memcpy(image->result, &num_faces, sizeof(int));
-    offset += sizeof(int);
+// Returns false if the model file can't be used
+bool detect_init()
+{
+    if(settings.isa[0] && !facedetect_set_isa(settings.isa))
+        LOGW("Kernels '%s' aren't available on this CPU, picking the best ones", settings.isa);
+
+    // mapped, the layers point straight into it
+    if(settings.model_path[0] && !facedetect_load_model(settings.model_path))
+    {
+        LOGE("Failed to load model %s", settings.model_path);
+        return false;
+    }
+
+    facedetect_init(); // copies model data to be used
+    facedetect_set_int8(settings.int8);
+    facedetect_set_fp16(settings.fp16);
+    facedetect_set_rgb(true); // images and video frames are RGB
+    facedetect_set_depth_first(settings.depth_first);
+
+    // big layers are split across the pool, see detect_parallel_for
+    facedetect_set_parallel(detect_parallel_for, &thread_pool, thread_pool.worker_count);
+
+    LOGI("Detector kernels: %s", facedetect_get_isa());
+    return true;
+}
+
+// Copies the faces in a facedetect_cnn() result buffer to rects, offset by
+// (x, y). Returns the number of rects
+static int detect_read_results(int* results, int x, int y, Rect* rects, int max_rects)
+{
+    int num_faces = MIN(results ? *results : 0, max_rects);
 
     for(int i = 0; i < num_faces; ++i)
     {
         short *p = ((short*)(results+1)) + 16*i;
 
-        Rect *r = (Rect*)(image->result+offset);
-
+        Rect *r = &rects[i];
         r->confidence = p[0];
-        r->x = p[1] + (image->subx*image->w);
-        r->y = p[2] + (image->suby*image->h);
+        r->x = p[1] + x;
+        r->y = p[2] + y;
         r->w = p[3];
         r->h = p[4];
+    }
+
+    return num_faces;
+}
+
+static void detect_store_results(Image* image, Rect* rects, int num_faces)
+{
+    image->result = (u8*)arena_alloc((Arena*)image->arena, sizeof(int) + num_faces*sizeof(Rect));
+    memcpy(image->result, &num_faces, sizeof(int));
+    memcpy(image->result + sizeof(int), rects, num_faces*sizeof(Rect));
+}
+
+// TaskFunc, arg is the Image to run detection on
+void detect_faces(void* arg)
+{
+    Image* image = (Image*)arg;
 
-        offset += sizeof(Rect);
+    int *results = facedetect_cnn_min_face(image->detect_buffer,image->data,image->w,image->h,image->step,image->min_face);
+
+    Rect rects[DETECT_MAX_FACES];
+    int num_faces = detect_read_results(results, image->subx*image->w, image->suby*image->h, rects, DETECT_MAX_FACES);
+    detect_store_results(image, rects, num_faces);
+}
+
+// ROI detection
+//
+// Faces rarely move far between two frames, so instead of the whole frame
+// the CNN can look at windows around the faces of the previous one. Every
+// face's box grows by ROI_MARGIN of its size on each side, and is then
+// snapped outwards to ROI_ALIGN, the CNN's largest stride. Snapped windows
+// need no padding in the network and keep its anchors where a full-frame
+// pass has them. Overlapping windows are merged. If they would cover most of
+// the frame anyway, the whole frame is detected instead.
+
+#define ROI_MARGIN    1.0f  // share of the face size added on every side
+#define ROI_ALIGN     32
+#define ROI_MAX_AREA  0.6f  // share of the frame above which the full frame is cheaper
+
+static bool roi_overlap(Rect* a, Rect* b)
+{
+    return a->x < b->x + b->w && b->x < a->x + a->w && a->y < b->y + b->h && b->y < a->y + a->h;
+}
+
+// Windows (in image's pixels) to detect rects again in. Returns the number of windows
+static int detect_roi_windows(Image* image, Rect* rects, int num_rects, Rect* windows)
+{
+    int num_windows = 0;
+
+    for(int i = 0; i < num_rects; ++i)
+    {
+        Rect* r = &rects[i];
+        int margin = (int)(MAX(r->w, r->h)*ROI_MARGIN);
+
+        int x0 = MAX(0, r->x - margin) / ROI_ALIGN * ROI_ALIGN;
+        int y0 = MAX(0, r->y - margin) / ROI_ALIGN * ROI_ALIGN;
+        int x1 = MIN(image->w, (r->x + r->w + margin + ROI_ALIGN - 1) / ROI_ALIGN * ROI_ALIGN);
+        int y1 = MIN(image->h, (r->y + r->h + margin + ROI_ALIGN - 1) / ROI_ALIGN * ROI_ALIGN);
+
+        if(x1 - x0 < ROI_ALIGN || y1 - y0 < ROI_ALIGN)
+            continue; // the face has left the frame
+
+        Rect w = {(u16)x0, (u16)y0, (u16)(x1 - x0), (u16)(y1 - y0), 0};
+        windows[num_windows++] = w;
     }
 
-    return NULL;
+    // merge until no two windows overlap, the union of snapped windows is snapped too
+    for(bool merged = true; merged;)
+    {
+        merged = false;
+        for(int i = 0; i < num_windows; ++i)
+        {
+            for(int j = i+1; j < num_windows; ++j)
+            {
+                Rect* a = &windows[i];
+                Rect* b = &windows[j];
+                if(!roi_overlap(a, b))
+                    continue;
+
+                int x0 = MIN(a->x, b->x);
+                int y0 = MIN(a->y, b->y);
+                int x1 = MAX(a->x + a->w, b->x + b->w);
+                int y1 = MAX(a->y + a->h, b->y + b->h);
+                Rect u = {(u16)x0, (u16)y0, (u16)(x1 - x0), (u16)(y1 - y0), 0};
+                *a = u;
+
+                windows[j--] = windows[--num_windows];
+                merged = true;
+            }
+        }
+    }
+
+    return num_windows;
+}
+
+// Like detect_faces(), but only on windows around rects, the faces found in
+// the previous frame in image's pixels. Finds nothing if there are none.
+void detect_faces_roi(Image* image, Rect* rects, int num_rects)
+{
+    Rect windows[DETECT_MAX_FACES];
+    int num_windows = detect_roi_windows(image, rects, MIN(num_rects, DETECT_MAX_FACES), windows);
+
+    u64 area = 0;
+    for(int i = 0; i < num_windows; ++i)
+        area += (u64)windows[i].w*windows[i].h;
+
+    if(area > ROI_MAX_AREA*image->w*image->h)
+    {
+        detect_faces(image);
+        return;
+    }
+
+    Rect faces[DETECT_MAX_FACES];
+    int num_faces = 0;
+
+    for(int i = 0; i < num_windows; ++i)
+    {
+        Rect* w = &windows[i];
+        u8* data = image->data + (u64)w->y*image->step + w->x*image->n;
+
+        int* results = facedetect_cnn_min_face(image->detect_buffer, data, w->w, w->h, image->step, image->min_face);
+        num_faces += detect_read_results(results, w->x, w->y, &faces[num_faces], DETECT_MAX_FACES - num_faces);
+    }
+
+    detect_store_results(image, faces, num_faces);
+}
+
+// Rects of the last detection on image in its own pixels, the confident ones only
+int detect_get_image_rects(Image* image, Rect* rects, int max_rects)
+{
+    if(!image->result)
+        return 0;
+
+    int faces_found = *((int*)image->result);
+    Rect* found = (Rect*)(image->result + sizeof(int));
+    int num_rects = 0;
+
+    for(int i = 0; i < faces_found && num_rects < max_rects; ++i)
+    {
+        if(found[i].confidence >= settings.confidence_threshold)
+            rects[num_rects++] = found[i];
+    }
+
+    return num_rects;
+}
+
+// Gathers the results of detect_faces() on a single video frame into rects,
+// mapped back to the full-res frame size (w, h). Returns number of rects
+int detect_get_rects(Image* image, int w, int h, Rect* rects, int max_rects)
+{
+    if(!image->result)
+        return 0;
+
+    u8* ret_rects = image->result;
+    int faces_found = *((int*)(ret_rects));
+    int num_rects = 0;
+
+    bool scaled = (image->w != w || image->h != h);
+    float scale = w > h ? w / (float)image->w : h / (float)image->h;
+    scale *= 1.15;
+
+    for(int i = 0; i < faces_found && num_rects < max_rects; ++i)
+    {
+        Rect r = *(Rect*)(ret_rects + sizeof(int) + i*sizeof(Rect));
+        if(r.confidence < settings.confidence_threshold) // filter out low-confidence regions
+            continue;
+
+        if(scaled)
+        {
+            r.x = (u16)round(r.x * scale);
+            r.y = (u16)round(r.y * scale);
+            r.w = (u16)round(r.w * scale);
+            r.h = (u16)round(r.h * scale);
+        }
+
+        // make sure rectangles are within bounds of image
+        if(r.x >= w || r.y >= h) continue;
+
+        if(r.x + r.w > w) r.w = MAX(0, w - r.x - 1);
+        if(r.y + r.h > h) r.h = MAX(0, h - r.y - 1);
+
+        rects[num_rects++] = r;
+    }
+
+    return num_rects;
 }
 
 // Returns number of rects
 int process_image(Image* image,Rect* ret_rects)
 {
-    if(!threads) return 0;
-
-    reverse_rgb_order(image);
+    if(!thread_pool.worker_count) return 0;
 
     // Determine image subdivision
 
@@ -83,7 +315,7 @@ int process_image(Image* image,Rect* ret_rects)
     LOGI("Image sub-size: (%d, %d), config: %dx%d", sub_width, sub_height, rows, cols);
 
     Image* sub_images[settings.thread_count] = {0};
-    u8 detect_buffers[settings.thread_count][0x9000] = {0};
+    u8 detect_buffers[settings.thread_count][DETECT_BUFFER_SIZE] = {0};
 
     for(int i = 0; i < settings.thread_count; ++i)
     {
@@ -91,7 +323,7 @@ int process_image(Image* image,Rect* ret_rects)
         sub_images[i] = (Image*)arena_alloc(thread_arenas[i], sizeof(Image));
     }
 
-    int actual_thread_count = 0;
+    TaskGroup group = {};
     int x = 0;
     int y = 0;
 
@@ -104,32 +336,24 @@ int process_image(Image* image,Rect* ret_rects)
 
     for(int i = 0; i < settings.thread_count; ++i)
     {
-        Arena* arena = thread_arenas[actual_thread_count];
-        pthread_t* thread = &threads[actual_thread_count];
-        Image* sub_image = sub_images[actual_thread_count];
+        Arena* arena = thread_arenas[i];
+        Image* sub_image = sub_images[i];
 
         // calculate offset into base image
         int offset = (y*image->w*sub_height*image->n) + x*sub_width*image->n;
 
-        sub_image->detect_buffer = detect_buffers[actual_thread_count];
+        sub_image->detect_buffer = detect_buffers[i];
         sub_image->data = image->data + offset;
         sub_image->w = sub_width;
         sub_image->h = sub_height;
         sub_image->n = image->n;
         sub_image->step = image->w*image->n;
         sub_image->arena = arena;
+        sub_image->min_face = image->min_face;
         sub_image->subx = x;
         sub_image->suby = y;
 
-        if(pthread_create(thread, NULL, detect_faces, (void*)sub_image) == 0)
-        {
-            //LOGI("Thread %d started (%d, %d)", i, x, y);
-            actual_thread_count++;
-        }
-        else
-        {
-            LOGW("Failed to start thread");
-        }
+        threadpool_submit(&thread_pool, &group, detect_faces, (void*)sub_image);
 
         x++;
         if(x >= cols)
@@ -139,11 +363,7 @@ int process_image(Image* image,Rect* ret_rects)
         }
     }
 
-    for(int i = 0; i < settings.thread_count; ++i)
-    {
-        //LOGI("Thread %d joined", i);
-        pthread_join(threads[i], NULL);
-    }
+    threadpool_wait(&thread_pool, &group);
 
     double detection_time = timer_get_elapsed(&timer);
     LOGI("detection time: %.3f ms", detection_time*1000.0f);
@@ -152,7 +372,7 @@ int process_image(Image* image,Rect* ret_rects)
     int num_faces = 0;
 
     // collect face box results
-    for(int i = 0; i < actual_thread_count; ++i)
+    for(int i = 0; i < settings.thread_count; ++i)
     {
         Image* sub_image = sub_images[i];
         if(sub_image && sub_image->result)
@@ -181,8 +401,6 @@ int process_image(Image* image,Rect* ret_rects)
         }
     }
 
-    reverse_rgb_order(image);
-
     // sort and filter out detected boxes
     util_sort_rects(num_faces, total_rects, false);
 
@@ -1,8 +1,11 @@
+#pragma once
+
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 }
 #include <pthread.h>
 #include <stdbool.h>
@@ -12,196 +15,394 @@ extern "C" {
 
 #include "base.h"
 
-bool ffmpeg_decode(const char *filename, Video *output)
+// Demuxed video packet as seen by the reader, in decode order
+typedef struct
+{
+    i64 pts;
+    i64 dts;
+    bool key;
+} PacketInfo;
+
+// Frame-at-a-time decoder. Frames are pulled one by one with
+// ffmpeg_reader_read() so the caller decides how many are kept in memory.
+// Frames come out in the decoder's native pixel format, see
+// ffmpeg_frame_to_rgb() for converting them.
+typedef struct
+{
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *codec_ctx;
+    AVStream *stream;
+    AVPacket *pkt;
+
+    int video_stream_index;
+    bool flushing; // no more packets, draining the decoder
+
+    int w;
+    int h;
+    AVRational frame_rate;
+    AVRational time_base;
+
+    // frames outside [start_pts, end_pts) are dropped, AV_NOPTS_VALUE for no limit
+    i64 start_pts;
+    i64 end_pts;
+
+    // every video packet demuxed so far, only kept if record_packets is set
+    bool record_packets;
+    PacketInfo* packets;
+    int packet_count;
+    int packet_cap;
+} VideoReader;
+
+// Frame-at-a-time encoder, fed with RGB24 frames or decoded frames in
+// presentation order
+typedef struct
 {
-    AVFormatContext *fmt_ctx = NULL;
-    AVCodecContext *codec_ctx = NULL;
-    const AVCodec *codec = NULL;
-    AVFrame *frame = NULL;
-    AVFrame *rgb_frame = NULL;
-    AVPacket *pkt = NULL;
-    struct SwsContext *sws_ctx = NULL;
-
-    int video_stream_index = -1;
-    int ret;
-    u32 frame_count = 0;
-
-    if (avformat_open_input(&fmt_ctx, filename, NULL, NULL) < 0)
+    AVFormatContext *fmt_ctx;
+    AVCodecContext *codec_ctx;
+    AVStream *stream;
+    AVFrame *frame;
+    AVPacket *pkt;
+    struct SwsContext *sws_ctx;       // RGB24 -> encoder format
+    struct SwsContext *frame_sws_ctx; // decoded frame -> encoder format, created on first use
+
+    AVRational src_time_base; // time base of the pts passed to ffmpeg_writer_write*
+    i64 first_pts; // in the encoder time base
+    i64 last_pts;
+    u32 frames_in;
+    u32 packets_out;
+} VideoWriter;
+
+void ffmpeg_reader_close(VideoReader* reader)
+{
+    if(reader->pkt)       av_packet_free(&reader->pkt);
+    if(reader->packets)   free(reader->packets);
+    if(reader->codec_ctx) avcodec_free_context(&reader->codec_ctx);
+    if(reader->fmt_ctx)   avformat_close_input(&reader->fmt_ctx);
+
+    memset(reader, 0, sizeof(VideoReader));
+}
+
+// thread_count is for the decoder, 0 picks one per core
+bool ffmpeg_reader_open(VideoReader* reader, const char *filename, int thread_count = 0)
+{
+    memset(reader, 0, sizeof(VideoReader));
+    reader->video_stream_index = -1;
+    reader->start_pts = AV_NOPTS_VALUE;
+    reader->end_pts = AV_NOPTS_VALUE;
+
+    if (avformat_open_input(&reader->fmt_ctx, filename, NULL, NULL) < 0)
     {
         LOGE("Could not open input file '%s'", filename);
         return false;
     }
 
-    if (avformat_find_stream_info(fmt_ctx, NULL) < 0)
+    if (avformat_find_stream_info(reader->fmt_ctx, NULL) < 0)
     {
         LOGE("Could not find stream info");
-        avformat_close_input(&fmt_ctx);
+        ffmpeg_reader_close(reader);
         return false;
     }
 
-    for (unsigned i = 0; i < fmt_ctx->nb_streams; i++)
+    for (unsigned i = 0; i < reader->fmt_ctx->nb_streams; i++)
     {
-        if (fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        if (reader->fmt_ctx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
         {
-            video_stream_index = i;
+            reader->video_stream_index = i;
             break;
         }
     }
 
-    if (video_stream_index == -1)
+    if (reader->video_stream_index == -1)
     {
         LOGE("No video stream found");
-        avformat_close_input(&fmt_ctx);
+        ffmpeg_reader_close(reader);
         return false;
     }
 
-    enum AVCodecID codec_id = fmt_ctx->streams[video_stream_index]->codecpar->codec_id;
-    LOGI("Video codec id: %d (%s)\n", codec_id, avcodec_get_name(codec_id));
+    reader->stream = reader->fmt_ctx->streams[reader->video_stream_index];
 
-    codec = avcodec_find_decoder(fmt_ctx->streams[video_stream_index]->codecpar->codec_id);
+    enum AVCodecID codec_id = reader->stream->codecpar->codec_id;
+    LOGI("Video codec id: %d (%s)", codec_id, avcodec_get_name(codec_id));
+
+    const AVCodec *codec = avcodec_find_decoder(codec_id);
     if (!codec)
     {
         LOGE("Unsupported codec");
-        avformat_close_input(&fmt_ctx);
+        ffmpeg_reader_close(reader);
         return false;
     }
 
-    codec_ctx = avcodec_alloc_context3(codec);
-    if (!codec_ctx)
+    reader->codec_ctx = avcodec_alloc_context3(codec);
+    if (!reader->codec_ctx)
     {
         LOGE("Could not allocate codec context");
-        avformat_close_input(&fmt_ctx);
+        ffmpeg_reader_close(reader);
         return false;
     }
 
-    avcodec_parameters_to_context(codec_ctx, fmt_ctx->streams[video_stream_index]->codecpar);
+    avcodec_parameters_to_context(reader->codec_ctx, reader->stream->codecpar);
 
     // Enable internal multithreading
-    codec_ctx->thread_count = 0;  // 0 = auto
-    codec_ctx->thread_type = FF_THREAD_FRAME; // or FF_THREAD_SLICE
+    reader->codec_ctx->thread_count = thread_count;  // 0 = auto
+    reader->codec_ctx->thread_type = FF_THREAD_FRAME; // or FF_THREAD_SLICE
 
-    if (avcodec_open2(codec_ctx, codec, NULL) < 0)
+    if (avcodec_open2(reader->codec_ctx, codec, NULL) < 0)
     {
         LOGE("Could not open codec");
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
+        ffmpeg_reader_close(reader);
         return false;
     }
 
-    int width = codec_ctx->width;
-    int height = codec_ctx->height;
-    int rgb_stride = width * 3;
-    int frame_rgb_size = rgb_stride * height;
+    reader->w = reader->codec_ctx->width;
+    reader->h = reader->codec_ctx->height;
+    reader->time_base = reader->stream->time_base;
+    reader->frame_rate = av_guess_frame_rate(reader->fmt_ctx, reader->stream, NULL);
+    if (reader->frame_rate.num == 0 || reader->frame_rate.den == 0)
+        reader->frame_rate = (AVRational){30, 1}; // fallback
+
+    reader->pkt = av_packet_alloc();
 
-    // Allocate buffer for up to 1000 frames
-    u8 *rgb_data = (u8 *)malloc((u64)frame_rgb_size * MAX_FRAMES);
-    if (!rgb_data)
+    if (!reader->pkt)
     {
-        LOGE("Failed to allocate RGB buffer of size %lu", (u64)frame_rgb_size * MAX_FRAMES);
-        avcodec_free_context(&codec_ctx);
-        avformat_close_input(&fmt_ctx);
+        LOGE("Could not allocate decoder packet");
+        ffmpeg_reader_close(reader);
         return false;
     }
 
-    frame = av_frame_alloc();
-    rgb_frame = av_frame_alloc();
-    pkt = av_packet_alloc();
+    return true;
+}
 
-    u8 *rgb_planes[4];
-    int rgb_linesize[4];
-    av_image_fill_arrays(rgb_planes, rgb_linesize, rgb_data, AV_PIX_FMT_RGB24, width, height, 1);
+// Seeks so that reading starts at or before the key frame described by key.
+// Frames before it can be dropped with start_pts.
+bool ffmpeg_reader_seek(VideoReader* reader, PacketInfo* key)
+{
+    if (av_seek_frame(reader->fmt_ctx, reader->video_stream_index, key->dts, AVSEEK_FLAG_BACKWARD) < 0)
+    {
+        LOGE("Could not seek to %ld", (long)key->dts);
+        return false;
+    }
 
-    sws_ctx = sws_getContext(width, height, codec_ctx->pix_fmt,
-                             width, height, AV_PIX_FMT_RGB24,
-                             SWS_BILINEAR, NULL, NULL, NULL);
+    avcodec_flush_buffers(reader->codec_ctx);
+    reader->flushing = false;
+    return true;
+}
+
+// Reads the next video packet into pkt without decoding it.
+// Returns false at the end of the file.
+bool ffmpeg_reader_read_packet(VideoReader* reader, AVPacket* pkt)
+{
+    for(;;)
+    {
+        if (av_read_frame(reader->fmt_ctx, pkt) < 0)
+            return false;
+
+        if (pkt->stream_index == reader->video_stream_index)
+            break;
 
-    while (av_read_frame(fmt_ctx, pkt) >= 0 && frame_count < MAX_FRAMES)
+        av_packet_unref(pkt);
+    }
+
+    if (reader->record_packets)
     {
-        if (pkt->stream_index == video_stream_index)
+        if (reader->packet_count == reader->packet_cap)
         {
-            ret = avcodec_send_packet(codec_ctx, pkt);
-            if (ret < 0)
+            reader->packet_cap = MAX(1024, reader->packet_cap*2);
+            reader->packets = (PacketInfo*)realloc(reader->packets, reader->packet_cap*sizeof(PacketInfo));
+        }
+
+        PacketInfo* info = &reader->packets[reader->packet_count++];
+        info->pts = pkt->pts;
+        info->dts = pkt->dts;
+        info->key = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
+    }
+
+    return true;
+}
+
+// Decodes the next frame into frame (unref'd first), left in the decoder's
+// pixel format. Returns false once the stream is exhausted or on a decode error.
+bool ffmpeg_reader_read(VideoReader* reader, AVFrame* frame)
+{
+    av_frame_unref(frame);
+
+    for(;;)
+    {
+        int ret = avcodec_receive_frame(reader->codec_ctx, frame);
+        if (ret == 0)
+        {
+            i64 pts = frame->best_effort_timestamp;
+
+            if (pts != AV_NOPTS_VALUE && reader->start_pts != AV_NOPTS_VALUE && pts < reader->start_pts)
             {
-                LOGE("Error sending packet for decoding");
-                break;
+                av_frame_unref(frame); // decoded only to get to the start
+                continue;
             }
 
-            while (ret >= 0)
+            if (pts != AV_NOPTS_VALUE && reader->end_pts != AV_NOPTS_VALUE && pts >= reader->end_pts)
             {
-                ret = avcodec_receive_frame(codec_ctx, frame);
-                if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                    break;
-                else if (ret < 0)
-                {
-                    LOGE("Error during decoding");
-                    goto cleanup_decode;
-                }
-
-                // Convert frame to RGB
-                u8 *dest_data[4] = { rgb_data + frame_count * frame_rgb_size, NULL, NULL, NULL };
-                int dest_linesize[4] = { rgb_stride, 0, 0, 0 };
-                sws_scale(sws_ctx, (const u8 *const *)frame->data, frame->linesize, 0,
-                          height, dest_data, dest_linesize);
-
-                frame_count++;
-                if (frame_count >= MAX_FRAMES)
-                    break;
+                // frames come out in presentation order, nothing left before the end
+                av_frame_unref(frame);
+                reader->flushing = true;
+                return false;
             }
+            break;
         }
-        av_packet_unref(pkt);
+
+        if (ret == AVERROR_EOF)
+            return false;
+
+        if (ret != AVERROR(EAGAIN))
+        {
+            LOGE("Error during decoding");
+            return false;
+        }
+
+        if (reader->flushing)
+            return false;
+
+        // decoder wants more input
+        if (!ffmpeg_reader_read_packet(reader, reader->pkt))
+        {
+            // end of file, drain the frames still held by the decoder
+            reader->flushing = true;
+            avcodec_send_packet(reader->codec_ctx, NULL);
+            continue;
+        }
+
+        ret = avcodec_send_packet(reader->codec_ctx, reader->pkt);
+        av_packet_unref(reader->pkt);
+
+        if (ret < 0)
+        {
+            LOGE("Error sending packet for decoding");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Converts a decoded frame to RGB24 at w x h (w*3 bytes per row), scaling
+// in the same pass. *ctx caches the scaler between calls and must only be
+// used from one thread at a time.
+bool ffmpeg_frame_to_rgb(struct SwsContext** ctx, const AVFrame* frame, u8* rgb, int w, int h)
+{
+    *ctx = sws_getCachedContext(*ctx, frame->width, frame->height, (enum AVPixelFormat)frame->format,
+                                w, h, AV_PIX_FMT_RGB24,
+                                SWS_BILINEAR, NULL, NULL, NULL);
+    if (!*ctx)
+    {
+        LOGE("Could not init sws context");
+        return false;
     }
 
-    // Fill the output structure
-    output->w = width;
-    output->h = height;
-    output->frame_count = frame_count;
-    output->data = rgb_data;
+    u8 *dest_data[4] = { rgb, NULL, NULL, NULL };
+    int dest_linesize[4] = { w * 3, 0, 0, 0 };
+    sws_scale(*ctx, (const u8 *const *)frame->data, frame->linesize, 0, frame->height, dest_data, dest_linesize);
 
-    // Cleanup
-    sws_freeContext(sws_ctx);
-    av_frame_free(&frame);
-    av_frame_free(&rgb_frame);
-    av_packet_free(&pkt);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
+    return true;
+}
+
+// Points image at the planes of an 8-bit planar YUV frame so it can be
+// transformed in place. The frame is made writable first, which copies it
+// if the decoder still holds a reference to it. Returns false for pixel
+// formats the planar transforms don't handle.
+bool ffmpeg_frame_to_planar(AVFrame* frame, PlanarImage* image)
+{
+    const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((enum AVPixelFormat)frame->format);
+    if (!desc || desc->nb_components != 3 || !(desc->flags & AV_PIX_FMT_FLAG_PLANAR))
+        return false;
+
+    if (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM))
+        return false;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        if (desc->comp[i].plane != i || desc->comp[i].depth != 8 || desc->comp[i].step != 1)
+            return false;
+    }
+
+    if (av_frame_make_writable(frame) < 0)
+    {
+        LOGE("Could not make frame writable");
+        return false;
+    }
+
+    for (int i = 0; i < 3; ++i)
+    {
+        image->planes[i] = frame->data[i];
+        image->stride[i] = frame->linesize[i];
+    }
+    image->w = frame->width;
+    image->h = frame->height;
+    image->chroma_shift_x = desc->log2_chroma_w;
+    image->chroma_shift_y = desc->log2_chroma_h;
+    image->full_range = (frame->color_range == AVCOL_RANGE_JPEG) ||
+                        frame->format == AV_PIX_FMT_YUVJ420P ||
+                        frame->format == AV_PIX_FMT_YUVJ422P ||
+                        frame->format == AV_PIX_FMT_YUVJ444P;
 
     return true;
+}
+
+static bool ffmpeg_writer_drain(VideoWriter* writer)
+{
+    for(;;)
+    {
+        int ret = avcodec_receive_packet(writer->codec_ctx, writer->pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return true;
+        else if (ret < 0)
+        {
+            LOGE("Error encoding frame");
+            return false;
+        }
+
+        if (writer->packets_out == 0)
+            LOGI("First packet written after %u input frames", writer->frames_in);
 
-cleanup_decode:
-    free(rgb_data);
-    sws_freeContext(sws_ctx);
-    av_frame_free(&frame);
-    av_frame_free(&rgb_frame);
-    av_packet_free(&pkt);
-    avcodec_free_context(&codec_ctx);
-    avformat_close_input(&fmt_ctx);
-    return false;
+        writer->pkt->stream_index = writer->stream->index;
+        av_packet_rescale_ts(writer->pkt, writer->codec_ctx->time_base, writer->stream->time_base);
+        av_interleaved_write_frame(writer->fmt_ctx, writer->pkt);
+        av_packet_unref(writer->pkt);
+        writer->packets_out++;
+    }
 }
 
-bool ffmpeg_encode(const char *filename, Video *video)
+void ffmpeg_writer_free(VideoWriter* writer)
 {
-    AVFormatContext *fmt_ctx = NULL;
-    AVStream *video_st = NULL;
-    AVCodecContext *codec_ctx = NULL;
-    const AVCodec *codec = NULL;
-    AVFrame *frame = NULL;
-    AVPacket *pkt = NULL;
-    struct SwsContext *sws_ctx = NULL;
-    int ret;
-
-    int width = video->w;
-    int height = video->h;
+    if (writer->sws_ctx)   sws_freeContext(writer->sws_ctx);
+    if (writer->frame_sws_ctx) sws_freeContext(writer->frame_sws_ctx);
+    if (writer->frame)     av_frame_free(&writer->frame);
+    if (writer->pkt)       av_packet_free(&writer->pkt);
+    if (writer->codec_ctx) avcodec_free_context(&writer->codec_ctx);
+    if (writer->fmt_ctx)
+    {
+        if (!(writer->fmt_ctx->oformat->flags & AVFMT_NOFILE) && writer->fmt_ctx->pb)
+            avio_closep(&writer->fmt_ctx->pb);
+        avformat_free_context(writer->fmt_ctx);
+    }
+
+    memset(writer, 0, sizeof(VideoWriter));
+}
+
+// thread_count is for the encoder, 0 picks one per core
+bool ffmpeg_writer_open(VideoWriter* writer, const char *filename, int width, int height, AVRational frame_rate, AVRational src_time_base, int thread_count = 0)
+{
+    memset(writer, 0, sizeof(VideoWriter));
+    writer->src_time_base = src_time_base;
+    writer->last_pts = AV_NOPTS_VALUE;
 
     // ---------------------------
     // Output format (MP4 / H264)
     // ---------------------------
-    avformat_alloc_output_context2(&fmt_ctx, NULL, "mp4", filename);
-    if (!fmt_ctx) {
-        fprintf(stderr, "Could not deduce output format\n");
+    avformat_alloc_output_context2(&writer->fmt_ctx, NULL, "mp4", filename);
+    if (!writer->fmt_ctx) {
+        LOGE("Could not deduce output format");
         return false;
     }
 
-    codec = avcodec_find_encoder_by_name("libx264");
+    const AVCodec *codec = avcodec_find_encoder_by_name("libx264");
 
     if (!codec)
     {
@@ -214,23 +415,24 @@ bool ffmpeg_encode(const char *filename, Video *video)
     }
 
     if (!codec) {
-        fprintf(stderr, "Encoder not found\n");
-        avformat_free_context(fmt_ctx);
+        LOGE("Encoder not found");
+        ffmpeg_writer_free(writer);
         return false;
     }
 
     // Add new video stream
-    video_st = avformat_new_stream(fmt_ctx, NULL);
-    if (!video_st) {
-        fprintf(stderr, "Could not create stream\n");
-        avformat_free_context(fmt_ctx);
+    writer->stream = avformat_new_stream(writer->fmt_ctx, NULL);
+    if (!writer->stream) {
+        LOGE("Could not create stream");
+        ffmpeg_writer_free(writer);
         return false;
     }
 
-    codec_ctx = avcodec_alloc_context3(codec);
+    AVCodecContext* codec_ctx = avcodec_alloc_context3(codec);
+    writer->codec_ctx = codec_ctx;
     if (!codec_ctx) {
-        fprintf(stderr, "Could not allocate codec context\n");
-        avformat_free_context(fmt_ctx);
+        LOGE("Could not allocate codec context");
+        ffmpeg_writer_free(writer);
         return false;
     }
 
@@ -239,151 +441,166 @@ bool ffmpeg_encode(const char *filename, Video *video)
     codec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
     codec_ctx->width = width;
     codec_ctx->height = height;
-    codec_ctx->time_base = (AVRational){1, 30};   // 30 fps
-    codec_ctx->framerate = (AVRational){30, 1};
+    codec_ctx->time_base = av_inv_q(frame_rate);
+    codec_ctx->framerate = frame_rate;
     codec_ctx->pix_fmt = AV_PIX_FMT_YUV420P;      // encoder wants YUV420P
     codec_ctx->gop_size = 12;
     codec_ctx->max_b_frames = 2;
-    codec_ctx->thread_count = 0; // 0 = auto-detect cores
+    codec_ctx->thread_count = thread_count; // 0 = auto-detect cores
     codec_ctx->thread_type  = FF_THREAD_FRAME | FF_THREAD_SLICE;
 
-    if (fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
+    if (writer->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER)
         codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
     AVDictionary *opts = NULL;
     av_dict_set(&opts, "preset", "superfast", 0);   // ultrafast, superfast, fast, medium, slow, placebo
     av_dict_set(&opts, "tune", "zerolatency", 0);
-    av_dict_set(&opts, "threads", "auto", 0);
+    if (thread_count == 0)
+        av_dict_set(&opts, "threads", "auto", 0);
 
     // Open encoder
-    if ((ret = avcodec_open2(codec_ctx, codec, &opts)) < 0) {
-        fprintf(stderr, "Could not open encoder\n");
-        avcodec_free_context(&codec_ctx);
-        avformat_free_context(fmt_ctx);
+    int ret = avcodec_open2(codec_ctx, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        LOGE("Could not open encoder");
+        ffmpeg_writer_free(writer);
         return false;
     }
 
     // Copy codec params to stream
-    ret = avcodec_parameters_from_context(video_st->codecpar, codec_ctx);
-    if (ret < 0) {
-        fprintf(stderr, "Could not copy codec parameters\n");
-        avcodec_free_context(&codec_ctx);
-        avformat_free_context(fmt_ctx);
+    if (avcodec_parameters_from_context(writer->stream->codecpar, codec_ctx) < 0) {
+        LOGE("Could not copy codec parameters");
+        ffmpeg_writer_free(writer);
         return false;
     }
+    writer->stream->time_base = codec_ctx->time_base;
 
     // Open output file
-    if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
-        if (avio_open(&fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0) {
-            fprintf(stderr, "Could not open output file '%s'\n", filename);
-            avcodec_free_context(&codec_ctx);
-            avformat_free_context(fmt_ctx);
+    if (!(writer->fmt_ctx->oformat->flags & AVFMT_NOFILE)) {
+        if (avio_open(&writer->fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0) {
+            LOGE("Could not open output file '%s'", filename);
+            ffmpeg_writer_free(writer);
             return false;
         }
     }
 
     // Write header
-    if (avformat_write_header(fmt_ctx, NULL) < 0) {
-        fprintf(stderr, "Error occurred writing header\n");
-        avio_close(fmt_ctx->pb);
-        avcodec_free_context(&codec_ctx);
-        avformat_free_context(fmt_ctx);
+    if (avformat_write_header(writer->fmt_ctx, NULL) < 0) {
+        LOGE("Error occurred writing header");
+        ffmpeg_writer_free(writer);
         return false;
     }
 
-    int rgb_stride;
-
     // Allocate frame + packet
-    frame = av_frame_alloc();
-    pkt = av_packet_alloc();
-    if (!frame || !pkt) {
-        fprintf(stderr, "Could not allocate frame/packet\n");
-        goto cleanup_encode;
+    writer->frame = av_frame_alloc();
+    writer->pkt = av_packet_alloc();
+    if (!writer->frame || !writer->pkt) {
+        LOGE("Could not allocate frame/packet");
+        ffmpeg_writer_free(writer);
+        return false;
     }
 
-    frame->format = codec_ctx->pix_fmt;
-    frame->width  = codec_ctx->width;
-    frame->height = codec_ctx->height;
-    if (av_frame_get_buffer(frame, 32) < 0) {
-        fprintf(stderr, "Could not allocate frame buffer\n");
-        goto cleanup_encode;
+    writer->frame->format = codec_ctx->pix_fmt;
+    writer->frame->width  = codec_ctx->width;
+    writer->frame->height = codec_ctx->height;
+    if (av_frame_get_buffer(writer->frame, 32) < 0) {
+        LOGE("Could not allocate frame buffer");
+        ffmpeg_writer_free(writer);
+        return false;
     }
 
     // SWS converter (RGB24 -> YUV420P)
-    sws_ctx = sws_getContext(width, height, AV_PIX_FMT_RGB24,
-                             width, height, codec_ctx->pix_fmt,
-                             SWS_BILINEAR, NULL, NULL, NULL);
-    if (!sws_ctx) {
-        fprintf(stderr, "Could not init sws context\n");
-        goto cleanup_encode;
+    writer->sws_ctx = sws_getContext(width, height, AV_PIX_FMT_RGB24,
+                                     width, height, codec_ctx->pix_fmt,
+                                     SWS_BILINEAR, NULL, NULL, NULL);
+    if (!writer->sws_ctx) {
+        LOGE("Could not init sws context");
+        ffmpeg_writer_free(writer);
+        return false;
     }
 
-    rgb_stride = width * 3;
-    for (int i = 0; i < video->frame_count; i++) {
-        const uint8_t *rgb_data[1] = { video->data + i * rgb_stride * height };
-        int rgb_linesize[1] = { rgb_stride };
+    return true;
+}
 
-        av_frame_make_writable(frame);
-        sws_scale(sws_ctx, rgb_data, rgb_linesize, 0, height, frame->data, frame->linesize);
+static bool ffmpeg_writer_send(VideoWriter* writer, AVFrame* frame, i64 pts)
+{
+    AVCodecContext* codec_ctx = writer->codec_ctx;
+
+    // Timestamp: rescale source pts to the encoder time base, the encoder
+    // rejects pts that don't strictly increase
+    i64 out_pts = (pts == AV_NOPTS_VALUE) ? writer->frames_in : av_rescale_q(pts, writer->src_time_base, codec_ctx->time_base);
+    if (writer->last_pts != AV_NOPTS_VALUE && out_pts <= writer->last_pts)
+        out_pts = writer->last_pts + 1;
+
+    frame->pts = out_pts;
+    if (writer->frames_in == 0)
+        writer->first_pts = out_pts;
+    writer->last_pts = out_pts;
+    writer->frames_in++;
+
+    if (avcodec_send_frame(codec_ctx, frame) < 0) {
+        LOGE("Error sending frame");
+        return false;
+    }
 
-        frame->pts = i;
+    return ffmpeg_writer_drain(writer);
+}
 
-        // Encode
-        ret = avcodec_send_frame(codec_ctx, frame);
-        if (ret < 0) {
-            fprintf(stderr, "Error sending frame\n");
-            goto cleanup_encode;
-        }
+// Encodes one RGB24 frame (w*h*3 bytes, tightly packed). pts is in the
+// src_time_base passed to ffmpeg_writer_open, AV_NOPTS_VALUE if unknown.
+bool ffmpeg_writer_write(VideoWriter* writer, const u8* rgb, i64 pts)
+{
+    AVCodecContext* codec_ctx = writer->codec_ctx;
 
-        while (ret >= 0) {
-            ret = avcodec_receive_packet(codec_ctx, pkt);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                break;
-            else if (ret < 0) {
-                fprintf(stderr, "Error encoding frame\n");
-                goto cleanup_encode;
-            }
+    const u8 *rgb_data[1] = { rgb };
+    int rgb_linesize[1] = { codec_ctx->width * 3 };
 
-            pkt->stream_index = video_st->index;
-            av_packet_rescale_ts(pkt, codec_ctx->time_base, video_st->time_base);
-            av_interleaved_write_frame(fmt_ctx, pkt);
-            av_packet_unref(pkt);
-        }
-    }
+    av_frame_make_writable(writer->frame);
+    sws_scale(writer->sws_ctx, rgb_data, rgb_linesize, 0, codec_ctx->height, writer->frame->data, writer->frame->linesize);
 
-    // Flush encoder
-    avcodec_send_frame(codec_ctx, NULL);
-    while (avcodec_receive_packet(codec_ctx, pkt) == 0) {
-        pkt->stream_index = video_st->index;
-        av_packet_rescale_ts(pkt, codec_ctx->time_base, video_st->time_base);
-        av_interleaved_write_frame(fmt_ctx, pkt);
-        av_packet_unref(pkt);
+    return ffmpeg_writer_send(writer, writer->frame, pts);
+}
+
+// Encodes a decoded frame as is. Frames that already match the encoder's
+// pixel format and size skip the colour conversion entirely.
+bool ffmpeg_writer_write_frame(VideoWriter* writer, AVFrame* frame)
+{
+    AVCodecContext* codec_ctx = writer->codec_ctx;
+    i64 pts = frame->best_effort_timestamp;
+
+    if (frame->format == codec_ctx->pix_fmt && frame->width == codec_ctx->width && frame->height == codec_ctx->height)
+    {
+        // don't let the decoder's frame types force key frames in the output
+        frame->pict_type = AV_PICTURE_TYPE_NONE;
+        return ffmpeg_writer_send(writer, frame, pts);
     }
 
-    // Write trailer
-    av_write_trailer(fmt_ctx);
+    writer->frame_sws_ctx = sws_getCachedContext(writer->frame_sws_ctx, frame->width, frame->height, (enum AVPixelFormat)frame->format,
+                                                 codec_ctx->width, codec_ctx->height, codec_ctx->pix_fmt,
+                                                 SWS_BILINEAR, NULL, NULL, NULL);
+    if (!writer->frame_sws_ctx) {
+        LOGE("Could not init sws context");
+        return false;
+    }
 
-    // Cleanup
-    sws_freeContext(sws_ctx);
-    av_frame_free(&frame);
-    av_packet_free(&pkt);
-    avcodec_free_context(&codec_ctx);
-    if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE))
-        avio_close(fmt_ctx->pb);
-    avformat_free_context(fmt_ctx);
+    av_frame_make_writable(writer->frame);
+    sws_scale(writer->frame_sws_ctx, (const u8 *const *)frame->data, frame->linesize, 0, frame->height, writer->frame->data, writer->frame->linesize);
 
-    return true;
+    return ffmpeg_writer_send(writer, writer->frame, pts);
+}
 
-cleanup_encode:
+// Flushes the encoder, writes the trailer and frees the writer
+bool ffmpeg_writer_close(VideoWriter* writer)
+{
+    avcodec_send_frame(writer->codec_ctx, NULL);
+    bool ok = ffmpeg_writer_drain(writer);
 
-    if (sws_ctx) sws_freeContext(sws_ctx);
-    if (frame) av_frame_free(&frame);
-    if (pkt) av_packet_free(&pkt);
-    if (codec_ctx) avcodec_free_context(&codec_ctx);
-    if (fmt_ctx) {
-        if (!(fmt_ctx->oformat->flags & AVFMT_NOFILE) && fmt_ctx->pb)
-            avio_close(fmt_ctx->pb);
-        avformat_free_context(fmt_ctx);
+    if (av_write_trailer(writer->fmt_ctx) < 0)
+    {
+        LOGE("Error writing trailer");
+        ok = false;
     }
-    return false;
+
+    ffmpeg_writer_free(writer);
+    return ok;
 }
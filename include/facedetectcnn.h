@@ -46,10 +46,80 @@ the use of this software, even if advised of the possibility of such damage.
 
 
 FACEDETECTION_EXPORT int * facedetect_cnn(unsigned char * result_buffer, //buffer memory for storing face detection results, !!its size must be 0x20000 Bytes!!
-                    unsigned char * rgb_image_data, int width, int height, int step); //input image, it must be BGR (three channels) insteed of RGB image!
-
+                    unsigned char * rgb_image_data, int width, int height, int step); //input image, it must be BGR (three channels), or RGB with facedetect_set_rgb()
+
+//Faces at least this wide are found by the stride 16 and 32 heads alone,
+//measured on the assets scaled from 0.15x to 2x (the widest face only the
+//stride 8 head found was 73 pixels).
+#define STRIDE8_MAX_FACE 96
+
+//facedetect_cnn() for when faces narrower than min_face pixels (in this image)
+//aren't needed. The stride 8 branch of the network, the most expensive one,
+//is skipped when it could only find faces that small. Smaller faces may still
+//be returned by the other branches.
+FACEDETECTION_EXPORT int * facedetect_cnn_min_face(unsigned char * result_buffer, unsigned char * rgb_image_data,
+                    int width, int height, int step, int min_face);
+
+//runs facedetect_cnn() on count images of the same size at once, layer by layer across the batch,
+//and writes each image's faces to its own buffer. Returns the number of images processed.
+FACEDETECTION_EXPORT int facedetect_cnn_batch(unsigned char ** result_buffers, //count buffers, !!each of them must be 0x9000 Bytes!!
+                    unsigned char ** rgb_images_data, int count, int width, int height, int step); //input images, they must be BGR (or RGB, see facedetect_set_rgb()) with the same size and step
+
+//picks the network build for the best instruction set the CPU supports,
+//or the one forced with facedetect_set_isa(), and loads the model into it
 FACEDETECTION_EXPORT void facedetect_init();
 
+//forces the network build to use, "generic", "avx2", "avx512" or "avx512vnni".
+//Call before facedetect_init(). Returns false if that build isn't in the
+//binary or the CPU doesn't support it.
+FACEDETECTION_EXPORT bool facedetect_set_isa(const char * isa);
+
+//name of the network build facedetect_init() picked
+FACEDETECTION_EXPORT const char * facedetect_get_isa();
+
+//runs task(arg, i) for every i in [0, count), on other threads if it can,
+//and returns once all of them are done
+typedef void (*facedetect_task_func)(void * arg, int index);
+typedef void (*facedetect_parallel_func)(void * ctx, facedetect_task_func task, void * arg, int count);
+
+//lets every layer split its rows into up to threads tasks run through parallel.
+//Layers with too little work per task stay on the calling thread. NULL turns it off.
+FACEDETECTION_EXPORT void facedetect_set_parallel(facedetect_parallel_func parallel, void * ctx, int threads);
+
+//runs the 1x1 point wise layers (all but the first) with 8-bit activations
+//and weights instead of float, see quantizeFilters()
+FACEDETECTION_EXPORT void facedetect_set_int8(bool enable);
+
+//stores the activations between the layers as FP16 and converts them to
+//float in registers inside the layers, halving the memory they go through.
+//Meant for the avx2 and avx512 builds (F16C), the generic one converts in software.
+FACEDETECTION_EXPORT void facedetect_set_fp16(bool enable);
+
+//takes the images as RGB instead of BGR. The channel swap is folded into
+//the first layer's weights once, the images are read as they are.
+FACEDETECTION_EXPORT void facedetect_set_rgb(bool enable);
+
+//runs the first layers on horizontal strips of the image, one strip through
+//all of them at a time, instead of one layer over the whole image at a time.
+//The strips' activations stay in cache, at the cost of computing the rows
+//where they meet twice. The faces found are the same.
+FACEDETECTION_EXPORT void facedetect_set_depth_first(bool enable);
+
+//measures the activation ranges of the int8 layers on an image and widens
+//the calibrated ranges to cover it. Call before detecting, from one thread.
+FACEDETECTION_EXPORT void facedetect_calibrate_int8(unsigned char * rgb_image_data, int width, int height, int step);
+
+//uses the weights in a model file instead of the ones built in. The file is
+//mapped read only and the layers point into it, so processes loading the same
+//file share its pages. A build the file has no tables for builds its layers
+//from the plain weights in it, on the heap. Call before facedetect_init().
+//Returns false if the file can't be read or doesn't fit the network.
+FACEDETECTION_EXPORT bool facedetect_load_model(const char * path);
+
+//writes the built in weights as a model file, with the tables of every
+//build this CPU can run
+FACEDETECTION_EXPORT bool facedetect_save_model(const char * path);
+
 /*
 DO NOT EDIT the following code if you don't really understand it.
 */
@@ -65,7 +135,9 @@ DO NOT EDIT the following code if you don't really understand it.
 //and then use INT8*INT8 dot product
 #define _MAX_UINT8_VALUE 127
 #else
-#define _MAX_UINT8_VALUE 255
+//maddubs adds two UINT8*INT8 products in 16 bits, which
+//only fits without saturating if the inputs are in [0, 127]
+#define _MAX_UINT8_VALUE 127
 #endif
 
 #if defined(_ENABLE_AVX512) 
@@ -96,10 +168,6 @@ DO NOT EDIT the following code if you don't really understand it.
 #include <iostream>
 #include <typeinfo>
 
-void* myAlloc(size_t size);
-void myFree_(void* ptr);
-#define myFree(ptr) (myFree_(*(ptr)), *(ptr)=0);
-
 #ifndef MIN
 #  define MIN(a,b)  ((a) > (b) ? (b) : (a))
 #endif
@@ -128,6 +196,163 @@ typedef struct ConvInfoStruct_ {
     float* pBiases;
 }ConvInfoStruct;
 
+//model file, see facedetect_load_model(). Native byte order. The header is
+//followed by a ModelFileLayer per layer and a ModelFileBuild per network
+//build it was saved with. Every blob starts on FACEDETECT_MODEL_ALIGN bytes.
+//The rows of the layers' weights and biases are padded to it with zeros,
+//the blobs of a build are laid out the way its kernels read them.
+#define FACEDETECT_MODEL_MAGIC   0x4e434446 // "FDCN"
+#define FACEDETECT_MODEL_VERSION 2 //bump it when a build's tables change layout
+#define FACEDETECT_MODEL_ALIGN   64
+
+typedef struct ModelFileHeader_ {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int num_layers;
+    unsigned int num_builds;
+}ModelFileHeader;
+
+typedef struct ModelFileLayer_ {
+    int channels;
+    int num_filters;
+    int is_depthwise;
+    int is_pointwise;
+    int with_relu;
+    int weight_step; //bytes per row of weights
+    int bias_step;   //bytes of the row of biases
+    float act_max;   //int8 range of the input, 0 keeps the layer in float
+    unsigned long long weights_offset; //num_filters rows (9 if depth wise) of channels floats
+    unsigned long long biases_offset;  //a row of num_filters floats
+}ModelFileLayer;
+
+//a PackedBlob in a model file, offset is from the start of the file
+typedef struct ModelFileBlob_ {
+    unsigned long long offset;
+    int rows;
+    int cols;
+    int channels;
+    int channelStep;
+}ModelFileBlob;
+
+//a PackedFilters in a model file
+typedef struct ModelFileFilters_ {
+    ModelFileBlob weights;
+    ModelFileBlob biases;
+    ModelFileBlob weights_p;
+    ModelFileBlob weights_q;
+    ModelFileBlob scales_q;
+    ModelFileBlob biases_q;
+    int has_int8;
+    float act_max;
+}ModelFileFilters;
+
+//the layers of one network build as init_parameters() leaves them
+typedef struct ModelFileBuild_ {
+    char name[16];                     //FaceDetectKernels::name
+    unsigned long long filters_offset; //a ModelFileFilters per layer, the first one is empty
+}ModelFileBuild;
+
+//the model file facedetect_load_model() mapped, shared by all the builds
+typedef struct FaceDetectModelFile_ {
+    const unsigned char * data;
+    size_t size;
+    const ModelFileLayer * layers;
+    int num_layers;
+    const ModelFileBuild * builds;
+    int num_builds;
+}FaceDetectModelFile;
+
+//a blob of a layer in the weight tables packed at build time, see
+//facedetectcnn-pack.cpp. channelStep is 0 if the layer doesn't have it.
+typedef struct PackedBlob_ {
+    size_t offset; //in bytes, into PackedModel::data
+    int rows;
+    int cols;
+    int channels;
+    int channelStep;
+}PackedBlob;
+
+//the blobs of a layer as init_parameters() leaves them
+typedef struct PackedFilters_ {
+    PackedBlob weights;
+    PackedBlob biases;
+    PackedBlob weights_p;
+    PackedBlob weights_q;
+    PackedBlob scales_q;
+    PackedBlob biases_q;
+    bool has_int8;
+    float act_max;
+}PackedFilters;
+
+//all the layers of one network build, data is NULL if it wasn't packed
+typedef struct PackedModel_ {
+    unsigned char * data;
+    size_t size;
+    const PackedFilters * filters;
+    int num_filters;
+}PackedModel;
+
+//one build of the network, compiled for an instruction set
+//in its own namespace, see facedetect_init()
+typedef struct FaceDetectKernels_ {
+    const char * name;
+    bool (*supported)(); //by the CPU running it
+    void (*init)();
+    std::vector<std::vector<FaceRect>> (*detect)(unsigned char ** rgbImageData, int count, int width, int height, int step, int min_face);
+    void (*set_int8)(bool enable);
+    void (*set_fp16)(bool enable);
+    void (*set_rgb)(bool enable);
+    void (*set_depth_first)(bool enable);
+    void (*calibrate_int8)(unsigned char * rgbImageData, int width, int height, int step);
+    void (*pack)(std::vector<unsigned char> & data, std::vector<PackedFilters> & filters); //see packParameters()
+}FaceDetectKernels;
+
+//set by facedetect_set_parallel(), shared by all the builds
+typedef struct FaceDetectParallel_ {
+    facedetect_parallel_func func;
+    void * ctx;
+    int threads;
+}FaceDetectParallel;
+
+extern FaceDetectParallel g_facedetectParallel;
+extern FaceDetectModelFile g_facedetectModelFile;
+
+//namespace of the network build in this translation unit, the
+//facedetectcnn-<isa>.cpp files set it before including the sources
+#ifndef FACEDETECT_ISA
+#define FACEDETECT_ISA generic
+#define FACEDETECT_ISA_GENERIC //also holds the exported functions
+#endif
+
+namespace FACEDETECT_ISA {
+
+extern const FaceDetectKernels kernels;
+
+//IEEE half precision, storage only
+typedef unsigned short fp16_t;
+
+void* myAlloc(size_t size);
+void myFree_(void* ptr);
+#define myFree(ptr) (myFree_(*(ptr)), *(ptr)=0);
+
+//memory of the data blobs, served from the calling thread's inference
+//workspace (see workspaceBegin) while one is active, from myAlloc otherwise
+void* blobAlloc(size_t size);
+void blobFree(void* ptr);
+
+//the blobs created between these two calls get preplanned slots in one
+//buffer per thread and nesting depth, the plan is made on the first run at
+//a given input size and kept for the last few sizes. Calls nest, a run
+//started on a thread that is inside another one gets its own workspace.
+void workspaceBegin(int width, int height, int count);
+void workspaceEnd();
+
+class CWorkspaceScope
+{
+public:
+    CWorkspaceScope(int width, int height, int count) { workspaceBegin(width, height, count); }
+    ~CWorkspaceScope() { workspaceEnd(); }
+};
 
 
 template <typename T>
@@ -151,9 +376,9 @@ public:
 	CDataBlob(int r, int c, int ch)
 	{
         data = nullptr;
+        //not zeroed, the layers write every element they read back
+        //and call setZero() themselves when they accumulate
         create(r, c, ch);
-        //#warning "confirm later"
-        setZero();
 	}
 	~CDataBlob()
 	{
@@ -178,7 +403,7 @@ public:
     void setNULL()
     {
         if (data)
-            myFree(&data);
+            blobFree(data);
         rows = cols = channels = channelStep = 0;
         data = nullptr;
     }
@@ -208,7 +433,7 @@ public:
             this->channelStep = channels * sizeof(T);
         else
             this->channelStep = (channels * sizeof(T)) + (_MALLOC_ALIGN / 8) - remBytes;
-        data = (T*)myAlloc(size_t(rows) * cols * this->channelStep);
+        data = (T*)blobAlloc(size_t(rows) * cols * this->channelStep);
 
         if (data == nullptr)
         {
@@ -348,6 +573,18 @@ class Filters{
     bool with_relu;
     CDataBlob<T> weights;
     CDataBlob<T> biases;
+    CDataBlob<T> weights_p; //1x1 point wise weights packed as channels x num_filters, see packFilters()
+
+    //int8 version of a 1x1 point wise layer, see quantizeFilters()
+    bool has_int8;
+    float act_max;                   //calibrated range of the input activations
+    CDataBlob<signed char> weights_q; //(channels/4) x (num_filters padded to 16) x 4
+    CDataBlob<float> scales_q;       //per filter, int32 sum -> float
+    CDataBlob<float> biases_q;       //biases padded like weights_q
+
+    //zero skipping version of a 1x1 point wise layer, see sparsifyFilters()
+    bool use_sparse;                 //faster than the dense tiles for this layer on this CPU
+    CDataBlob<unsigned int> live_s;  //bit ch%32 of word ch/32 set if input channel ch has non zero weights
 
     Filters()
     {
@@ -356,6 +593,9 @@ class Filters{
         is_depthwise = false;
         is_pointwise = false;
         with_relu = true;
+        has_int8 = false;
+        act_max = 0.f;
+        use_sparse = false;
     }
 
     Filters & operator=(ConvInfoStruct & convinfo)
@@ -406,37 +646,44 @@ class Filters{
 
 };
 
+bool packFilters(Filters<float> & filters);
+void addStaticData(const void * data, size_t size);
+void packParameters(std::vector<unsigned char> & data, std::vector<PackedFilters> & filters);
+bool quantizeFilters(Filters<float> & filters, float act_max);
+bool sparsifyFilters(Filters<float> & filters, float zeros);
+void setInt8(bool enable);
+void setCalibrating(bool enable);
+
 std::vector<FaceRect> objectdetect_cnn(const unsigned char* rgbImageData, int with, int height, int step);
+std::vector<std::vector<FaceRect>> objectdetect_cnn_batch(unsigned char ** rgbImageData, int count, int width, int height, int step, int min_face = 0);
 
-CDataBlob<float> setDataFrom3x3S2P1to1x1S1P0FromImage(const unsigned char* inputData, int imgWidth, int imgHeight, int imgChannels, int imgWidthStep, int padDivisor=32);
+CDataBlob<float> convolution3x3S2FromImage(const unsigned char* inputData, int imgWidth, int imgHeight, int imgChannels, int imgWidthStep,
+                const Filters<float>& filters, bool do_relu = true, int padDivisor=32);
 CDataBlob<float> convolution(const CDataBlob<float>& inputData, const Filters<float>& filters, bool do_relu = true);
-CDataBlob<float> convolutionDP(const CDataBlob<float>& inputData, 
+
+//the layers between the first and the heads take and return float or fp16_t blobs
+template<typename TO, typename TI>
+CDataBlob<TO> convolutionDP(const CDataBlob<TI>& inputData, 
                 const Filters<float>& filtersP, const Filters<float>& filtersD, bool do_relu = true);
-CDataBlob<float> convolution4layerUnit(const CDataBlob<float>& inputData, 
+template<typename T>
+CDataBlob<T> convolution4layerUnit(const CDataBlob<T>& inputData, 
                 const Filters<float>& filtersP1, const Filters<float>& filtersD1, 
                 const Filters<float>& filtersP2, const Filters<float>& filtersD2, bool do_relu = true);
 CDataBlob<float> maxpooling2x2S2(const CDataBlob<float>& inputData);
-
-CDataBlob<float> elementAdd(const CDataBlob<float>& inputData1, const CDataBlob<float>& inputData2);
-CDataBlob<float> upsampleX2(const CDataBlob<float>& inputData);
-
-CDataBlob<float> meshgrid(int feature_width, int feature_height, int stride, float offset=0.0f);
-
-// TODO implement in SIMD
-void bbox_decode(CDataBlob<float>& bbox_pred, const CDataBlob<float>& priors, int stride);
-void kps_decode(CDataBlob<float>& bbox_pred, const CDataBlob<float>& priors, int stride);
+CDataBlob<fp16_t> maxpooling2x2S2(const CDataBlob<fp16_t>& inputData);
 
 template<typename T>
-CDataBlob<T> blob2vector(const CDataBlob<T> &inputData);
-
+CDataBlob<T> elementAdd(const CDataBlob<T>& inputData1, const CDataBlob<T>& inputData2);
 template<typename T>
-CDataBlob<T> concat3(const CDataBlob<T>& inputData1, const CDataBlob<T>& inputData2, const CDataBlob<T>& inputData3);
-
-// TODO implement in SIMD
-void sigmoid(CDataBlob<float>& inputData);
-
-std::vector<FaceRect> detection_output(const CDataBlob<float>& cls,
-                const CDataBlob<float>& reg,
-                const CDataBlob<float>& kps,
-                const CDataBlob<float>& obj,
+CDataBlob<T> upsampleX2(const CDataBlob<T>& inputData);
+
+//scores the anchors of the heads in place, decodes the ones reaching
+//confidence_threshold and runs NMS on them
+std::vector<FaceRect> detection_output(const CDataBlob<float> * cls[],
+                const CDataBlob<float> * reg[],
+                const CDataBlob<float> * kps[],
+                const CDataBlob<float> * obj[],
+                const int strides[], int num_heads,
                 float overlap_threshold, float confidence_threshold, int top_k, int keep_top_k);
+
+} //namespace FACEDETECT_ISA
@@ -2,9 +2,14 @@
 #include <pthread.h>
 
 #include "base.h"
+#include "cache.h"
 #include "platform.h"
 #include "detect.h"
 #include "ffmpeg.h"
+#include "pipeline.h"
+#include "segment.h"
+#include "smart.h"
+#include "threadpool.h"
 #include "transform.h"
 #include "util.h"
 
@@ -12,23 +17,24 @@
 //
 // [x] Add scramble transform
 // [ ] Add padding to sub-images
-// [ ] Add blur transform
+// [x] Add blur transform
 // [x] Add image scaling function
 // [ ] Add lots of test images and --tester mode
-// [ ] Implement thread pool (spin-lock)
-// [ ] Open a video file and read image frames
-// [ ] Write output video file
+// [x] Implement thread pool (spin-lock)
+// [x] Open a video file and read image frames
+// [x] Write output video file
 
 Arena* scratch = {0};
 Arena* thread_arenas[MAX_ARENAS] = {0};
 Timer timer = {0};
 ProgramSettings settings = {};
-pthread_t *threads = NULL;
+ThreadPool thread_pool = {};
 Image texture_image = {};
 
 bool init(int argc, char **args);
 bool parse_args(ProgramSettings* settings, int argc, char* argv[]);
 int process_image(Image* image,Rect* ret_rects);
+int detect_image(Image* image, Rect* rects);
 int handle_image();
 int handle_video();
 
@@ -87,9 +93,6 @@ int main(int argc, char** args)
         }
     }
 
-    // initialize threads
-    threads = (pthread_t *)calloc(settings.thread_count,sizeof(pthread_t));
-
     if(settings.has_texture)
     {
         bool loaded = util_load_image(settings.texture_image_path, &texture_image);
@@ -109,9 +112,52 @@ int main(int argc, char** args)
         handle_video();
     }
 
+    threadpool_destroy(&thread_pool);
+
     return 0;
 }
 
+// Downscales, detects and maps the rects back to image's size
+int detect_image(Image* image, Rect* rects)
+{
+    Image image_scaled = {};
+    const int scaled_size = DETECT_SCALED_SIZE;
+    bool use_scaled_image = false;
+
+    if(!settings.no_scale)
+    {
+        double t0 = timer_get_time();
+        use_scaled_image = transform_downscale(NULL, image,&image_scaled,scaled_size);   
+        double elapsed = timer_get_time() - t0;
+        LOGI("Downscale took %.3f ms", elapsed*1000.0);
+    }
+
+    image->min_face = settings.min_face;
+    if(use_scaled_image)
+        image_scaled.min_face = settings.min_face * image_scaled.w / image->w;
+
+    //util_write_output(&image_scaled, "output/out_scaled.png");
+
+    int num_rects = use_scaled_image ? process_image(&image_scaled, rects) : process_image(image, rects);
+    LOGI("Found %d rects", num_rects);
+
+    if(use_scaled_image)
+    {
+        // correct rects positions / sizes
+        const float scale = image->w > image->h ? image->w / (float)image_scaled.w : image->h / (float)image_scaled.h;
+        for(int i = 0; i < num_rects; ++i)
+        {
+            Rect* r = &rects[i];
+            r->x = (u16)round(r->x * scale);
+            r->y = (u16)round(r->y * scale);
+            r->w = (u16)round(r->w * scale);
+            r->h = (u16)round(r->h * scale);
+        }
+    }
+
+    return num_rects;
+}
+
 int handle_image()
 {
     Image image = {};
@@ -126,37 +172,31 @@ int handle_image()
         bool loaded = util_load_image(infile.data, &image);
         if(!loaded) return 1;
 
-        Image image_scaled = {};
-        const int scaled_size = 640;
-        bool use_scaled_image = false;
+        Rect rects[256] = {0};
+        int num_rects = 0;
+
+        // rects from an earlier run with the same detector settings
+        VideoDetections detections = {};
+        CacheKey cache = {};
+        bool has_key = cache_key(infile.data, TYPE_IMAGE, &cache);
+        bool cached = has_key && cache_load(infile.data, &cache, &detections) && detections.frame_count == 1;
 
-        if(!settings.no_scale)
+        if(cached)
         {
-            double t0 = timer_get_time();
-            use_scaled_image = transform_downscale(NULL, &image,&image_scaled,scaled_size);   
-            double elapsed = timer_get_time() - t0;
-            LOGI("Downscale took %.3f ms", elapsed*1000.0);
+            num_rects = MIN(detections.frames[0].num_rects, 256);
+            memcpy(rects, detections.rects, num_rects*sizeof(Rect));
         }
-
-        //util_write_output(&image_scaled, "output/out_scaled.png");
-
-        Rect rects[256] = {0};
-        int num_rects = use_scaled_image ? process_image(&image_scaled, rects) : process_image(&image, rects);
-        LOGI("Found %d rects", num_rects);
-
-        if(use_scaled_image)
+        else
         {
-            // correct rects positions / sizes
-            const float scale = image.w > image.h ? image.w / (float)image_scaled.w : image.h / (float)image_scaled.h;
-            for(int i = 0; i < num_rects; ++i)
+            num_rects = detect_image(&image, rects);
+
+            if(has_key)
             {
-                Rect* r = &rects[i];
-                r->x = (u16)round(r->x * scale);
-                r->y = (u16)round(r->y * scale);
-                r->w = (u16)round(r->w * scale);
-                r->h = (u16)round(r->h * scale);
+                video_detections_add(&detections, 0, rects, num_rects);
+                cache_save(infile.data, &cache, &detections);
             }
         }
+        video_detections_free(&detections);
 
         for(int i = 0; i < settings.transform_count; ++i)
         {
@@ -186,205 +226,65 @@ int handle_video()
     double t0 = timer_get_time();
 
     LOGI("Decoding video file %s", settings.input_file_text);
-    
-    // decode video file
-    Video vid = {};
-    bool decoded = ffmpeg_decode(settings.input_file_text, &vid);
 
-    if(!decoded)
+    VideoReader reader = {};
+    if(!ffmpeg_reader_open(&reader, settings.input_file_text))
     {
-        LOGE("Failed to decode video %s", "");
+        LOGE("Failed to decode video %s", settings.input_file_text);
         return 1;
     }
 
-    Arena *arena_results = arena_create(ARENA_SIZE_MEDIUM);
+    // rects from an earlier run with the same detector settings
+    VideoDetections detections = {};
+    CacheKey cache = {};
+    bool has_key = cache_key(settings.input_file_text, TYPE_VIDEO, &cache);
+    bool cached = has_key && cache_load(settings.input_file_text, &cache, &detections);
 
-    double elapsed = timer_get_time() - t0;
-    LOGI("Decode took %.3f ms (frame count: %d), output: %p", elapsed*1000.0, vid.frame_count, vid.data);
-
-    Image* images = (Image*)calloc(settings.thread_count, sizeof(Image));
-    Image* images_scaled = (Image*)calloc(settings.thread_count, sizeof(Image));
-
-    bool use_scaled[settings.thread_count] = {};
-
-    u8 detect_buffers[settings.thread_count][0x9000] = {0};
+    int frame_count = 0;
+    bool encoded = true;
 
-    u32 output_count = 0;
-    u8* output_ptrs[MAX_FRAMES] = {};
-
-    // run detections
-    int frame_counter = 0;
-
-    int actual_thread_count;
-
-    for(;;)
+    if(settings.smart_render && smart_render_supported(&reader))
     {
-        if(frame_counter >= vid.frame_count)
-             break;
-
-        for(int i = 0; i < settings.thread_count; ++i)
-        {
-            memset(&images_scaled[i], 0, sizeof(Image));
-            use_scaled[i] = false;
-        }
-
-        actual_thread_count = 0;
-
-        // Create threads
-        for(int i = 0; i < settings.thread_count; ++i)
-        {
-            Arena* arena = thread_arenas[actual_thread_count];
-            pthread_t* thread = &threads[actual_thread_count];
-
-            Image* image = &images[actual_thread_count];
-            Image* image_scaled = &images_scaled[actual_thread_count];
-
-            // reset arena
-            arena_reset(arena);
-
-            // fill out the image object
-            image->detect_buffer = detect_buffers[actual_thread_count];
-            image->frame_number = frame_counter;
-            image->data = &vid.data[(u64)frame_counter*vid.w*vid.h*3];
-            image->w = vid.w;
-            image->h = vid.h;
-            image->n = 3;
-            image->step = 3*image->w;
-            image->arena = arena;
-
-            frame_counter++;
-            
-            if(!settings.no_scale)
-            {
-                 // Scale down image
-                use_scaled[actual_thread_count] = transform_downscale(arena, image,image_scaled,640);
-            }
-
-            // start detection thread
-            if(pthread_create(thread, NULL, detect_faces, (void*)(use_scaled[i] ? image_scaled : image)) == 0)
-            {
-                actual_thread_count++;
-            }
-            else
-            {
-                LOGW("Failed to start thread");
-            }
-        }
-        
-        // join all threads back
-        for(int i = 0; i < settings.thread_count; ++i)
-        {
-            pthread_join(threads[i], NULL);
-        }
-        
-        // Gather results
-        int num_faces = 0;
-
-        for(int i = 0; i < actual_thread_count; ++i)
-        {
-            Image* image = use_scaled[i] ? &images_scaled[i] : &images[i];
-            num_faces = 0;
-
-            if(image && image->result)
-            {
-                u8* ret_rects = image->result;
-
-                int offset = 0;
-                int _faces_found = *((int*)(ret_rects));
-                offset += sizeof(int);
-
-                output_ptrs[image->frame_number] = (u8 *)arena_alloc(arena_results, sizeof(u32)+(_faces_found*sizeof(Rect)));
-
-                for(int j = 0; j < _faces_found; ++j)
-                {
-                    Rect* r = (Rect*)(ret_rects+offset);
-                    if(r->confidence < settings.confidence_threshold) // filter out low-confidence regions
-                        continue;
-
-                    if(use_scaled[i])
-                    {
-                        float scale = vid.w > vid.h ? vid.w / (float)image->w : vid.h / (float)image->h;
-                        scale *= 1.15;
-                        printf("scale: %f\n", scale);
-                        printf("r_before: %u %u %u %u\n", r->x, r->y, r->w, r->h);
-
-                        r->x = (u16)round(r->x * scale);
-                        r->y = (u16)round(r->y * scale);
-                        r->w = (u16)round(r->w * scale);
-                        r->h = (u16)round(r->h * scale);
-
-                        printf("r_after: %u %u %u %u\n", r->x, r->y, r->w, r->h);
-                    }
-
-                    // make sure rectangles are within bounds of image
-                    if(r->x >= image->w || r->y >= image->h) continue;
-
-                    if(r->x + r->w > image->w) r->w = MAX(0, image->w - r->x - 1);
-                    if(r->y + r->h > image->h) r->h = MAX(0, image->h - r->y - 1);
-
-                    memcpy(output_ptrs[image->frame_number]+offset, r, sizeof(Rect));
-                    offset += sizeof(Rect);
-                    num_faces++;
-                }
-
-                memcpy(output_ptrs[image->frame_number], &num_faces, sizeof(u32));
-                output_count += num_faces;
-            }
-        }
-
-        LOGI("[Frame %d]: num_faces: %d", frame_counter, num_faces);
+        frame_count = smart_render(&reader, settings.input_file_text, "output/out.mp4", &detections);
+        ffmpeg_reader_close(&reader);
     }
-
-    frame_counter = 0;
-
-    LOGI("Applying transformation...");
-    for(int i = 0; i < vid.frame_count; ++i)
+    else if(settings.segment_count > 1)
     {
-        // Get frame
-        Image image = {};
-
-        image.frame_number = frame_counter;
-        image.data = &vid.data[(u64)frame_counter*vid.w*vid.h*3];
-        image.w = vid.w;
-        image.h = vid.h;
-        image.n = 3;
-        image.step = 3*image.w;
-
-        // Get Rects
-        u8 *ptr = output_ptrs[frame_counter++];
+        ffmpeg_reader_close(&reader);
+        frame_count = segments_run(settings.input_file_text, "output/out.mp4", settings.segment_count, &detections);
+    }
+    else
+    {
+        if(settings.smart_render)
+            LOGW("Re-encoding every frame instead");
 
-        if(!ptr)
+        VideoWriter writer = {};
+        if(!ffmpeg_writer_open(&writer, "output/out.mp4", reader.w, reader.h, reader.frame_rate, reader.time_base))
         {
-            LOGW("No output at this frame");
-            continue;
+            LOGE("Failed to write output file");
+            ffmpeg_reader_close(&reader);
+            video_detections_free(&detections);
+            return 1;
         }
 
-        u32 num_rects = 0;
-        memcpy((u8*)&num_rects, ptr, sizeof(u32));
-        ptr += sizeof(u32);
-        Rect *rects = (Rect *)(ptr); 
+        frame_count = pipeline_run(&reader, &writer, cached ? NULL : &detections, cached ? &detections : NULL);
 
-        // Apply transformations
-        for(int j = 0; j < settings.transform_count; ++j)
-        {
-            Transform* t = &settings.transforms[j];
-            transform_apply(&image, num_rects, rects,t->type);
-        }
+        encoded = ffmpeg_writer_close(&writer);
+        ffmpeg_reader_close(&reader);
     }
 
-    LOGI("Transformations done!");
+    if(frame_count >= 0 && has_key && !cached)
+        cache_save(settings.input_file_text, &cache, &detections);
+    video_detections_free(&detections);
 
-    // Encode output video
-    double _t0 = timer_get_time();
-    bool encoded = ffmpeg_encode("output/out.mp4", &vid);
-    if(!encoded)
+    if(frame_count < 0 || !encoded)
     {
         LOGE("Failed to write output file");
         return 1;
     }
 
-    double _elapsed = timer_get_time() - _t0;
-    LOGI("Encode took %.3f ms", _elapsed*1000.0);
+    double elapsed = timer_get_time() - t0;
+    LOGI("Processed %d frames in %.3f ms", frame_count, elapsed*1000.0);
 
     LOGI("Complete!");
 
@@ -411,12 +311,25 @@ bool init(int argc, char **args)
     settings.nms_iou_threshold = 0.6;
     settings.has_texture = false;
     settings.no_scale = false;
+    settings.smart_render = false;
+    settings.detect_interval = 1;
+    settings.track_max_age = 15;
+    settings.segment_count = 1;
+    settings.roi_interval = 1;
+    settings.min_face = 0;
+    settings.int8 = false;
+    settings.fp16 = false;
+    settings.depth_first = false;
+    settings.isa[0] = '\0';
+    settings.model_path[0] = '\0';
     settings.block_scale = 0.20;
     settings.input_file_count = 0;
 
     bool parse = parse_args(&settings, argc, args);
     if(!parse) return false;
 
+    settings.thread_count = MIN(settings.thread_count, MAX_ARENAS);
+
     // print settings
     LOGI("--- Settings ---");
     LOGI("  Thread Count: %d", settings.thread_count);
@@ -424,6 +337,17 @@ bool init(int argc, char **args)
     LOGI("  NMS IOU Threshold: %f", settings.nms_iou_threshold);
     LOGI("  Texture: %s", settings.has_texture ? settings.texture_image_path : "(None)");
     LOGI("  Block Scale: %f", settings.block_scale);
+    LOGI("  Smart Render: %s", settings.smart_render ? "ON" : "OFF");
+    LOGI("  Detect Interval: %d", settings.detect_interval);
+    LOGI("  Track Max Age: %d", settings.track_max_age);
+    LOGI("  Segments: %d", settings.segment_count);
+    LOGI("  ROI Interval: %d", settings.roi_interval);
+    LOGI("  Min Face: %d", settings.min_face);
+    LOGI("  INT8: %s", settings.int8 ? "ON" : "OFF");
+    LOGI("  FP16: %s", settings.fp16 ? "ON" : "OFF");
+    LOGI("  Depth First: %s", settings.depth_first ? "ON" : "OFF");
+    LOGI("  ISA: %s", settings.isa[0] ? settings.isa : "(Auto)");
+    LOGI("  Model: %s", settings.model_path[0] ? settings.model_path : "(Built In)");
     LOGI("  Debug: %s", settings.debug ? "ON" : "OFF");
     LOGI("----------------");
     
@@ -434,8 +358,17 @@ bool init(int argc, char **args)
     }
     scratch = arena_create(ARENA_SIZE_MEDIUM);
 
+    // start worker threads, these live for the whole run
+    if(!threadpool_init(&thread_pool, settings.thread_count))
+    {
+        LOGE("Failed to start thread pool");
+        return false;
+    }
+
+    lanczos_init(DOWNSCALE_LANCZOS_A);
+
     // initialize model data
-    detect_init();
+    if(!detect_init()) return false;
 
     return true;
 }
@@ -443,7 +376,7 @@ bool init(int argc, char **args)
 void print_help()
 {
     printf("\n[USAGE]\n");
-    printf("  censorman <in_file> -o <out_file> -d {class_list} -t {transform_list} [-c confidence_threshold][-k thread_count] [--debug] [--image <texture_image_path>] [--block_scale <block_scale>] [--is_quiet]\n");
+    printf("  censorman <in_file> -o <out_file> -d {class_list} -t {transform_list} [-c confidence_threshold][-k thread_count] [--debug] [--image <texture_image_path>] [--block_scale <block_scale>] [--smart] [--detect_interval <n>] [--track_max_age <n>] [--segments <n>] [--roi <n>] [--min_face <px>] [--int8] [--fp16] [--depth_first] [--isa <isa>] [--model <model_path>] [--is_quiet]\n");
     printf("\n[DESCRIPTION]\n  Takes an image file, detects regions of human faces (for now), applies transformations on those regions and writes back an output image file\n");
     printf("\n[ARGUMENTS]\n");
     printf("  in_file:              Path to input image file (or folder) (.jpg, .png, .bmp)\n");
@@ -455,6 +388,17 @@ void print_help()
     printf("  debug:                Print debug info and draw boxes on output image\n");
     printf("  texture_image_path:   Used with 'texture' transform\n");
     printf("  block_scale:          Value between 0.0 and 1.0. Used to scale blocks in pixelate transform\n");
+    printf("  smart:                Video only. Copy GOPs without detections instead of re-encoding them (H.264 sources)\n");
+    printf("  detect_interval:      Video only. Run detection every n frames and track faces in between (default 1, every frame). While a face is lost it runs every n/2 frames\n");
+    printf("  track_max_age:        Video only. Frames a tracked face is kept without being detected again (default 15)\n");
+    printf("  segments:             Video only. Split at key frames and process this many parts at once (default 1)\n");
+    printf("  roi:                  Video only. Detect the full frame every n frames, and only around the last frame's faces in between (default 1, off). Ignored with detect_interval\n");
+    printf("  min_face:             Width in pixels of the smallest face to find. From %d the detector skips its small-face branch\n", STRIDE8_MAX_FACE);
+    printf("  int8:                 Run most of the detector in 8-bit. Faster with AVX2/AVX-512 builds, boxes may move by a few pixels\n");
+    printf("  fp16:                 Keep the detector's activations in 16-bit floats, halving their memory traffic. Scores move by < 0.001\n");
+    printf("  depth_first:          Run the detector's first layers on strips of the image that stay in cache. Same results, speed depends on the CPU's caches\n");
+    printf("  isa:                  Force the detector's kernels instead of the best the CPU supports {generic, avx2, avx512, avx512vnni}\n");
+    printf("  model_path:           Detector weights file to use instead of the built in ones (.fdcn, written by facedetectcnn-pack --model)\n");
     printf("  is_quiet:             Suppress standard log output\n");
     printf("\n");
 }
@@ -481,6 +425,14 @@ bool parse_args(ProgramSettings* settings, int argc, char* argv[])
                         settings->debug = true;
                     if(STR_EQUAL(&argv[i][2],"quiet"))
                         is_quiet = true;
+                    if(STR_EQUAL(&argv[i][2],"smart"))
+                        settings->smart_render = true;
+                    if(STR_EQUAL(&argv[i][2],"int8"))
+                        settings->int8 = true;
+                    if(STR_EQUAL(&argv[i][2],"fp16"))
+                        settings->fp16 = true;
+                    if(STR_EQUAL(&argv[i][2],"depth_first"))
+                        settings->depth_first = true;
                     if(STR_EQUAL(&argv[i][2],"no_scale"))
                         settings->no_scale = true;
                     else if(STR_EQUAL(&argv[i][2],"block_scale"))
@@ -493,6 +445,62 @@ bool parse_args(ProgramSettings* settings, int argc, char* argv[])
                             settings->block_scale = f;
                         }
                     }
+                    else if(STR_EQUAL(&argv[i][2],"detect_interval"))
+                    {
+                        if(i < argc-1)
+                        {
+                            i++;
+                            settings->detect_interval = MAX(1, atoi(argv[i]));
+                        }
+                    }
+                    else if(STR_EQUAL(&argv[i][2],"track_max_age"))
+                    {
+                        if(i < argc-1)
+                        {
+                            i++;
+                            settings->track_max_age = MAX(0, atoi(argv[i]));
+                        }
+                    }
+                    else if(STR_EQUAL(&argv[i][2],"roi"))
+                    {
+                        if(i < argc-1)
+                        {
+                            i++;
+                            settings->roi_interval = MAX(1, atoi(argv[i]));
+                        }
+                    }
+                    else if(STR_EQUAL(&argv[i][2],"min_face"))
+                    {
+                        if(i < argc-1)
+                        {
+                            i++;
+                            settings->min_face = MAX(0, atoi(argv[i]));
+                        }
+                    }
+                    else if(STR_EQUAL(&argv[i][2],"isa"))
+                    {
+                        if(i < argc-1)
+                        {
+                            i++;
+                            snprintf(settings->isa, sizeof(settings->isa), "%s", argv[i]);
+                        }
+                    }
+                    else if(STR_EQUAL(&argv[i][2],"model"))
+                    {
+                        if(i < argc-1)
+                        {
+                            i++;
+                            snprintf(settings->model_path, sizeof(settings->model_path), "%s", argv[i]);
+                        }
+                    }
+                    else if(STR_EQUAL(&argv[i][2],"segments"))
+                    {
+                        if(i < argc-1)
+                        {
+                            i++;
+                            settings->segment_count = CLAMP(atoi(argv[i]), 1, SEGMENT_MAX_COUNT);
+                        }
+                    }
                     else if(STR_EQUAL(&argv[i][2],"image"))
                     {
                         if(i < argc-1)
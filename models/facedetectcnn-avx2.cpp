@@ -0,0 +1,31 @@
+/*
+The network compiled for avx2 in namespace avx2. facedetect_init() picks
+it at run time when the CPU has AVX2 and FMA, so the binary doesn't need to be
+built for that instruction set.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//the standard headers come first, so none of their inline code is
+//compiled for avx2 and shared with the rest of the binary
+#include <cmath>
+#include <float.h>
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+#include <vector>
+#include <iostream>
+#include <typeinfo>
+
+#pragma GCC target("avx2,fma,f16c")
+
+#undef _ENABLE_AVX512
+#undef _ENABLE_AVX2
+#undef _ENABLE_NEON
+#define _ENABLE_AVX2
+#define FACEDETECT_ISA avx2
+
+#include "facedetectcnn.cpp"
+#include "facedetectcnn-model.cpp"
+
+#endif
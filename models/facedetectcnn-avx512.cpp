@@ -0,0 +1,31 @@
+/*
+The network compiled for avx512 in namespace avx512. facedetect_init() picks
+it at run time when the CPU has AVX-512 F/BW/VL/DQ, so the binary doesn't need to be
+built for that instruction set.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//the standard headers come first, so none of their inline code is
+//compiled for avx512 and shared with the rest of the binary
+#include <cmath>
+#include <float.h>
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+#include <vector>
+#include <iostream>
+#include <typeinfo>
+
+#pragma GCC target("avx512f,avx512bw,avx512vl,avx512dq,avx2,fma,f16c")
+
+#undef _ENABLE_AVX512
+#undef _ENABLE_AVX2
+#undef _ENABLE_NEON
+#define _ENABLE_AVX512
+#define FACEDETECT_ISA avx512
+
+#include "facedetectcnn.cpp"
+#include "facedetectcnn-model.cpp"
+
+#endif
@@ -0,0 +1,33 @@
+/*
+The network compiled for avx512 with VNNI in namespace avx512vnni. Same
+kernels as the avx512 build, but the INT8 point wise layers use vpdpbusd.
+facedetect_init() picks it at run time when the CPU also has AVX512-VNNI.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+
+//the standard headers come first, so none of their inline code is
+//compiled for avx512vnni and shared with the rest of the binary
+#include <cmath>
+#include <float.h>
+#include <algorithm>
+#include <limits.h>
+#include <string.h>
+#include <vector>
+#include <iostream>
+#include <typeinfo>
+
+#pragma GCC target("avx512f,avx512bw,avx512vl,avx512dq,avx512vnni,avx2,fma,f16c")
+
+#undef _ENABLE_AVX512
+#undef _ENABLE_AVX512VNNI
+#undef _ENABLE_AVX2
+#undef _ENABLE_NEON
+#define _ENABLE_AVX512
+#define _ENABLE_AVX512VNNI
+#define FACEDETECT_ISA avx512vnni
+
+#include "facedetectcnn.cpp"
+#include "facedetectcnn-model.cpp"
+
+#endif
@@ -39,6 +39,12 @@ the use of this software, even if advised of the possibility of such damage.
 
 #include "facedetectcnn.h"
 
+#if defined(FACEDETECT_ISA_GENERIC) && !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #if 0
 #include <opencv2/opencv.hpp>
@@ -52,175 +58,987 @@ cv::TickMeter cvtm;
 
 #define NUM_CONV_LAYER 53
 
+//rows of CONV3's output (1/8 of the image) computed at a time in depth-first
+//mode, and the rows on each side the strip's receptive field reaches: 5 for
+//the zero padding at the strip's edges to wear off by CONV3 (2 rows at 1/2
+//from CONV0, 4 at 1/4 from CONV1 and CONV2, 2 at 1/8 from CONV3). Both
+//neighbours compute the halo again, shorter strips cost more than they save.
+#define DEPTH_FIRST_STRIP_ROWS 32
+#define DEPTH_FIRST_HALO 5
+
 extern ConvInfoStruct param_pConvInfo[NUM_CONV_LAYER];
 
+namespace FACEDETECT_ISA {
+
 bool param_initialized = false;
 Filters<float> g_pFilters[NUM_CONV_LAYER];
 
+//largest input activation of every point wise layer, measured with
+//facedetect_calibrate_int8() on sample images. The first layer stays
+//in float, its input is the 8-bit image already.
+float param_int8_act_max[NUM_CONV_LAYER] = {
+    0, 6.41f, 0, 5.38f, 0, 3.80f, 0, 4.92f,
+    0, 3.19f, 0, 2.59f, 0, 2.87f, 0, 4.76f,
+    0, 3.08f, 0, 6.18f, 0, 3.51f, 0, 7.26f,
+    0, 6.31f, 0, 2.54f, 0, 7.75f, 0, 6.37f,
+    0, 4.45f, 0, 7.75f, 0, 6.37f, 0, 4.45f,
+    0, 7.75f, 0, 6.37f, 0, 4.45f, 0, 7.75f,
+    0, 6.37f, 0, 4.45f, 0
+};
+
+//share of the input activations of every point wise layer that are 0,
+//measured on the same images. sparsifyFilters() times the layers' sparse
+//path on inputs like these.
+float param_act_zeros[NUM_CONV_LAYER] = {
+    0, 0.35f, 0, 0.20f, 0, 0.20f, 0, 0.29f,
+    0, 0.30f, 0, 0.48f, 0, 0.45f, 0, 0.53f,
+    0, 0.45f, 0, 0.39f, 0, 0.60f, 0, 0.30f,
+    0, 0.23f, 0, 0.53f, 0, 0.30f, 0, 0.43f,
+    0, 0.42f, 0, 0.30f, 0, 0.43f, 0, 0.42f,
+    0, 0.30f, 0, 0.43f, 0, 0.42f, 0, 0.30f,
+    0, 0.43f, 0, 0.42f, 0
+};
+
+//the images are RGB instead of the BGR the model was trained on
+static bool g_rgb = false;
+
+//swaps the weights of the first and the last channel of every tap of the
+//first layer, so it reads the images in the other channel order
+static void swapFirstLayerRB()
+{
+    Filters<float> & filters = g_pFilters[0];
+    for (int f = 0; f < filters.num_filters; f++)
+    {
+        float * pW = filters.weights.ptr(0, f);
+        for (int t = 0; t < 9; t++)
+            std::swap(pW[t * 3], pW[t * 3 + 2]);
+    }
+    packFilters(filters);
+}
+
+#if defined(FACEDETECT_PACKED)
+//this build's layers packed by facedetectcnn-pack at build time, in the
+//generated facedetectcnn-packed.cpp
+extern const PackedModel param_packed;
+#endif
+
+//points blob at memory it doesn't own, see addStaticData()
+template<typename T>
+static void loadPackedBlob(CDataBlob<T> & blob, const unsigned char * data, const PackedBlob & packed)
+{
+    blob.setNULL();
+    if (packed.channelStep == 0)
+        return;
+
+    blob.rows = packed.rows;
+    blob.cols = packed.cols;
+    blob.channels = packed.channels;
+    blob.channelStep = packed.channelStep;
+    blob.data = (T*)(data + packed.offset);
+}
+
+//points layer i at the tables packed at build time, without copying them.
+//Returns false if there are none.
+static bool loadPackedFilters(int i)
+{
+#if defined(FACEDETECT_PACKED)
+    if (!param_packed.data || param_packed.num_filters != NUM_CONV_LAYER)
+        return false;
+
+    Filters<float> & filters = g_pFilters[i];
+    const ConvInfoStruct & info = param_pConvInfo[i];
+    const PackedFilters & packed = param_packed.filters[i];
+
+    addStaticData(param_packed.data, param_packed.size);
+
+    filters.channels = info.channels;
+    filters.num_filters = info.num_filters;
+    filters.is_depthwise = info.is_depthwise;
+    filters.is_pointwise = info.is_pointwise;
+    filters.with_relu = info.with_relu;
+    loadPackedBlob(filters.weights, param_packed.data, packed.weights);
+    loadPackedBlob(filters.biases, param_packed.data, packed.biases);
+    loadPackedBlob(filters.weights_p, param_packed.data, packed.weights_p);
+    loadPackedBlob(filters.weights_q, param_packed.data, packed.weights_q);
+    loadPackedBlob(filters.scales_q, param_packed.data, packed.scales_q);
+    loadPackedBlob(filters.biases_q, param_packed.data, packed.biases_q);
+    filters.has_int8 = packed.has_int8;
+    filters.act_max = packed.act_max;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static PackedBlob fromModelFileBlob(const ModelFileBlob & blob)
+{
+    PackedBlob packed = {size_t(blob.offset), blob.rows, blob.cols, blob.channels, blob.channelStep};
+    return packed;
+}
+
+//the layers of this build in the model file, NULL if it was saved without
+//them or they aren't aligned the way the kernels load them
+static const ModelFileFilters * modelFileBuildFilters()
+{
+    const FaceDetectModelFile & model = g_facedetectModelFile;
+
+    for (int b = 0; b < model.num_builds; b++)
+    {
+        if (strcmp(model.builds[b].name, kernels.name) != 0)
+            continue;
+
+        const ModelFileFilters * filters = (const ModelFileFilters *)(model.data + model.builds[b].filters_offset);
+        for (int i = 1; i < NUM_CONV_LAYER; i++)
+        {
+            const ModelFileBlob * blobs[6] = {&filters[i].weights, &filters[i].biases, &filters[i].weights_p,
+                                              &filters[i].weights_q, &filters[i].scales_q, &filters[i].biases_q};
+            for (int k = 0; k < 6; k++)
+            {
+                if (blobs[k]->offset % (_MALLOC_ALIGN / 8) != 0)
+                    return NULL;
+            }
+        }
+        return filters;
+    }
+    return NULL;
+}
+
+//points layer i at the model file facedetect_load_model() mapped. The layers
+//after the first use the tables saved for this build as they are, without
+//them the weights and biases are used and the rest of the layer is built
+//from them. Returns false if there's no model file.
+static bool loadModelFileFilters(int i)
+{
+    const FaceDetectModelFile & model = g_facedetectModelFile;
+    if (!model.data)
+        return false;
+
+    Filters<float> & filters = g_pFilters[i];
+    const ModelFileLayer & layer = model.layers[i];
+
+    addStaticData(model.data, model.size);
+
+    filters.channels = layer.channels;
+    filters.num_filters = layer.num_filters;
+    filters.is_depthwise = layer.is_depthwise != 0;
+    filters.is_pointwise = layer.is_pointwise != 0;
+    filters.with_relu = layer.with_relu != 0;
+
+    const ModelFileFilters * built = (i > 0) ? modelFileBuildFilters() : NULL;
+    if (built)
+    {
+        const ModelFileFilters & f = built[i];
+        loadPackedBlob(filters.weights, model.data, fromModelFileBlob(f.weights));
+        loadPackedBlob(filters.biases, model.data, fromModelFileBlob(f.biases));
+        loadPackedBlob(filters.weights_p, model.data, fromModelFileBlob(f.weights_p));
+        loadPackedBlob(filters.weights_q, model.data, fromModelFileBlob(f.weights_q));
+        loadPackedBlob(filters.scales_q, model.data, fromModelFileBlob(f.scales_q));
+        loadPackedBlob(filters.biases_q, model.data, fromModelFileBlob(f.biases_q));
+        filters.has_int8 = f.has_int8 != 0;
+        filters.act_max = f.act_max;
+        return true;
+    }
+
+    PackedBlob weights = {size_t(layer.weights_offset), 1, layer.is_pointwise ? layer.num_filters : 9, layer.channels, layer.weight_step};
+    PackedBlob biases = {size_t(layer.biases_offset), 1, 1, layer.num_filters, layer.bias_step};
+
+    if (i > 0)
+    {
+        loadPackedBlob(filters.weights, model.data, weights);
+        loadPackedBlob(filters.biases, model.data, biases);
+    }
+    else
+    {
+        //the mapping is read only, facedetect_set_rgb() changes the first layer
+        filters.weights.create(weights.rows, weights.cols, weights.channels);
+        for (int c = 0; c < weights.cols; c++)
+            memcpy(filters.weights.ptr(0, c), model.data + weights.offset + size_t(c) * weights.channelStep, weights.channels * sizeof(float));
+
+        filters.biases.create(biases.rows, biases.cols, biases.channels);
+        memcpy(filters.biases.ptr(0, 0), model.data + biases.offset, biases.channels * sizeof(float));
+    }
+
+    packFilters(filters);
+    if (i > 0)
+        quantizeFilters(filters, layer.act_max);
+    return true;
+}
+
 void init_parameters()
 {
     for(int i = 0; i < NUM_CONV_LAYER; i++)
+    {
+        if (loadModelFileFilters(i))
+            continue;
+
+        //the first layer is always built here, facedetect_set_rgb() changes its weights
+        if (i > 0 && loadPackedFilters(i))
+            continue;
+
         g_pFilters[i] = param_pConvInfo[i];
+        packFilters(g_pFilters[i]);
+        if (i > 0)
+            quantizeFilters(g_pFilters[i], param_int8_act_max[i]);
+    }
+
+    if (g_rgb)
+        swapFirstLayerRB();
+
+    //the first layer reads the image, it has no zeros to skip
+    for (int i = 1; i < NUM_CONV_LAYER; i++)
+        sparsifyFilters(g_pFilters[i], param_act_zeros[i]);
 
     param_initialized = true;
 }
 
-std::vector<FaceRect> objectdetect_cnn(unsigned char * rgbImageData, int width, int height, int step)
+template<typename T>
+static void packBlob(std::vector<unsigned char> & data, const CDataBlob<T> & blob, PackedBlob & packed)
+{
+    memset(&packed, 0, sizeof(packed));
+    if (blob.isEmpty())
+        return;
+
+    size_t size = size_t(blob.rows) * blob.cols * blob.channelStep;
+    data.resize((data.size() + _MALLOC_ALIGN / 8 - 1) / (_MALLOC_ALIGN / 8) * (_MALLOC_ALIGN / 8));
+
+    packed.offset = data.size();
+    packed.rows = blob.rows;
+    packed.cols = blob.cols;
+    packed.channels = blob.channels;
+    packed.channelStep = blob.channelStep;
+    data.insert(data.end(), (const unsigned char *)blob.data, (const unsigned char *)blob.data + size);
+}
+
+//appends the layers after the first, as init_parameters() leaves them, to
+//data for facedetectcnn-pack. Each blob starts on _MALLOC_ALIGN bits.
+void packParameters(std::vector<unsigned char> & data, std::vector<PackedFilters> & filters)
 {
-    TIME_START;
     if (!param_initialized)
-    {
         init_parameters();
+
+    filters.assign(NUM_CONV_LAYER, PackedFilters());
+
+    for (int i = 1; i < NUM_CONV_LAYER; i++)
+    {
+        const Filters<float> & f = g_pFilters[i];
+        PackedFilters & packed = filters[i];
+
+        packBlob(data, f.weights, packed.weights);
+        packBlob(data, f.biases, packed.biases);
+        packBlob(data, f.weights_p, packed.weights_p);
+        packBlob(data, f.weights_q, packed.weights_q);
+        packBlob(data, f.scales_q, packed.scales_q);
+        packBlob(data, f.biases_q, packed.biases_q);
+        packed.has_int8 = f.has_int8;
+        packed.act_max = f.act_max;
     }
-    TIME_END("init");
+}
 
+static void setRgb(bool enable)
+{
+    if (param_initialized && enable != g_rgb)
+        swapFirstLayerRB();
+    g_rgb = enable;
+}
 
-    TIME_START;
-    auto fx = setDataFrom3x3S2P1to1x1S1P0FromImage(rgbImageData, width, height, 3, step);
-    TIME_END("convert data");
+//stores the activations between the first layer and the heads as fp16_t
+static bool g_fp16 = false;
 
-    /***************CONV0*********************/
-    TIME_START;
-    fx = convolution(fx, g_pFilters[0]);
-    TIME_END("conv_head");
+static void setFp16(bool enable)
+{
+    g_fp16 = enable;
+}
 
-    TIME_START;
-    fx = convolutionDP(fx, g_pFilters[1], g_pFilters[2]);
-    TIME_END("conv0");
+//runs CONV0 to CONV3 on horizontal strips instead of over the whole image
+static bool g_depthFirst = false;
 
-    TIME_START;
-    fx = maxpooling2x2S2(fx);
-    TIME_END("pool0");
+static void setDepthFirst(bool enable)
+{
+    g_depthFirst = enable;
+}
 
-    /***************CONV1*********************/
-    TIME_START;
+// CONV0 to CONV3 over an image, layer by layer
+template<typename T>
+static CDataBlob<T> runBackbone(const unsigned char * rgbImageData, int width, int height, int step)
+{
+    CDataBlob<float> f0 = convolution3x3S2FromImage(rgbImageData, width, height, 3, step, g_pFilters[0]);
+    CDataBlob<T> fx = convolutionDP<T>(f0, g_pFilters[1], g_pFilters[2]);
+    f0.setNULL();
+    fx = maxpooling2x2S2(fx);
     fx = convolution4layerUnit(fx, g_pFilters[3], g_pFilters[4], g_pFilters[5], g_pFilters[6]);
-    TIME_END("conv1");
-
-    /***************CONV2*********************/
-    TIME_START;
     fx = convolution4layerUnit(fx, g_pFilters[7], g_pFilters[8], g_pFilters[9], g_pFilters[10]);
-    TIME_END("conv2");
-
-    /***************CONV3*********************/
-    TIME_START;
     fx = maxpooling2x2S2(fx);
-    TIME_END("pool3");
+    return convolution4layerUnit(fx, g_pFilters[11], g_pFilters[12], g_pFilters[13], g_pFilters[14]);
+}
 
-    TIME_START;
-    auto fb1 = convolution4layerUnit(fx, g_pFilters[11], g_pFilters[12], g_pFilters[13], g_pFilters[14]);
-    TIME_END("conv3");
+// CONV0 to CONV3 depth first. Each strip of DEPTH_FIRST_STRIP_ROWS output
+// rows goes through all the layers with its halo before the next one starts,
+// so its activations stay in cache from one layer to the next. The halo rows
+// are computed again by the neighbouring strips. Strips start on multiples
+// of 4 output rows (32 image rows), where the network pads the image to, so
+// every strip's layers line up with the full image's and the valid rows come
+// out the same.
+template<typename T>
+static CDataBlob<T> runBackboneDepthFirst(const unsigned char * rgbImageData, int width, int height, int step)
+{
+    int rows = (height + 31) / 32 * 4;
+    CDataBlob<T> out;
+
+    for (int r0 = 0; r0 < rows; r0 += DEPTH_FIRST_STRIP_ROWS)
+    {
+        int r1 = MIN(r0 + DEPTH_FIRST_STRIP_ROWS, rows);
+        int h0 = MAX(0, r0 - DEPTH_FIRST_HALO) / 4 * 4;
+        int h1 = MIN(r1 + DEPTH_FIRST_HALO, rows);
+        int imageRows = MIN(height - h0 * 8, (h1 - h0) * 8);
+
+        CDataBlob<T> strip = runBackbone<T>(rgbImageData + size_t(step) * h0 * 8, width, imageRows, step);
+
+        if (out.isEmpty())
+            out.create(rows, strip.cols, strip.channels);
+
+        for (int r = r0; r < r1; r++)
+            memcpy(out.ptr(r, 0), strip.ptr(r - h0, 0), size_t(out.cols) * out.channelStep);
+    }
+
+    return out;
+}
+
+// Runs the network over count images of the same size. Every layer is applied
+// to the whole batch before moving on to the next one, so a layer's weights
+// are fetched once per batch instead of once per image. T is the type of the
+// activations after the first layer, the heads always output float.
+// The stride 8 branch is left out if min_face is too wide for it.
+template<typename T>
+static std::vector<std::vector<FaceRect>> runNetwork(unsigned char ** rgbImageData, int count, int width, int height, int step, int min_face)
+{
+    bool stride8 = (min_face < STRIDE8_MAX_FACE);
+
+    //declared before the blobs so it ends after they're all gone
+    CWorkspaceScope workspace(width, height, count);
+
+    std::vector<CDataBlob<T>> fx(count), fb1(count), fb2(count), fb3(count);
+    std::vector<CDataBlob<float>> pred_reg[3], pred_cls[3], pred_kps[3], pred_obj[3];
+    for (int k = 0; k < 3; k++)
+    {
+        pred_reg[k].resize(count);
+        pred_cls[k].resize(count);
+        pred_kps[k].resize(count);
+        pred_obj[k].resize(count);
+    }
+
+    if (g_depthFirst)
+    {
+        /***************CONV0 to CONV3*************/
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fb1[i] = runBackboneDepthFirst<T>(rgbImageData[i], width, height, step);
+        TIME_END("conv0-3 depth first");
+    }
+    else
+    {
+        std::vector<CDataBlob<float>> f0(count);
+
+        /***************CONV0*********************/
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            f0[i] = convolution3x3S2FromImage(rgbImageData[i], width, height, 3, step, g_pFilters[0]);
+        TIME_END("conv_head");
+
+        TIME_START;
+        for (int i = 0; i < count; i++)
+        {
+            fx[i] = convolutionDP<T>(f0[i], g_pFilters[1], g_pFilters[2]);
+            f0[i].setNULL();
+        }
+        TIME_END("conv0");
+
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fx[i] = maxpooling2x2S2(fx[i]);
+        TIME_END("pool0");
+
+        /***************CONV1*********************/
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fx[i] = convolution4layerUnit(fx[i], g_pFilters[3], g_pFilters[4], g_pFilters[5], g_pFilters[6]);
+        TIME_END("conv1");
+
+        /***************CONV2*********************/
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fx[i] = convolution4layerUnit(fx[i], g_pFilters[7], g_pFilters[8], g_pFilters[9], g_pFilters[10]);
+        TIME_END("conv2");
+
+        /***************CONV3*********************/
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fx[i] = maxpooling2x2S2(fx[i]);
+        TIME_END("pool3");
+
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fb1[i] = convolution4layerUnit(fx[i], g_pFilters[11], g_pFilters[12], g_pFilters[13], g_pFilters[14]);
+        TIME_END("conv3");
+    }
 
     /***************CONV4*********************/
     TIME_START;
-    fx = maxpooling2x2S2(fb1);
+    for (int i = 0; i < count; i++)
+        fx[i] = maxpooling2x2S2(fb1[i]);
     TIME_END("pool4");
 
     TIME_START;
-    auto fb2 = convolution4layerUnit(fx, g_pFilters[15], g_pFilters[16], g_pFilters[17], g_pFilters[18]);
+    for (int i = 0; i < count; i++)
+        fb2[i] = convolution4layerUnit(fx[i], g_pFilters[15], g_pFilters[16], g_pFilters[17], g_pFilters[18]);
     TIME_END("conv4");
 
     /***************CONV5*********************/
     TIME_START;
-    fx = maxpooling2x2S2(fb2);
+    for (int i = 0; i < count; i++)
+        fx[i] = maxpooling2x2S2(fb2[i]);
     TIME_END("pool5");
 
     TIME_START;
-    auto fb3 = convolution4layerUnit(fx, g_pFilters[19], g_pFilters[20], g_pFilters[21], g_pFilters[22]);
+    for (int i = 0; i < count; i++)
+        fb3[i] = convolution4layerUnit(fx[i], g_pFilters[19], g_pFilters[20], g_pFilters[21], g_pFilters[22]);
     TIME_END("conv5");
 
-    CDataBlob<float> pred_reg[3], pred_cls[3], pred_kps[3], pred_obj[3];
     /***************branch5*********************/
     TIME_START;
-    fb3 = convolutionDP(fb3, g_pFilters[27], g_pFilters[28]);
-    pred_cls[2] = convolutionDP(fb3, g_pFilters[33], g_pFilters[34], false);
-    pred_reg[2] = convolutionDP(fb3, g_pFilters[39], g_pFilters[40], false);
-    pred_kps[2] = convolutionDP(fb3, g_pFilters[51], g_pFilters[52], false);
-    pred_obj[2] = convolutionDP(fb3, g_pFilters[45], g_pFilters[46], false);
+    for (int i = 0; i < count; i++)
+        fb3[i] = convolutionDP<T>(fb3[i], g_pFilters[27], g_pFilters[28]);
+    for (int i = 0; i < count; i++)
+        pred_cls[2][i] = convolutionDP<float>(fb3[i], g_pFilters[33], g_pFilters[34], false);
+    for (int i = 0; i < count; i++)
+        pred_reg[2][i] = convolutionDP<float>(fb3[i], g_pFilters[39], g_pFilters[40], false);
+    for (int i = 0; i < count; i++)
+        pred_kps[2][i] = convolutionDP<float>(fb3[i], g_pFilters[51], g_pFilters[52], false);
+    for (int i = 0; i < count; i++)
+        pred_obj[2][i] = convolutionDP<float>(fb3[i], g_pFilters[45], g_pFilters[46], false);
     TIME_END("branch5");
 
     /*****************add5*********************/    
     TIME_START;
-    fb2 = elementAdd(upsampleX2(fb3), fb2);
+    for (int i = 0; i < count; i++)
+        fb2[i] = elementAdd(upsampleX2(fb3[i]), fb2[i]);
     TIME_END("add5");
 
     /*****************add6*********************/    
     TIME_START;
-    fb2 = convolutionDP(fb2, g_pFilters[25], g_pFilters[26]);
-    pred_cls[1] = convolutionDP(fb2, g_pFilters[31], g_pFilters[32], false);
-    pred_reg[1] = convolutionDP(fb2, g_pFilters[37], g_pFilters[38], false);
-    pred_kps[1] = convolutionDP(fb2, g_pFilters[49], g_pFilters[50], false);
-    pred_obj[1] = convolutionDP(fb2, g_pFilters[43], g_pFilters[44], false);
+    for (int i = 0; i < count; i++)
+        fb2[i] = convolutionDP<T>(fb2[i], g_pFilters[25], g_pFilters[26]);
+    for (int i = 0; i < count; i++)
+        pred_cls[1][i] = convolutionDP<float>(fb2[i], g_pFilters[31], g_pFilters[32], false);
+    for (int i = 0; i < count; i++)
+        pred_reg[1][i] = convolutionDP<float>(fb2[i], g_pFilters[37], g_pFilters[38], false);
+    for (int i = 0; i < count; i++)
+        pred_kps[1][i] = convolutionDP<float>(fb2[i], g_pFilters[49], g_pFilters[50], false);
+    for (int i = 0; i < count; i++)
+        pred_obj[1][i] = convolutionDP<float>(fb2[i], g_pFilters[43], g_pFilters[44], false);
     TIME_END("branch4");
 
-    /*****************add4*********************/
-    TIME_START;
-    fb1 = elementAdd(upsampleX2(fb2), fb1);
-    TIME_END("add4");
+    if (stride8)
+    {
+        /*****************add4*********************/
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fb1[i] = elementAdd(upsampleX2(fb2[i]), fb1[i]);
+        TIME_END("add4");
 
-    /***************branch3*********************/
-    TIME_START;
-    fb1 = convolutionDP(fb1, g_pFilters[23], g_pFilters[24]);
-    pred_cls[0] = convolutionDP(fb1, g_pFilters[29], g_pFilters[30], false);
-    pred_reg[0] = convolutionDP(fb1, g_pFilters[35], g_pFilters[36], false);
-    pred_kps[0] = convolutionDP(fb1, g_pFilters[47], g_pFilters[48], false);
-    pred_obj[0] = convolutionDP(fb1, g_pFilters[41], g_pFilters[42], false);
-    TIME_END("branch3");
-    
-    /***************PRIORBOX*********************/
-    TIME_START;
-    auto prior3 = meshgrid(fb1.cols, fb1.rows, 8);
-    auto prior4 = meshgrid(fb2.cols, fb2.rows, 16);
-    auto prior5 = meshgrid(fb3.cols, fb3.rows, 32);
-    TIME_END("prior");
-    /***************PRIORBOX*********************/
+        /***************branch3*********************/
+        TIME_START;
+        for (int i = 0; i < count; i++)
+            fb1[i] = convolutionDP<T>(fb1[i], g_pFilters[23], g_pFilters[24]);
+        for (int i = 0; i < count; i++)
+            pred_cls[0][i] = convolutionDP<float>(fb1[i], g_pFilters[29], g_pFilters[30], false);
+        for (int i = 0; i < count; i++)
+            pred_reg[0][i] = convolutionDP<float>(fb1[i], g_pFilters[35], g_pFilters[36], false);
+        for (int i = 0; i < count; i++)
+            pred_kps[0][i] = convolutionDP<float>(fb1[i], g_pFilters[47], g_pFilters[48], false);
+        for (int i = 0; i < count; i++)
+            pred_obj[0][i] = convolutionDP<float>(fb1[i], g_pFilters[41], g_pFilters[42], false);
+        TIME_END("branch3");
+    }
 
-    TIME_START;
-    bbox_decode(pred_reg[0], prior3, 8);
-    bbox_decode(pred_reg[1], prior4, 16);
-    bbox_decode(pred_reg[2], prior5, 32);
+    std::vector<std::vector<FaceRect>> facesInfo(count);
+    const int strides[3] = {8, 16, 32};
 
-    kps_decode(pred_kps[0], prior3, 8);
-    kps_decode(pred_kps[1], prior4, 16);
-    kps_decode(pred_kps[2], prior5, 32);
+    for (int i = 0; i < count; i++)
+    {
+        const CDataBlob<float> * cls[3] = {&pred_cls[0][i], &pred_cls[1][i], &pred_cls[2][i]};
+        const CDataBlob<float> * reg[3] = {&pred_reg[0][i], &pred_reg[1][i], &pred_reg[2][i]};
+        const CDataBlob<float> * kps[3] = {&pred_kps[0][i], &pred_kps[1][i], &pred_kps[2][i]};
+        const CDataBlob<float> * obj[3] = {&pred_obj[0][i], &pred_obj[1][i], &pred_obj[2][i]};
 
-    auto cls = concat3(blob2vector(pred_cls[0]), blob2vector(pred_cls[1]), blob2vector(pred_cls[2]));
-    auto reg = concat3(blob2vector(pred_reg[0]), blob2vector(pred_reg[1]), blob2vector(pred_reg[2]));
-    auto kps = concat3(blob2vector(pred_kps[0]), blob2vector(pred_kps[1]), blob2vector(pred_kps[2]));
-    auto obj = concat3(blob2vector(pred_obj[0]), blob2vector(pred_obj[1]), blob2vector(pred_obj[2]));
+        TIME_START;
+        int first = stride8 ? 0 : 1;
+        facesInfo[i] = detection_output(cls + first, reg + first, kps + first, obj + first, strides + first, 3 - first,
+                                        0.45f, 0.2f, 1000, 512);
+        TIME_END("detection output")
+    }
 
-    sigmoid(cls);
-    sigmoid(obj);
-    TIME_END("decode")
+    return facesInfo;
+}
 
+std::vector<std::vector<FaceRect>> objectdetect_cnn_batch(unsigned char ** rgbImageData, int count, int width, int height, int step, int min_face)
+{
     TIME_START;
-    std::vector<FaceRect> facesInfo = detection_output(cls, reg, kps, obj, 0.45f, 0.2f, 1000, 512);
-    TIME_END("detection output")
-    return facesInfo;
+    if (!param_initialized)
+    {
+        init_parameters();
+    }
+    TIME_END("init");
+
+    if (g_fp16)
+        return runNetwork<fp16_t>(rgbImageData, count, width, height, step, min_face);
+    return runNetwork<float>(rgbImageData, count, width, height, step, min_face);
 }
 
-void facedetect_init()
+std::vector<FaceRect> objectdetect_cnn(unsigned char * rgbImageData, int width, int height, int step)
 {
-    init_parameters();
+    return objectdetect_cnn_batch(&rgbImageData, 1, width, height, step)[0];
 }
 
-int* facedetect_cnn(unsigned char * result_buffer, //buffer memory for storing face detection results, !!its size must be 0x9000 Bytes!!
-    unsigned char * rgb_image_data, int width, int height, int step) //input image, it must be BGR (three-channel) image!
+//measures the activation ranges of the int8 layers on an image, see facedetect_calibrate_int8()
+static void calibrateInt8(unsigned char * rgbImageData, int width, int height, int step)
 {
+    if (!param_initialized)
+        init_parameters();
 
-    if (!result_buffer)
+    //the float path records the ranges into act_max as it goes
+    setCalibrating(true);
+    objectdetect_cnn(rgbImageData, width, height, step);
+    setCalibrating(false);
+
+    for (int i = 1; i < NUM_CONV_LAYER; i++)
+        quantizeFilters(g_pFilters[i], g_pFilters[i].act_max);
+}
+
+static bool cpuSupported()
+{
+#if defined(_ENABLE_AVX512)
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+           __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512dq") &&
+#if defined(_ENABLE_AVX512VNNI)
+           __builtin_cpu_supports("avx512vnni") &&
+#endif
+           __builtin_cpu_supports("fma");
+#elif defined(_ENABLE_AVX2)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") &&
+           __builtin_cpu_supports("f16c");
+#else
+    return true;
+#endif
+}
+
+#define FACEDETECT_STR_(x) #x
+#define FACEDETECT_STR(x) FACEDETECT_STR_(x)
+
+const FaceDetectKernels kernels = {
+    FACEDETECT_STR(FACEDETECT_ISA),
+    cpuSupported,
+    init_parameters,
+    objectdetect_cnn_batch,
+    setInt8,
+    setFp16,
+    setRgb,
+    setDepthFirst,
+    calibrateInt8,
+    packParameters
+};
+
+} //namespace FACEDETECT_ISA
+
+#if defined(FACEDETECT_ISA_GENERIC)
+
+//the builds in this binary, best first
+#if defined(__x86_64__) || defined(__i386__)
+namespace avx512vnni { extern const FaceDetectKernels kernels; }
+namespace avx512 { extern const FaceDetectKernels kernels; }
+namespace avx2 { extern const FaceDetectKernels kernels; }
+#endif
+
+static const FaceDetectKernels * g_pKernelList[] = {
+#if defined(__x86_64__) || defined(__i386__)
+    &avx512vnni::kernels,
+    &avx512::kernels,
+    &avx2::kernels,
+#endif
+    &generic::kernels
+};
+static const int g_numKernels = sizeof(g_pKernelList) / sizeof(g_pKernelList[0]);
+
+static const FaceDetectKernels * g_pKernels = NULL;
+
+FaceDetectParallel g_facedetectParallel = {NULL, NULL, 1};
+
+FaceDetectModelFile g_facedetectModelFile = {NULL, 0, NULL, 0, NULL, 0};
+
+//rows of a model file blob are padded to FACEDETECT_MODEL_ALIGN bytes
+static int modelRowStep(int count)
+{
+    int bytes = count * int(sizeof(float));
+    return (bytes + FACEDETECT_MODEL_ALIGN - 1) / FACEDETECT_MODEL_ALIGN * FACEDETECT_MODEL_ALIGN;
+}
+
+static bool modelBlobValid(const FaceDetectModelFile & model, unsigned long long offset, int rows, int count, int step)
+{
+    return offset % FACEDETECT_MODEL_ALIGN == 0 && step == modelRowStep(count) &&
+        offset <= model.size && (unsigned long long)rows * step <= model.size - offset;
+}
+
+static bool modelPackedBlobValid(const FaceDetectModelFile & model, const ModelFileBlob & blob)
+{
+    if (blob.channelStep == 0)
+        return true; //the layer doesn't have it
+    if (blob.rows < 0 || blob.cols < 0 || blob.channels < 0 || blob.channelStep < 0)
+        return false;
+
+    unsigned long long size = (unsigned long long)blob.rows * blob.cols * blob.channelStep;
+    return blob.offset <= model.size && size <= model.size - blob.offset;
+}
+
+//checks the header, that every layer has the shape of the built in one and
+//that the tables of the builds are inside the file
+static bool modelValid(const FaceDetectModelFile & model)
+{
+    const ModelFileHeader * header = (const ModelFileHeader *)model.data;
+    if (model.size < sizeof(ModelFileHeader) + NUM_CONV_LAYER * sizeof(ModelFileLayer) ||
+        header->magic != FACEDETECT_MODEL_MAGIC ||
+        header->version != FACEDETECT_MODEL_VERSION ||
+        header->num_layers != NUM_CONV_LAYER ||
+        header->num_builds > (model.size - sizeof(ModelFileHeader) - NUM_CONV_LAYER * sizeof(ModelFileLayer)) / sizeof(ModelFileBuild))
+        return false;
+
+    for (int i = 0; i < NUM_CONV_LAYER; i++)
     {
-        fprintf(stderr, "%s: null buffer memory.\n", __FUNCTION__);
-        return NULL;
+        const ModelFileLayer & layer = model.layers[i];
+        const ConvInfoStruct & info = param_pConvInfo[i];
+
+        if (layer.channels != info.channels ||
+            layer.num_filters != info.num_filters ||
+            (layer.is_depthwise != 0) != info.is_depthwise ||
+            (layer.is_pointwise != 0) != info.is_pointwise)
+            return false;
+
+        int rows = layer.is_pointwise ? layer.num_filters : 9;
+        if (!modelBlobValid(model, layer.weights_offset, rows, layer.channels, layer.weight_step) ||
+            !modelBlobValid(model, layer.biases_offset, 1, layer.num_filters, layer.bias_step))
+            return false;
     }
-    //clear memory
-    result_buffer[0] = 0;
-    result_buffer[1] = 0;
-    result_buffer[2] = 0;
-    result_buffer[3] = 0;
 
-    std::vector<FaceRect> faces = objectdetect_cnn(rgb_image_data, width, height, step);
+    for (int b = 0; b < model.num_builds; b++)
+    {
+        const ModelFileBuild & build = model.builds[b];
+        if (!memchr(build.name, 0, sizeof(build.name)) ||
+            build.filters_offset % FACEDETECT_MODEL_ALIGN != 0 || build.filters_offset > model.size ||
+            NUM_CONV_LAYER * sizeof(ModelFileFilters) > model.size - build.filters_offset)
+            return false;
+
+        const ModelFileFilters * filters = (const ModelFileFilters *)(model.data + build.filters_offset);
+        for (int i = 0; i < NUM_CONV_LAYER; i++)
+        {
+            const ModelFileFilters & f = filters[i];
+            if (!modelPackedBlobValid(model, f.weights) || !modelPackedBlobValid(model, f.biases) ||
+                !modelPackedBlobValid(model, f.weights_p) || !modelPackedBlobValid(model, f.weights_q) ||
+                !modelPackedBlobValid(model, f.scales_q) || !modelPackedBlobValid(model, f.biases_q))
+                return false;
+        }
+    }
+    return true;
+}
+
+static void unmapModel(FaceDetectModelFile & model)
+{
+#if defined(_WIN32)
+    _aligned_free((void*)model.data);
+#else
+    munmap((void*)model.data, model.size);
+#endif
+    memset(&model, 0, sizeof(model));
+}
+
+bool facedetect_load_model(const char * path)
+{
+    if (g_facedetectModelFile.data)
+    {
+        std::cerr << "A model file is loaded already" << std::endl;
+        return false;
+    }
+
+    FaceDetectModelFile model = {NULL, 0, NULL, 0, NULL, 0};
+
+#if defined(_WIN32)
+    //no mmap, read it into memory aligned the same way
+    FILE * fp = fopen(path, "rb");
+    if (fp && fseek(fp, 0, SEEK_END) == 0)
+    {
+        long size = ftell(fp);
+        if (size > 0 && fseek(fp, 0, SEEK_SET) == 0)
+        {
+            unsigned char * data = (unsigned char *)_aligned_malloc(size, FACEDETECT_MODEL_ALIGN);
+            if (data && fread(data, 1, size, fp) == size_t(size))
+            {
+                model.data = data;
+                model.size = size_t(size);
+            }
+            else
+                _aligned_free(data);
+        }
+    }
+    if (fp)
+        fclose(fp);
+#else
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        void * data = mmap(NULL, size_t(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            model.data = (const unsigned char *)data;
+            model.size = size_t(st.st_size);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+
+    if (!model.data)
+    {
+        std::cerr << "Could not read model file " << path << std::endl;
+        return false;
+    }
+
+    model.layers = (const ModelFileLayer *)(model.data + sizeof(ModelFileHeader));
+    model.num_layers = NUM_CONV_LAYER;
+    model.builds = (const ModelFileBuild *)(model.layers + NUM_CONV_LAYER);
+    model.num_builds = (model.size >= sizeof(ModelFileHeader)) ? int(((const ModelFileHeader *)model.data)->num_builds) : 0;
+
+    if (!modelValid(model))
+    {
+        std::cerr << "Model file " << path << " doesn't fit this network" << std::endl;
+        unmapModel(model);
+        return false;
+    }
+
+    g_facedetectModelFile = model;
+    return true;
+}
+
+//appends rows of count floats to data, each padded to FACEDETECT_MODEL_ALIGN
+//bytes with zeros, and returns where they start
+static unsigned long long appendModelRows(std::vector<unsigned char> & data, const float * src, int rows, int count)
+{
+    size_t offset = data.size();
+    int step = modelRowStep(count);
+
+    data.resize(offset + size_t(rows) * step, 0);
+    for (int r = 0; r < rows; r++)
+        memcpy(&data[offset + size_t(r) * step], src + size_t(r) * count, count * sizeof(float));
+    return offset;
+}
+
+static void alignModelData(std::vector<unsigned char> & data)
+{
+    data.resize((data.size() + FACEDETECT_MODEL_ALIGN - 1) / FACEDETECT_MODEL_ALIGN * FACEDETECT_MODEL_ALIGN, 0);
+}
+
+//a blob of a build's packed tables, placed at base in the file
+static ModelFileBlob toModelFileBlob(const PackedBlob & packed, size_t base)
+{
+    ModelFileBlob blob;
+    memset(&blob, 0, sizeof(blob));
+    if (packed.channelStep == 0)
+        return blob;
+
+    blob.offset = base + packed.offset;
+    blob.rows = packed.rows;
+    blob.cols = packed.cols;
+    blob.channels = packed.channels;
+    blob.channelStep = packed.channelStep;
+    return blob;
+}
+
+//appends the layers of a build as its kernels read them and returns the
+//ModelFileBuild pointing at them
+static ModelFileBuild appendModelBuild(std::vector<unsigned char> & data, const FaceDetectKernels & kernels)
+{
+    std::vector<unsigned char> packedData;
+    std::vector<PackedFilters> packed;
+    kernels.pack(packedData, packed);
+
+    alignModelData(data);
+    size_t base = data.size();
+    data.insert(data.end(), packedData.begin(), packedData.end());
+    alignModelData(data);
+
+    ModelFileBuild build;
+    memset(&build, 0, sizeof(build));
+    snprintf(build.name, sizeof(build.name), "%s", kernels.name);
+    build.filters_offset = data.size();
+
+    for (int i = 0; i < NUM_CONV_LAYER; i++)
+    {
+        ModelFileFilters f;
+        memset(&f, 0, sizeof(f));
+        f.weights = toModelFileBlob(packed[i].weights, base);
+        f.biases = toModelFileBlob(packed[i].biases, base);
+        f.weights_p = toModelFileBlob(packed[i].weights_p, base);
+        f.weights_q = toModelFileBlob(packed[i].weights_q, base);
+        f.scales_q = toModelFileBlob(packed[i].scales_q, base);
+        f.biases_q = toModelFileBlob(packed[i].biases_q, base);
+        f.has_int8 = packed[i].has_int8;
+        f.act_max = packed[i].act_max;
+        data.insert(data.end(), (const unsigned char *)&f, (const unsigned char *)&f + sizeof(f));
+    }
+    return build;
+}
+
+bool facedetect_save_model(const char * path)
+{
+    if (g_facedetectModelFile.data)
+    {
+        std::cerr << "A model file is loaded, the builds would pack its weights" << std::endl;
+        return false;
+    }
+
+    //the builds need to run to pack their layers
+    std::vector<const FaceDetectKernels *> builds;
+    for (int i = 0; i < g_numKernels; i++)
+    {
+        if (g_pKernelList[i]->supported())
+            builds.push_back(g_pKernelList[i]);
+        else
+            std::cerr << "Not saving " << g_pKernelList[i]->name << ", this CPU can't run it" << std::endl;
+    }
+
+    size_t buildsOffset = sizeof(ModelFileHeader) + NUM_CONV_LAYER * sizeof(ModelFileLayer);
+    std::vector<unsigned char> data(buildsOffset + builds.size() * sizeof(ModelFileBuild));
+    alignModelData(data);
+
+    ModelFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = FACEDETECT_MODEL_MAGIC;
+    header.version = FACEDETECT_MODEL_VERSION;
+    header.num_layers = NUM_CONV_LAYER;
+    header.num_builds = (unsigned int)builds.size();
+    memcpy(&data[0], &header, sizeof(header));
+
+    for (int i = 0; i < NUM_CONV_LAYER; i++)
+    {
+        const ConvInfoStruct & info = param_pConvInfo[i];
+
+        ModelFileLayer layer;
+        memset(&layer, 0, sizeof(layer));
+        layer.channels = info.channels;
+        layer.num_filters = info.num_filters;
+        layer.is_depthwise = info.is_depthwise;
+        layer.is_pointwise = info.is_pointwise;
+        layer.with_relu = info.with_relu;
+        layer.weight_step = modelRowStep(info.channels);
+        layer.bias_step = modelRowStep(info.num_filters);
+        layer.act_max = generic::param_int8_act_max[i];
+        layer.weights_offset = appendModelRows(data, info.pWeights, info.is_pointwise ? info.num_filters : 9, info.channels);
+        layer.biases_offset = appendModelRows(data, info.pBiases, 1, info.num_filters);
+
+        memcpy(&data[sizeof(ModelFileHeader) + i * sizeof(ModelFileLayer)], &layer, sizeof(layer));
+    }
 
+    for (size_t b = 0; b < builds.size(); b++)
+    {
+        ModelFileBuild build = appendModelBuild(data, *builds[b]);
+        memcpy(&data[buildsOffset + b * sizeof(ModelFileBuild)], &build, sizeof(build));
+    }
+
+    FILE * fp = fopen(path, "wb");
+    if (!fp)
+    {
+        std::cerr << "Could not open " << path << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(&data[0], 1, data.size(), fp) == data.size();
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+    {
+        std::cerr << "Could not write " << path << std::endl;
+        remove(path);
+    }
+    return ok;
+}
+
+void facedetect_set_parallel(facedetect_parallel_func parallel, void * ctx, int threads)
+{
+    g_facedetectParallel.func = parallel;
+    g_facedetectParallel.ctx = ctx;
+    g_facedetectParallel.threads = parallel ? MAX(1, threads) : 1;
+}
+
+bool facedetect_set_isa(const char * isa)
+{
+    for (int i = 0; i < g_numKernels; i++)
+    {
+        if (isa && strcmp(isa, g_pKernelList[i]->name) == 0 && g_pKernelList[i]->supported())
+        {
+            g_pKernels = g_pKernelList[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const char * facedetect_get_isa()
+{
+    return g_pKernels ? g_pKernels->name : "none";
+}
+
+void facedetect_init()
+{
+    for (int i = 0; !g_pKernels && i < g_numKernels; i++)
+    {
+        if (g_pKernelList[i]->supported())
+            g_pKernels = g_pKernelList[i];
+    }
+
+    g_pKernels->init();
+}
+
+void facedetect_set_int8(bool enable)
+{
+    for (int i = 0; i < g_numKernels; i++)
+        g_pKernelList[i]->set_int8(enable);
+}
+
+void facedetect_set_fp16(bool enable)
+{
+    for (int i = 0; i < g_numKernels; i++)
+        g_pKernelList[i]->set_fp16(enable);
+}
+
+void facedetect_set_rgb(bool enable)
+{
+    for (int i = 0; i < g_numKernels; i++)
+        g_pKernelList[i]->set_rgb(enable);
+}
+
+void facedetect_set_depth_first(bool enable)
+{
+    for (int i = 0; i < g_numKernels; i++)
+        g_pKernelList[i]->set_depth_first(enable);
+}
+
+void facedetect_calibrate_int8(unsigned char * rgb_image_data, int width, int height, int step)
+{
+    if (!g_pKernels)
+        facedetect_init();
+
+    g_pKernels->calibrate_int8(rgb_image_data, width, height, step);
+}
+
+//copies faces into result_buffer in the format returned by facedetect_cnn()
+static int* write_results(unsigned char * result_buffer, const std::vector<FaceRect> & faces)
+{
     int num_faces =(int)faces.size();
     num_faces = MIN(num_faces, 1024); //1024 = 0x9000 / (16 * 2 + 4)
 
@@ -245,3 +1063,64 @@ int* facedetect_cnn(unsigned char * result_buffer, //buffer memory for storing f
 
     return pCount;
 }
+
+int* facedetect_cnn(unsigned char * result_buffer, //buffer memory for storing face detection results, !!its size must be 0x9000 Bytes!!
+    unsigned char * rgb_image_data, int width, int height, int step) //input image, it must be BGR (three-channel) image!
+{
+    return facedetect_cnn_min_face(result_buffer, rgb_image_data, width, height, step, 0);
+}
+
+int* facedetect_cnn_min_face(unsigned char * result_buffer, unsigned char * rgb_image_data,
+    int width, int height, int step, int min_face)
+{
+
+    if (!result_buffer)
+    {
+        fprintf(stderr, "%s: null buffer memory.\n", __FUNCTION__);
+        return NULL;
+    }
+    //clear memory
+    result_buffer[0] = 0;
+    result_buffer[1] = 0;
+    result_buffer[2] = 0;
+    result_buffer[3] = 0;
+
+    if (!g_pKernels)
+        facedetect_init();
+
+    std::vector<FaceRect> faces = g_pKernels->detect(&rgb_image_data, 1, width, height, step, min_face)[0];
+
+    return write_results(result_buffer, faces);
+}
+
+int facedetect_cnn_batch(unsigned char ** result_buffers, //count buffers laid out like facedetect_cnn()'s, !!each 0x9000 Bytes!!
+    unsigned char ** rgb_images_data, int count, int width, int height, int step) //count BGR images, all of the same size and step
+{
+    if (!result_buffers || !rgb_images_data || count <= 0)
+    {
+        fprintf(stderr, "%s: null buffer memory.\n", __FUNCTION__);
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (!result_buffers[i])
+        {
+            fprintf(stderr, "%s: null buffer memory.\n", __FUNCTION__);
+            return 0;
+        }
+        memset(result_buffers[i], 0, 4);
+    }
+
+    if (!g_pKernels)
+        facedetect_init();
+
+    std::vector<std::vector<FaceRect>> faces = g_pKernels->detect(rgb_images_data, count, width, height, step, 0);
+
+    for (int i = 0; i < count; i++)
+        write_results(result_buffers[i], faces[i]);
+
+    return count;
+}
+
+#endif //FACEDETECT_ISA_GENERIC
@@ -0,0 +1,121 @@
+/*
+Writes the weight tables of every network build in this binary, packed the
+way init_parameters() leaves them, to a C++ source file:
+
+  facedetectcnn-pack <out.cpp>
+  facedetectcnn-pack --model <out.fdcn>
+
+Run at build time (see build.sh) and compiled in with -DFACEDETECT_PACKED.
+init_parameters() then points the layers at the static tables instead of
+copying facedetectcnn-data.cpp into new blobs, packing and quantizing them
+on every start. The layouts depend on the instruction set, so a build the
+CPU running this can't execute is left out and packs itself at startup.
+
+With --model it writes the built in weights as a model file for
+facedetect_load_model() instead, with the same tables for the builds this
+CPU can run.
+*/
+
+#include "facedetectcnn.h"
+
+#include <stdio.h>
+
+namespace generic { extern const FaceDetectKernels kernels; }
+#if defined(__x86_64__) || defined(__i386__)
+namespace avx2 { extern const FaceDetectKernels kernels; }
+namespace avx512 { extern const FaceDetectKernels kernels; }
+namespace avx512vnni { extern const FaceDetectKernels kernels; }
+#endif
+
+static void writeBlob(FILE * fp, const PackedBlob & b)
+{
+    fprintf(fp, "{%zu, %d, %d, %d, %d}", b.offset, b.rows, b.cols, b.channels, b.channelStep);
+}
+
+static bool writeBuild(FILE * fp, const FaceDetectKernels & kernels)
+{
+    fprintf(fp, "namespace %s {\n\n", kernels.name);
+
+    if (!kernels.supported())
+    {
+        std::cerr << "Not packing " << kernels.name << ", this CPU can't run it" << std::endl;
+        fprintf(fp, "extern const PackedModel param_packed = {NULL, 0, NULL, 0};\n\n");
+        fprintf(fp, "} //namespace %s\n\n", kernels.name);
+        return true;
+    }
+
+    std::vector<unsigned char> data;
+    std::vector<PackedFilters> filters;
+    kernels.pack(data, filters);
+    data.resize((data.size() + 3) / 4 * 4);
+
+    //as 32-bit words in this machine's byte order, the one it's built for
+    fprintf(fp, "alignas(64) static unsigned int packed_data[%zu] = {", data.size() / 4);
+    for (size_t i = 0; i < data.size(); i += 4)
+    {
+        unsigned int word;
+        memcpy(&word, &data[i], 4);
+        fprintf(fp, "%s0x%08x,", (i % 64 == 0) ? "\n" : "", word);
+    }
+    fprintf(fp, "\n};\n\n");
+
+    fprintf(fp, "static const PackedFilters packed_filters[%zu] = {\n", filters.size());
+    for (size_t i = 0; i < filters.size(); i++)
+    {
+        const PackedFilters & f = filters[i];
+        const PackedBlob * blobs[6] = {&f.weights, &f.biases, &f.weights_p, &f.weights_q, &f.scales_q, &f.biases_q};
+
+        fprintf(fp, "    {");
+        for (int b = 0; b < 6; b++)
+        {
+            writeBlob(fp, *blobs[b]);
+            fprintf(fp, ", ");
+        }
+        fprintf(fp, "%s, %.9ef},\n", f.has_int8 ? "true" : "false", f.act_max);
+    }
+    fprintf(fp, "};\n\n");
+
+    fprintf(fp, "extern const PackedModel param_packed = {(unsigned char *)packed_data, sizeof(packed_data), packed_filters, %zu};\n\n", filters.size());
+    fprintf(fp, "} //namespace %s\n\n", kernels.name);
+
+    std::cerr << "Packed " << kernels.name << ": " << data.size() << " bytes" << std::endl;
+    return !ferror(fp);
+}
+
+int main(int argc, char ** argv)
+{
+    if (argc == 3 && strcmp(argv[1], "--model") == 0)
+        return facedetect_save_model(argv[2]) ? 0 : 1;
+
+    if (argc != 2)
+    {
+        std::cerr << "Usage: facedetectcnn-pack <out.cpp>" << std::endl;
+        std::cerr << "       facedetectcnn-pack --model <out.fdcn>" << std::endl;
+        return 1;
+    }
+
+    FILE * fp = fopen(argv[1], "w");
+    if (!fp)
+    {
+        std::cerr << "Could not open " << argv[1] << std::endl;
+        return 1;
+    }
+
+    fprintf(fp, "// Generated at build time by facedetectcnn-pack, do not edit\n");
+    fprintf(fp, "#include \"facedetectcnn.h\"\n\n");
+
+    bool ok = writeBuild(fp, generic::kernels);
+#if defined(__x86_64__) || defined(__i386__)
+    ok = ok && writeBuild(fp, avx2::kernels);
+    ok = ok && writeBuild(fp, avx512::kernels);
+    ok = ok && writeBuild(fp, avx512vnni::kernels);
+#endif
+
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok)
+    {
+        std::cerr << "Could not write " << argv[1] << std::endl;
+        remove(argv[1]);
+    }
+    return ok ? 0 : 1;
+}
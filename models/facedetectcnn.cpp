@@ -40,6 +40,10 @@ the use of this software, even if advised of the possibility of such damage.
 #include <cmath>
 #include <float.h> //for FLT_EPSION
 #include <algorithm>//for stable_sort, sort
+#include <limits.h> //for INT_MAX
+#include <chrono>   //for sparsifyFilters()
+
+namespace FACEDETECT_ISA {
 
 typedef struct NormalizedBBox_
 {
@@ -78,50 +82,352 @@ void myFree_(void* ptr)
 	}
 }
 
+/*
+Inference workspace
+
+The network creates and drops the same sequence of blobs on every run at a
+given input size. The first run at a size records that sequence: the size of
+every blob and when it was created and freed. The blobs are then laid out in
+one buffer so that two of them only share bytes if they are never alive at
+the same time. Later runs at that size hand out the planned slots in order
+and never touch the heap for blob memory.
+
+A workspace keeps the plans of the last few input sizes, so runs that take
+turns between sizes, like the windows around faces of different sizes in
+one frame, don't record and plan again every time. The plans share the
+workspace's buffer, it grows to the largest of them.
+
+Each thread has a small stack of workspaces, one per run in progress on it.
+A thread waiting on the tasks of a layer runs other queued work meanwhile,
+which can be a whole other run, and that run gets the next workspace up
+instead of replaying its plan over the blobs of the one it interrupted.
+*/
+typedef struct BlobRecord_
+{
+    size_t size;
+    size_t offset;
+    int created; //event index
+    int freed;   //event index, INT_MAX if still alive at the end
+} BlobRecord;
+
+//input sizes a workspace keeps plans for, the least recently used one is
+//replaced by a new size
+#define MAX_WORKSPACE_PLANS 4
 
-CDataBlob<float> setDataFrom3x3S2P1to1x1S1P0FromImage(const unsigned char* inputData, int imgWidth, int imgHeight, int imgChannels, int imgWidthStep, int padDivisor) {
-    if (imgChannels != 3) {
-        std::cerr << __FUNCTION__ << ": The input image must be a 3-channel RGB image." << std::endl;
-        exit(1);
+typedef struct WorkspacePlan_
+{
+    int width;
+    int height;
+    int count;
+
+    bool planned;
+    int lastUsed;
+
+    std::vector<BlobRecord> records;
+} WorkspacePlan;
+
+typedef struct InferenceWorkspace_
+{
+    WorkspacePlan plans[MAX_WORKSPACE_PLANS];
+    WorkspacePlan* plan; //of the run in progress
+    int uses;
+
+    bool active;
+    bool recording;
+
+    std::vector<std::pair<void*, int> > live; //recording only, blob pointer -> record
+    int events;
+    size_t next; //replay position in records
+
+    char* buffer;
+    size_t bufferSize;
+} InferenceWorkspace;
+
+//runs nested deeper than this allocate from the heap
+#define MAX_WORKSPACE_DEPTH 4
+
+static thread_local InferenceWorkspace g_workspaces[MAX_WORKSPACE_DEPTH];
+static thread_local int g_workspaceDepth = 0;
+
+//the workspace of the innermost run on this thread, NULL if there's none
+static InferenceWorkspace* currentWorkspace()
+{
+    int depth = g_workspaceDepth;
+    return (depth > 0 && depth <= MAX_WORKSPACE_DEPTH) ? &g_workspaces[depth - 1] : NULL;
+}
+
+static size_t alignSize(size_t size)
+{
+    return (size + _MALLOC_ALIGN - 1) & ~(size_t)(_MALLOC_ALIGN - 1);
+}
+
+//first fit, biggest blobs first
+static void planWorkspace(InferenceWorkspace* ws)
+{
+    std::vector<BlobRecord>& records = ws->plan->records;
+
+    std::vector<int> order(records.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = (int)i;
+    std::stable_sort(order.begin(), order.end(), [&records](int a, int b) { return records[a].size > records[b].size; });
+
+    std::vector<int> placed;
+    size_t total = 0;
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        BlobRecord& r = records[order[i]];
+        size_t size = alignSize(r.size);
+        size_t offset = 0;
+
+        //move past every placed blob that is alive at the same time and
+        //overlaps, until a gap fits
+        bool moved = true;
+        while (moved)
+        {
+            moved = false;
+            for (size_t j = 0; j < placed.size(); j++)
+            {
+                const BlobRecord& o = records[placed[j]];
+                bool alive = r.created < o.freed && o.created < r.freed;
+                bool overlap = offset < o.offset + alignSize(o.size) && o.offset < offset + size;
+                if (alive && overlap)
+                {
+                    offset = o.offset + alignSize(o.size);
+                    moved = true;
+                }
+            }
+        }
+
+        r.offset = offset;
+        placed.push_back(order[i]);
+        total = MAX(total, offset + size);
     }
-    if (padDivisor != 32) {
-        std::cerr << __FUNCTION__ << ": This version need pad of 32" << std::endl;
-        exit(1);
+
+    //the other plans fit in a bigger buffer as well
+    if (ws->buffer && ws->bufferSize < total)
+    {
+        myFree(&ws->buffer);
+        ws->bufferSize = 0;
+    }
+    if (!ws->buffer)
+    {
+        ws->buffer = (char*)myAlloc(MAX(total, (size_t)1));
+        ws->bufferSize = ws->buffer ? total : 0;
     }
-    int rows = ((imgHeight - 1) / padDivisor + 1) * padDivisor / 2;
-    int cols = ((imgWidth - 1) / padDivisor + 1 ) * padDivisor / 2;
-    int channels = 32;
-    CDataBlob<float> outBlob(rows, cols, channels);
 
-#if defined(_OPENMP)
-#pragma omp parallel for
-#endif
-    for (int r = 0; r < rows; r++) {
-        for (int c = 0; c < cols; c++) {
-            float* pData = outBlob.ptr(r, c);
-            for (int fy = -1; fy <= 1; fy++) {
-                int srcy = r * 2 + fy;
-                
-                if (srcy < 0 || srcy >= imgHeight) //out of the range of the image
-                    continue;
+    ws->plan->planned = (ws->buffer != nullptr);
+    for (int i = 0; !ws->buffer && i < MAX_WORKSPACE_PLANS; i++)
+        ws->plans[i].planned = false;
+}
 
-                for (int fx = -1; fx <= 1; fx++) {
-                    int srcx = c * 2 + fx;
+//the plan for this input size, or the one to record it in
+static WorkspacePlan* findWorkspacePlan(InferenceWorkspace* ws, int width, int height, int count)
+{
+    WorkspacePlan* oldest = &ws->plans[0];
+    for (int i = 0; i < MAX_WORKSPACE_PLANS; i++)
+    {
+        WorkspacePlan* plan = &ws->plans[i];
+        if (plan->width == width && plan->height == height && plan->count == count)
+            return plan;
+        if (plan->lastUsed < oldest->lastUsed)
+            oldest = plan;
+    }
 
-                    if (srcx < 0 || srcx >= imgWidth) //out of the range of the image
-                        continue;
+    oldest->width = width;
+    oldest->height = height;
+    oldest->count = count;
+    oldest->planned = false;
+    oldest->records.clear();
+    return oldest;
+}
 
-                    const unsigned char * pImgData = inputData + size_t(imgWidthStep) * srcy + imgChannels * srcx;
+void workspaceBegin(int width, int height, int count)
+{
+    g_workspaceDepth++;
+
+    InferenceWorkspace* ws = currentWorkspace();
+    if (!ws)
+        return;
+
+    ws->plan = findWorkspacePlan(ws, width, height, count);
+    ws->plan->lastUsed = ++ws->uses;
+    if (!ws->plan->planned)
+        ws->plan->records.clear();
+    ws->live.clear();
+
+    ws->active = true;
+    ws->recording = !ws->plan->planned;
+    ws->events = 0;
+    ws->next = 0;
+}
 
-                    int output_channel_offset = ((fy + 1) * 3 + fx + 1) ; //3x3 filters, 3-channel image
-                    pData[output_channel_offset * imgChannels] = pImgData[0];
-                    pData[output_channel_offset * imgChannels + 1] = pImgData[1];
-                    pData[output_channel_offset * imgChannels + 2] = pImgData[2];
-                }
-            }                    
+void workspaceEnd()
+{
+    InferenceWorkspace* ws = currentWorkspace();
+    g_workspaceDepth--;
+
+    if (!ws)
+        return;
+
+    if (ws->recording)
+    {
+        //whatever is still alive is kept apart from everything after it
+        for (size_t i = 0; i < ws->live.size(); i++)
+        {
+            ws->plan->records[ws->live[i].second].freed = INT_MAX;
+            myFree_(ws->live[i].first);
         }
-    } 
-    return outBlob;
+        ws->live.clear();
+        planWorkspace(ws);
+    }
+
+    ws->active = false;
+    ws->recording = false;
+}
+
+void* blobAlloc(size_t size)
+{
+    InferenceWorkspace* ws = currentWorkspace();
+
+    if (ws && ws->active && ws->recording)
+    {
+        void* ptr = myAlloc(size);
+        if (ptr)
+        {
+            BlobRecord r = {size, 0, ws->events++, INT_MAX};
+            ws->live.push_back(std::make_pair(ptr, (int)ws->plan->records.size()));
+            ws->plan->records.push_back(r);
+        }
+        return ptr;
+    }
+
+    if (ws && ws->active && ws->plan->planned)
+    {
+        std::vector<BlobRecord>& records = ws->plan->records;
+        if (ws->next < records.size() && records[ws->next].size == size)
+            return ws->buffer + records[ws->next++].offset;
+
+        //the run went differently than the recorded one, plan again next time
+        ws->plan->planned = false;
+    }
+
+    return myAlloc(size);
+}
+
+//memory the layers' blobs point into without owning it: the weight tables
+//packed at build time and the mapped model file
+#define MAX_STATIC_DATA 4
+
+typedef struct StaticData_
+{
+    const char* data;
+    size_t size;
+} StaticData;
+
+static StaticData g_staticData[MAX_STATIC_DATA];
+static int g_numStaticData = 0;
+
+void addStaticData(const void * data, size_t size)
+{
+    for (int i = 0; i < g_numStaticData; i++)
+    {
+        if (g_staticData[i].data == data)
+            return;
+    }
+
+    if (g_numStaticData < MAX_STATIC_DATA)
+    {
+        StaticData d = {(const char*)data, size};
+        g_staticData[g_numStaticData++] = d;
+    }
+}
+
+static bool isStaticData(const void * ptr)
+{
+    for (int i = 0; i < g_numStaticData; i++)
+    {
+        if ((const char*)ptr >= g_staticData[i].data && (const char*)ptr < g_staticData[i].data + g_staticData[i].size)
+            return true;
+    }
+    return false;
+}
+
+void blobFree(void* ptr)
+{
+    for (int i = 0; i < MAX_WORKSPACE_DEPTH; i++)
+    {
+        const InferenceWorkspace* slots = &g_workspaces[i];
+        if (slots->buffer && (char*)ptr >= slots->buffer && (char*)ptr < slots->buffer + slots->bufferSize)
+            return; //a workspace slot
+    }
+
+    InferenceWorkspace* ws = currentWorkspace();
+
+    if (isStaticData(ptr))
+        return; //see addStaticData()
+
+    if (ws && ws->active && ws->recording)
+    {
+        for (size_t i = 0; i < ws->live.size(); i++)
+        {
+            if (ws->live[i].first == ptr)
+            {
+                ws->plan->records[ws->live[i].second].freed = ws->events++;
+                ws->live.erase(ws->live.begin() + i);
+                break;
+            }
+        }
+    }
+
+    myFree_(ptr);
+}
+
+
+static bool g_int8 = false;
+static bool g_calibrating = false;
+
+//work (about one multiply-add each) a task should get at least, below
+//that handing rows to other threads costs more than it saves
+#define PARALLEL_MIN_WORK (1 << 17)
+
+//number of tasks to split rows worth work_per_row each into
+static int parallelTasks(int rows, size_t work_per_row)
+{
+    const FaceDetectParallel & p = g_facedetectParallel;
+
+    //calibration gathers ranges into the filters as it goes
+    if (!p.func || p.threads <= 1 || g_calibrating)
+        return 1;
+
+    size_t tasks = size_t(rows) * work_per_row / PARALLEL_MIN_WORK;
+    return (int)MAX((size_t)1, MIN(tasks, (size_t)MIN(rows, p.threads)));
+}
+
+//runs body(i) for i in [0, tasks)
+template <typename Body>
+static void parallelFor(int tasks, const Body & body)
+{
+    if (tasks <= 1)
+    {
+        body(0);
+        return;
+    }
+
+    g_facedetectParallel.func(g_facedetectParallel.ctx, [](void * arg, int i) {
+        (*(const Body *)arg)(i);
+    }, (void *)&body, tasks);
+}
+
+//runs body(begin, end) over [0, rows), split by parallelTasks()
+template <typename Body>
+static void parallelRows(int rows, size_t work_per_row, const Body & body)
+{
+    int tasks = parallelTasks(rows, work_per_row);
+
+    parallelFor(tasks, [&](int i) {
+        body(int(int64_t(rows) * i / tasks), int(int64_t(rows) * (i + 1) / tasks));
+    });
 }
 
 //p1 and p2 must be 512-bit aligned (16 float numbers)
@@ -215,139 +521,1095 @@ inline bool vecMulAdd(const float * p1, const float * p2, float * p3, int num)
     return true;
 }
 
-inline bool vecAdd(const float * p1, float * p2, int num)
+inline bool vecAdd(const float * p1, float * p2, int num)
+{
+#if defined(_ENABLE_AVX512)
+    __m512 a_float_x16, b_float_x16;
+    for (int i = 0; i < num; i += 16)
+    {
+        a_float_x16 = _mm512_load_ps(p1 + i);
+        b_float_x16 = _mm512_load_ps(p2 + i);
+        b_float_x16 = _mm512_add_ps(a_float_x16, b_float_x16);
+        _mm512_store_ps(p2 + i, b_float_x16);
+    }
+#elif defined(_ENABLE_AVX2)
+    __m256 a_float_x8, b_float_x8;
+    for (int i = 0; i < num; i += 8)
+    {
+        a_float_x8 = _mm256_load_ps(p1 + i);
+        b_float_x8 = _mm256_load_ps(p2 + i);
+        b_float_x8 = _mm256_add_ps(a_float_x8, b_float_x8);
+        _mm256_store_ps(p2 + i, b_float_x8);
+    }
+#elif defined(_ENABLE_NEON)
+    float32x4_t a_float_x4, b_float_x4, c_float_x4;
+    for (int i = 0; i < num; i+=4)
+    {
+        a_float_x4 = vld1q_f32(p1 + i);
+        b_float_x4 = vld1q_f32(p2 + i);
+        c_float_x4 = vaddq_f32(a_float_x4, b_float_x4);
+        vst1q_f32(p2 + i, c_float_x4);
+    }
+#else
+    for(int i = 0; i < num; i++)
+    {
+        p2[i] += p1[i];
+    }
+#endif
+    return true;
+}
+
+inline bool vecAdd(const float * p1, const float * p2, float* p3, int num)
+{
+#if defined(_ENABLE_AVX512)
+    __m512 a_float_x16, b_float_x16;
+    for (int i = 0; i < num; i += 16)
+    {
+        a_float_x16 = _mm512_load_ps(p1 + i);
+        b_float_x16 = _mm512_load_ps(p2 + i);
+        b_float_x16 = _mm512_add_ps(a_float_x16, b_float_x16);
+        _mm512_store_ps(p3 + i, b_float_x16);
+    }
+#elif defined(_ENABLE_AVX2)
+    __m256 a_float_x8, b_float_x8;
+    for (int i = 0; i < num; i += 8)
+    {
+        a_float_x8 = _mm256_load_ps(p1 + i);
+        b_float_x8 = _mm256_load_ps(p2 + i);
+        b_float_x8 = _mm256_add_ps(a_float_x8, b_float_x8);
+        _mm256_store_ps(p3 + i, b_float_x8);
+    }
+#elif defined(_ENABLE_NEON)
+    float32x4_t a_float_x4, b_float_x4, c_float_x4;
+    for (int i = 0; i < num; i+=4)
+    {
+        a_float_x4 = vld1q_f32(p1 + i);
+        b_float_x4 = vld1q_f32(p2 + i);
+        c_float_x4 = vaddq_f32(a_float_x4, b_float_x4);
+        vst1q_f32(p3 + i, c_float_x4);
+    }
+#else
+    for(int i = 0; i < num; i++)
+    {
+        p3[i] = p1[i] + p2[i];
+    }
+#endif
+    return true;
+}
+
+inline void vecRelu(float * p, int num)
+{
+#if defined(_ENABLE_AVX512)
+    __m512 zeros = _mm512_setzero_ps();
+    for (int i = 0; i < num; i += 16)
+        _mm512_store_ps(p + i, _mm512_max_ps(_mm512_load_ps(p + i), zeros));
+#elif defined(_ENABLE_AVX2)
+    __m256 zeros = _mm256_setzero_ps();
+    for (int i = 0; i < num; i += 8)
+        _mm256_store_ps(p + i, _mm256_max_ps(_mm256_load_ps(p + i), zeros));
+#else
+    for (int i = 0; i < num; i++)
+        p[i] *= (p[i] > 0);
+#endif
+}
+
+inline void vecMax(const float * p1, float * p2, int num)
+{
+#if defined(_ENABLE_AVX512)
+    for (int i = 0; i < num; i += 16)
+        _mm512_store_ps(p2 + i, _mm512_max_ps(_mm512_load_ps(p1 + i), _mm512_load_ps(p2 + i)));
+#elif defined(_ENABLE_AVX2)
+    for (int i = 0; i < num; i += 8)
+        _mm256_store_ps(p2 + i, _mm256_max_ps(_mm256_load_ps(p1 + i), _mm256_load_ps(p2 + i)));
+#elif defined(_ENABLE_NEON)
+    for (int i = 0; i < num; i += 4)
+        vst1q_f32(p2 + i, vmaxq_f32(vld1q_f32(p1 + i), vld1q_f32(p2 + i)));
+#else
+    for (int i = 0; i < num; i++)
+        p2[i] = MAX(p1[i], p2[i]);
+#endif
+}
+
+/*
+FP16 activations
+
+With facedetect_set_fp16() the blobs between the first layer and the heads
+are stored as IEEE half floats. The layers convert them to float right where
+they are read and back where they are written, all the math stays in float.
+The conversions work on whole vectors like the functions above, num is
+rounded up to the vector width and blobs are padded to it.
+*/
+//floats converted at once on the stack, a multiple of every vector width
+#define FP16_CHUNK 64
+
+#if !defined(_ENABLE_AVX512) && !defined(_ENABLE_AVX2) && !defined(_ENABLE_NEON)
+static inline float halfToFloat(fp16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0x1f) //inf, nan
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    else if (exponent)
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    else if (mantissa) //subnormal
+    {
+        exponent = 113;
+        while (!(mantissa & 0x400))
+        {
+            mantissa <<= 1;
+            exponent--;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    else
+        bits = sign;
+
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+//rounds to nearest even like F16C
+static inline fp16_t floatToHalf(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    uint32_t sign = (bits >> 16) & 0x8000;
+    bits &= 0x7fffffff;
+
+    if (bits >= 0x47800000) //too big, inf or nan
+        return fp16_t(sign | (bits > 0x7f800000 ? 0x7e00 : 0x7c00));
+
+    if (bits < 0x38800000) //subnormal or zero, let the float adder round it
+    {
+        float magic = 0.5f;
+        uint32_t magicBits;
+        memcpy(&magicBits, &magic, sizeof(magicBits));
+        memcpy(&f, &bits, sizeof(f));
+        f += magic;
+        memcpy(&bits, &f, sizeof(bits));
+        return fp16_t(sign | (bits - magicBits));
+    }
+
+    uint32_t odd = (bits >> 13) & 1;
+    bits += 0xc8000fff + odd; //rebias the exponent and round
+    return fp16_t(sign | (bits >> 13));
+}
+#endif
+
+inline void vecFromHalf(const fp16_t * p1, float * p2, int num)
+{
+#if defined(_ENABLE_AVX512)
+    for (int i = 0; i < num; i += 16)
+        _mm512_store_ps(p2 + i, _mm512_cvtph_ps(_mm256_load_si256((const __m256i *)(p1 + i))));
+#elif defined(_ENABLE_AVX2)
+    for (int i = 0; i < num; i += 8)
+        _mm256_store_ps(p2 + i, _mm256_cvtph_ps(_mm_load_si128((const __m128i *)(p1 + i))));
+#elif defined(_ENABLE_NEON)
+    for (int i = 0; i < num; i += 4)
+        vst1q_f32(p2 + i, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(p1 + i))));
+#else
+    for (int i = 0; i < num; i++)
+        p2[i] = halfToFloat(p1[i]);
+#endif
+}
+
+inline void vecToHalf(const float * p1, fp16_t * p2, int num)
+{
+#if defined(_ENABLE_AVX512)
+    for (int i = 0; i < num; i += 16)
+        _mm256_store_si256((__m256i *)(p2 + i), _mm512_cvtps_ph(_mm512_load_ps(p1 + i), _MM_FROUND_TO_NEAREST_INT));
+#elif defined(_ENABLE_AVX2)
+    for (int i = 0; i < num; i += 8)
+        _mm_store_si128((__m128i *)(p2 + i), _mm256_cvtps_ph(_mm256_load_ps(p1 + i), _MM_FROUND_TO_NEAREST_INT));
+#elif defined(_ENABLE_NEON)
+    for (int i = 0; i < num; i += 4)
+        vst1_u16(p2 + i, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(p1 + i))));
+#else
+    for (int i = 0; i < num; i++)
+        p2[i] = floatToHalf(p1[i]);
+#endif
+}
+
+//num values at p as float: p itself, or converted into pBuffer
+static inline const float * floatValues(const float * p, float * pBuffer, int num) { return p; }
+static inline const float * floatValues(const fp16_t * p, float * pBuffer, int num)
+{
+    vecFromHalf(p, pBuffer, num);
+    return pBuffer;
+}
+
+//where to compute num floats going to p: p itself, or pBuffer to be
+//stored with storeValues()
+static inline float * floatTarget(float * p, float * pBuffer) { return p; }
+static inline float * floatTarget(fp16_t * p, float * pBuffer) { return pBuffer; }
+static inline void storeValues(const float * pBuffer, float * p, int num) {}
+static inline void storeValues(const float * pBuffer, fp16_t * p, int num) { vecToHalf(pBuffer, p, num); }
+
+//a row of cols pixels of a blob as float, converted into row index of buffer if needed
+static inline const float * floatRow(const CDataBlob<float> & blob, int r, CDataBlob<float> & buffer, int index, int & step)
+{
+    step = blob.channelStep / sizeof(float);
+    return blob.ptr(r, 0);
+}
+static inline const float * floatRow(const CDataBlob<fp16_t> & blob, int r, CDataBlob<float> & buffer, int index, int & step)
+{
+    int inStep = blob.channelStep / sizeof(fp16_t);
+    step = buffer.channelStep / sizeof(float);
+
+    const fp16_t * pIn = blob.ptr(r, 0);
+    float * pOut = buffer.ptr(index, 0);
+    for (int c = 0; c < blob.cols; c++)
+        vecFromHalf(pIn + size_t(c) * inStep, pOut + size_t(c) * step, blob.channels);
+    return pOut;
+}
+
+//where to compute row r of a blob as float, and storing it back
+static inline float * floatTargetRow(CDataBlob<float> & blob, int r, CDataBlob<float> & buffer, int index, int & step)
+{
+    step = blob.channelStep / sizeof(float);
+    return blob.ptr(r, 0);
+}
+static inline float * floatTargetRow(CDataBlob<fp16_t> & blob, int r, CDataBlob<float> & buffer, int index, int & step)
+{
+    step = buffer.channelStep / sizeof(float);
+    return buffer.ptr(index, 0);
+}
+static inline void storeRow(CDataBlob<float> & blob, int r, const CDataBlob<float> & buffer, int index) {}
+static inline void storeRow(CDataBlob<fp16_t> & blob, int r, const CDataBlob<float> & buffer, int index)
+{
+    int outStep = blob.channelStep / sizeof(fp16_t);
+    int step = buffer.channelStep / sizeof(float);
+
+    const float * pIn = buffer.ptr(index, 0);
+    fp16_t * pOut = blob.ptr(r, 0);
+    for (int c = 0; c < blob.cols; c++)
+        vecToHalf(pIn + size_t(c) * step, pOut + size_t(c) * outStep, blob.channels);
+}
+
+void setInt8(bool enable)
+{
+    g_int8 = enable;
+}
+
+void setCalibrating(bool enable)
+{
+    g_calibrating = enable;
+}
+
+/*
+INT8 point wise layers
+
+The inputs of every point wise layer are ReLU outputs, so they are quantized
+to [0, _MAX_UINT8_VALUE] with one scale per layer, calibrated on sample
+images (act_max). The weights get one scale per filter and are stored as
+INT8, 4 input channels at a time for 16 filters side by side:
+
+    weights_q[k][f][i] = weight of filter f for input channel 4k+i
+
+so a single broadcast of 4 input bytes feeds a u8*s8 dot product of 16
+filters at once (vpdpbusd in the avx512vnni build, maddubs + madd in the
+others). The 32-bit sums are turned back into float with the two scales and
+the bias, the depth wise layers after them stay in float.
+*/
+bool quantizeFilters(Filters<float> & filters, float act_max)
+{
+    filters.has_int8 = false;
+    filters.act_max = act_max;
+
+    if (!filters.is_pointwise || filters.is_depthwise || act_max <= 0.f ||
+        filters.channels % 4 != 0 || filters.channels > 256 || filters.num_filters > 256)
+        return false;
+
+    int groups = filters.channels / 4;
+    int padded = (filters.num_filters + 15) / 16 * 16;
+
+    filters.weights_q.create(1, groups, padded * 4);
+    filters.scales_q.create(1, 1, padded);
+    filters.biases_q.create(1, 1, padded);
+    filters.weights_q.setZero();
+    filters.scales_q.setZero();
+    filters.biases_q.setZero();
+
+    float act_scale = act_max / _MAX_UINT8_VALUE;
+
+    for (int f = 0; f < filters.num_filters; f++)
+    {
+        const float * pW = filters.weights.ptr(0, f);
+
+        float w_max = 0.f;
+        for (int ch = 0; ch < filters.channels; ch++)
+            w_max = MAX(w_max, std::fabs(pW[ch]));
+
+        float w_scale = (w_max > 0.f) ? w_max / 127.f : 1.f;
+
+        for (int ch = 0; ch < filters.channels; ch++)
+        {
+            int q = (int)std::lround(pW[ch] / w_scale);
+            filters.weights_q.ptr(0, ch / 4)[f * 4 + ch % 4] = (signed char)MAX(-127, MIN(127, q));
+        }
+
+        filters.scales_q.data[f] = act_scale * w_scale;
+        filters.biases_q.data[f] = filters.biases.data[f];
+    }
+
+    filters.has_int8 = true;
+    return true;
+}
+
+#if defined(_ENABLE_AVX512)
+static inline __m512i dotProductU8S8x16(__m512i acc, __m512i a, __m512i b)
+{
+#if defined(_ENABLE_AVX512VNNI)
+    return _mm512_dpbusd_epi32(acc, a, b);
+#else
+    __m512i p = _mm512_maddubs_epi16(a, b);
+    return _mm512_add_epi32(acc, _mm512_madd_epi16(p, _mm512_set1_epi16(1)));
+#endif
+}
+#elif defined(_ENABLE_AVX2)
+static inline __m256i dotProductU8S8x8(__m256i acc, __m256i a, __m256i b)
+{
+    __m256i p = _mm256_maddubs_epi16(a, b);
+    return _mm256_add_epi32(acc, _mm256_madd_epi16(p, _mm256_set1_epi16(1)));
+}
+#endif
+
+//INT8 version of convolution_1x1pointwiseRow()
+inline void convolution_1x1pointwiseRowInt8(const float * pIn, int inStep, const Filters<float> & filters, float * pOut, int outStep, int cols)
+{
+    int channels = filters.channels;
+    int groups = channels / 4;
+    int num_filters = filters.num_filters;
+    const float inv_scale = _MAX_UINT8_VALUE / filters.act_max;
+    const float * pScales = filters.scales_q.data;
+    const float * pBiases = filters.biases_q.data;
+
+    alignas(64) unsigned char q[256];
+
+    for (int col = 0; col < cols; col++)
+    {
+        const float * pI = pIn + size_t(col) * inStep;
+        float * pO = pOut + size_t(col) * outStep;
+
+        for (int ch = 0; ch < channels; ch++)
+            q[ch] = (unsigned char)MIN(pI[ch] * inv_scale + 0.5f, (float)_MAX_UINT8_VALUE);
+
+#if defined(_ENABLE_AVX512)
+        //4 registers of 16 filters at a time
+        int used = (num_filters + 15) / 16 * 16;
+        for (int f0 = 0; f0 < used; f0 += 64)
+        {
+            int blocks = MIN(4, (used - f0) / 16);
+            __m512i acc[4] = {_mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512(), _mm512_setzero_si512()};
+
+            for (int k = 0; k < groups; k++)
+            {
+                int q4;
+                memcpy(&q4, q + 4 * k, 4);
+                __m512i a = _mm512_set1_epi32(q4);
+                const signed char * pW = filters.weights_q.ptr(0, k) + f0 * 4;
+                for (int b = 0; b < blocks; b++)
+                    acc[b] = dotProductU8S8x16(acc[b], a, _mm512_load_si512(pW + b * 64));
+            }
+
+            for (int b = 0; b < blocks; b++)
+            {
+                int f = f0 + b * 16;
+                __m512 v = _mm512_fmadd_ps(_mm512_cvtepi32_ps(acc[b]), _mm512_load_ps(pScales + f), _mm512_load_ps(pBiases + f));
+                _mm512_store_ps(pO + f, v);
+            }
+        }
+#elif defined(_ENABLE_AVX2)
+        //the output pixel is only padded to 8 floats
+        int used = (num_filters + 7) / 8 * 8;
+        for (int f0 = 0; f0 < used; f0 += 32)
+        {
+            int blocks = MIN(4, (used - f0) / 8);
+            __m256i acc[4] = {_mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256(), _mm256_setzero_si256()};
+
+            for (int k = 0; k < groups; k++)
+            {
+                int q4;
+                memcpy(&q4, q + 4 * k, 4);
+                __m256i a = _mm256_set1_epi32(q4);
+                const signed char * pW = filters.weights_q.ptr(0, k) + f0 * 4;
+                for (int b = 0; b < blocks; b++)
+                    acc[b] = dotProductU8S8x8(acc[b], a, _mm256_load_si256((const __m256i *)(pW + b * 32)));
+            }
+
+            for (int b = 0; b < blocks; b++)
+            {
+                int f = f0 + b * 8;
+                __m256 v = _mm256_fmadd_ps(_mm256_cvtepi32_ps(acc[b]), _mm256_load_ps(pScales + f), _mm256_load_ps(pBiases + f));
+                _mm256_store_ps(pO + f, v);
+            }
+        }
+#else
+        //plain reference, only the SIMD builds make this faster than float
+        int sums[256];
+        memset(sums, 0, sizeof(int) * num_filters);
+        for (int k = 0; k < groups; k++)
+        {
+            const signed char * pW = filters.weights_q.ptr(0, k);
+            const unsigned char * pQ = q + 4 * k;
+            for (int f = 0; f < num_filters; f++)
+                sums[f] += pQ[0] * pW[f * 4] + pQ[1] * pW[f * 4 + 1] + pQ[2] * pW[f * 4 + 2] + pQ[3] * pW[f * 4 + 3];
+        }
+        for (int f = 0; f < num_filters; f++)
+            pO[f] = sums[f] * pScales[f] + pBiases[f];
+#endif
+    }
+}
+
+/*
+Packed 1x1 point wise layers
+
+A 1x1 conv over a row is a (pixels x channels) * (channels x filters) matrix
+product. The weights are transposed once at init so the filters of every
+input channel sit side by side:
+
+    weights_p[c][f] = weight of filter f for input channel c
+
+and the output is computed in tiles of PW_TILE_PIXELS pixels by up to
+PW_TILE_VECTORS vectors of filters, all kept in registers. Every step over
+the input channels loads the weight vectors once and broadcasts one input
+value per pixel, instead of reloading a pixel for every filter and reducing
+each dot product horizontally. Builds without SIMD keep the weights as they
+are and work on 2 pixels by 4 filters of dot products instead.
+*/
+#if defined(_ENABLE_AVX512)
+#define PW_LANES 16
+#define PW_TILE_PIXELS 6
+#define PW_TILE_VECTORS 4
+typedef __m512 pw_float;
+static inline pw_float pwLoad(const float * p) { return _mm512_load_ps(p); }
+static inline pw_float pwSet1(float x) { return _mm512_set1_ps(x); }
+static inline pw_float pwFmadd(pw_float a, pw_float b, pw_float c) { return _mm512_fmadd_ps(a, b, c); }
+static inline void pwStore(float * p, pw_float a) { _mm512_store_ps(p, a); }
+#elif defined(_ENABLE_AVX2)
+#define PW_LANES 8
+#define PW_TILE_PIXELS 4
+#define PW_TILE_VECTORS 3
+typedef __m256 pw_float;
+static inline pw_float pwLoad(const float * p) { return _mm256_load_ps(p); }
+static inline pw_float pwSet1(float x) { return _mm256_set1_ps(x); }
+static inline pw_float pwFmadd(pw_float a, pw_float b, pw_float c) { return _mm256_fmadd_ps(a, b, c); }
+static inline void pwStore(float * p, pw_float a) { _mm256_store_ps(p, a); }
+#elif defined(_ENABLE_NEON)
+#define PW_LANES 4
+#define PW_TILE_PIXELS 6
+#define PW_TILE_VECTORS 4
+typedef float32x4_t pw_float;
+static inline pw_float pwLoad(const float * p) { return vld1q_f32(p); }
+static inline pw_float pwSet1(float x) { return vdupq_n_f32(x); }
+static inline pw_float pwFmadd(pw_float a, pw_float b, pw_float c) { return vmlaq_f32(c, a, b); }
+static inline void pwStore(float * p, pw_float a) { vst1q_f32(p, a); }
+#endif
+
+#if defined(PW_LANES)
+//PIXELS x VECTORS*PW_LANES outputs starting at pOut
+template<int PIXELS, int VECTORS>
+static inline void pointwiseTile(const float * pIn, int inStep, const float * pW, int wStep, const float * pB, int channels, float * pOut, int outStep)
+{
+    pw_float acc[PIXELS][VECTORS];
+    for (int v = 0; v < VECTORS; v++)
+    {
+        pw_float b = pwLoad(pB + v * PW_LANES);
+        for (int p = 0; p < PIXELS; p++)
+            acc[p][v] = b;
+    }
+
+    for (int ch = 0; ch < channels; ch++)
+    {
+        pw_float w[VECTORS];
+        for (int v = 0; v < VECTORS; v++)
+            w[v] = pwLoad(pW + size_t(ch) * wStep + v * PW_LANES);
+
+        for (int p = 0; p < PIXELS; p++)
+        {
+            pw_float x = pwSet1(pIn[size_t(p) * inStep + ch]);
+            for (int v = 0; v < VECTORS; v++)
+                acc[p][v] = pwFmadd(x, w[v], acc[p][v]);
+        }
+    }
+
+    for (int p = 0; p < PIXELS; p++)
+        for (int v = 0; v < VECTORS; v++)
+            pwStore(pOut + size_t(p) * outStep + v * PW_LANES, acc[p][v]);
+}
+
+template<int PIXELS>
+static inline void pointwiseTile(int vectors, const float * pIn, int inStep, const float * pW, int wStep, const float * pB, int channels, float * pOut, int outStep)
+{
+    switch (vectors)
+    {
+    case 1: pointwiseTile<PIXELS, 1>(pIn, inStep, pW, wStep, pB, channels, pOut, outStep); break;
+    case 2: pointwiseTile<PIXELS, 2>(pIn, inStep, pW, wStep, pB, channels, pOut, outStep); break;
+    case 3: pointwiseTile<PIXELS, 3>(pIn, inStep, pW, wStep, pB, channels, pOut, outStep); break;
+#if PW_TILE_VECTORS >= 4
+    case 4: pointwiseTile<PIXELS, 4>(pIn, inStep, pW, wStep, pB, channels, pOut, outStep); break;
+#endif
+    }
+}
+
+//Most inputs of the point wise layers are 0 after the ReLU before them, but
+//scattered rather than in runs of channels. The sparse path lists the non
+//zero inputs of a pixel first and only multiplies those, two pixels at a
+//time. The outputs are summed in the same order as pointwiseTile(), leaving
+//out the x * w = 0 terms doesn't change them.
+#define PW_SPARSE_MAX_CHANNELS 256
+
+#if defined(_ENABLE_AVX2) && !defined(_ENABLE_AVX512)
+//for every 8-bit mask, the lanes it selects moved to the front and how many
+//there are, AVX2 has no compress
+typedef struct CompressTable_
+{
+    int lanes[256][8];
+    int count[256];
+
+    CompressTable_()
+    {
+        for (int m = 0; m < 256; m++)
+        {
+            count[m] = 0;
+            for (int i = 0; i < 8; i++)
+                lanes[m][i] = 0;
+            for (int i = 0; i < 8; i++)
+                if (m & (1 << i))
+                    lanes[m][count[m]++] = i;
+        }
+    }
+} CompressTable;
+
+static const CompressTable g_compressTable;
+#endif
+
+//the non zero inputs of the pixel at pIn among the channels set in pLive,
+//as values and offsets into weights_p. pX and pOffsets need room for 16
+//more, whole vectors are stored.
+static inline int pointwiseSparseInputs(const float * pIn, const unsigned int * pLive, int channels, int wStep, float * pX, int * pOffsets)
+{
+    int n = 0;
+#if defined(_ENABLE_AVX512)
+    __m512i offsets = _mm512_mullo_epi32(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15), _mm512_set1_epi32(wStep));
+    __m512i step = _mm512_set1_epi32(16 * wStep);
+    for (int ch = 0; ch < channels; ch += 16)
+    {
+        __m512 x = _mm512_loadu_ps(pIn + ch);
+        __mmask16 m = _mm512_cmp_ps_mask(x, _mm512_setzero_ps(), _CMP_NEQ_UQ) & (__mmask16)(pLive[ch / 32] >> (ch % 32));
+        _mm512_storeu_ps(pX + n, _mm512_maskz_compress_ps(m, x));
+        _mm512_storeu_si512(pOffsets + n, _mm512_maskz_compress_epi32(m, offsets));
+        n += __builtin_popcount(m);
+        offsets = _mm512_add_epi32(offsets, step);
+    }
+#elif defined(_ENABLE_AVX2)
+    __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(wStep));
+    __m256i step = _mm256_set1_epi32(8 * wStep);
+    for (int ch = 0; ch < channels; ch += 8)
+    {
+        __m256 x = _mm256_loadu_ps(pIn + ch);
+        int m = _mm256_movemask_ps(_mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_NEQ_UQ)) & ((pLive[ch / 32] >> (ch % 32)) & 0xff);
+        __m256i lanes = _mm256_loadu_si256((const __m256i *)g_compressTable.lanes[m]);
+        _mm256_storeu_ps(pX + n, _mm256_permutevar8x32_ps(x, lanes));
+        _mm256_storeu_si256((__m256i *)(pOffsets + n), _mm256_permutevar8x32_epi32(offsets, lanes));
+        n += g_compressTable.count[m];
+        offsets = _mm256_add_epi32(offsets, step);
+    }
+#else
+    for (int ch = 0; ch < channels; ch++)
+    {
+        pX[n] = pIn[ch];
+        pOffsets[n] = ch * wStep;
+        n += (pIn[ch] != 0.f) & (pLive[ch / 32] >> (ch % 32) & 1);
+    }
+#endif
+    return n;
+}
+
+//VECTORS*PW_LANES outputs of 2 pixels from their non zero inputs
+template<int VECTORS>
+static inline void pointwiseSparseTile(const float * pX0, const int * pOffsets0, int n0, const float * pX1, const int * pOffsets1, int n1,
+                                       const float * pW, const float * pB, float * pOut0, float * pOut1)
+{
+    pw_float acc0[VECTORS], acc1[VECTORS];
+    for (int v = 0; v < VECTORS; v++)
+        acc0[v] = acc1[v] = pwLoad(pB + v * PW_LANES);
+
+    int i = 0;
+    for (; i < MIN(n0, n1); i++)
+    {
+        const float * pW0 = pW + pOffsets0[i];
+        const float * pW1 = pW + pOffsets1[i];
+        pw_float x0 = pwSet1(pX0[i]);
+        pw_float x1 = pwSet1(pX1[i]);
+        for (int v = 0; v < VECTORS; v++)
+        {
+            acc0[v] = pwFmadd(x0, pwLoad(pW0 + v * PW_LANES), acc0[v]);
+            acc1[v] = pwFmadd(x1, pwLoad(pW1 + v * PW_LANES), acc1[v]);
+        }
+    }
+    for (int j = i; j < n0; j++)
+    {
+        pw_float x0 = pwSet1(pX0[j]);
+        for (int v = 0; v < VECTORS; v++)
+            acc0[v] = pwFmadd(x0, pwLoad(pW + pOffsets0[j] + v * PW_LANES), acc0[v]);
+    }
+    for (int j = i; j < n1; j++)
+    {
+        pw_float x1 = pwSet1(pX1[j]);
+        for (int v = 0; v < VECTORS; v++)
+            acc1[v] = pwFmadd(x1, pwLoad(pW + pOffsets1[j] + v * PW_LANES), acc1[v]);
+    }
+
+    for (int v = 0; v < VECTORS; v++)
+    {
+        pwStore(pOut1 + v * PW_LANES, acc1[v]);
+        pwStore(pOut0 + v * PW_LANES, acc0[v]);
+    }
+}
+
+static inline void pointwiseSparseTile(int vectors, const float * pX0, const int * pOffsets0, int n0, const float * pX1, const int * pOffsets1, int n1,
+                                       const float * pW, const float * pB, float * pOut0, float * pOut1)
+{
+    switch (vectors)
+    {
+    case 1: pointwiseSparseTile<1>(pX0, pOffsets0, n0, pX1, pOffsets1, n1, pW, pB, pOut0, pOut1); break;
+    case 2: pointwiseSparseTile<2>(pX0, pOffsets0, n0, pX1, pOffsets1, n1, pW, pB, pOut0, pOut1); break;
+    case 3: pointwiseSparseTile<3>(pX0, pOffsets0, n0, pX1, pOffsets1, n1, pW, pB, pOut0, pOut1); break;
+#if PW_TILE_VECTORS >= 4
+    case 4: pointwiseSparseTile<4>(pX0, pOffsets0, n0, pX1, pOffsets1, n1, pW, pB, pOut0, pOut1); break;
+#endif
+    }
+}
+
+static void convolution_1x1pointwiseRowSparse(const float * pIn, int inStep, const Filters<float> & filters, float * pOut, int outStep, int cols)
+{
+    const float * pWeights = filters.weights_p.data;
+    const float * pBiases = filters.biases.data;
+    const unsigned int * pLive = filters.live_s.data;
+    int channels = filters.channels;
+    int weightStep = filters.weights_p.channelStep / sizeof(float);
+    int vectors = (filters.num_filters + PW_LANES - 1) / PW_LANES;
+
+    float x[2][PW_SPARSE_MAX_CHANNELS + 16];
+    int offsets[2][PW_SPARSE_MAX_CHANNELS + 16];
+
+    for (int col = 0; col < cols; col += 2)
+    {
+        int col1 = MIN(col + 1, cols - 1); //the last pixel twice if cols is odd
+        int n0 = pointwiseSparseInputs(pIn + size_t(col) * inStep, pLive, channels, weightStep, x[0], offsets[0]);
+        int n1 = pointwiseSparseInputs(pIn + size_t(col1) * inStep, pLive, channels, weightStep, x[1], offsets[1]);
+
+        for (int v0 = 0; v0 < vectors; v0 += PW_TILE_VECTORS)
+        {
+            pointwiseSparseTile(MIN(PW_TILE_VECTORS, vectors - v0), x[0], offsets[0], n0, x[1], offsets[1], n1,
+                                pWeights + v0 * PW_LANES, pBiases + v0 * PW_LANES,
+                                pOut + size_t(col) * outStep + v0 * PW_LANES, pOut + size_t(col1) * outStep + v0 * PW_LANES);
+        }
+    }
+}
+#endif
+
+bool packFilters(Filters<float> & filters)
+{
+    if (!filters.is_pointwise || filters.is_depthwise)
+        return false;
+
+#if defined(PW_LANES)
+    filters.weights_p.create(1, filters.channels, filters.num_filters);
+    filters.weights_p.setZero();
+
+    for (int f = 0; f < filters.num_filters; f++)
+    {
+        const float * pW = filters.weights.ptr(0, f);
+        for (int ch = 0; ch < filters.channels; ch++)
+            filters.weights_p.ptr(0, ch)[f] = pW[ch];
+    }
+#endif
+
+    //the tiles write whole vectors, keep the padding filters at 0. Model
+    //files have them at 0 already, and are mapped read only.
+    float * pB = filters.biases.data;
+    for (int f = filters.num_filters; f < int(filters.biases.channelStep / sizeof(float)); f++)
+        if (pB[f] != 0.f)
+            pB[f] = 0.f;
+
+    return true;
+}
+
+//1x1 point wise conv of cols pixels in a row
+inline void convolution_1x1pointwiseRow(const float * pIn, int inStep, const Filters<float> & filters, float * pOut, int outStep, int cols)
+{
+    if (g_calibrating)
+    {
+        //widen the layer's activation range to cover this row
+        float & act_max = const_cast<Filters<float> &>(filters).act_max;
+        for (int col = 0; col < cols; col++)
+            for (int ch = 0; ch < filters.channels; ch++)
+                act_max = MAX(act_max, pIn[size_t(col) * inStep + ch]);
+    }
+    else if (g_int8 && filters.has_int8)
+    {
+        convolution_1x1pointwiseRowInt8(pIn, inStep, filters, pOut, outStep, cols);
+        return;
+    }
+#if defined(PW_LANES)
+    else if (filters.use_sparse)
+    {
+        convolution_1x1pointwiseRowSparse(pIn, inStep, filters, pOut, outStep, cols);
+        return;
+    }
+#endif
+
+    const float * pBiases = filters.biases.data;
+    int channels = filters.channels;
+    int num_filters = filters.num_filters;
+
+#if defined(PW_LANES)
+    const float * pWeights = filters.weights_p.data;
+    int weightStep = filters.weights_p.channelStep / sizeof(float);
+    int vectors = (num_filters + PW_LANES - 1) / PW_LANES;
+
+    for (int v0 = 0; v0 < vectors; v0 += PW_TILE_VECTORS)
+    {
+        int nv = MIN(PW_TILE_VECTORS, vectors - v0);
+        const float * pW = pWeights + v0 * PW_LANES;
+        const float * pB = pBiases + v0 * PW_LANES;
+        float * pO = pOut + v0 * PW_LANES;
+
+        int col = 0;
+        for (; col + PW_TILE_PIXELS <= cols; col += PW_TILE_PIXELS)
+            pointwiseTile<PW_TILE_PIXELS>(nv, pIn + size_t(col) * inStep, inStep, pW, weightStep, pB, channels, pO + size_t(col) * outStep, outStep);
+        for (; col < cols; col++)
+            pointwiseTile<1>(nv, pIn + size_t(col) * inStep, inStep, pW, weightStep, pB, channels, pO + size_t(col) * outStep, outStep);
+    }
+#else
+    //2 pixels by 4 filters of dot products over the unpacked weights,
+    //the compiler vectorizes the loop over the channels
+    const float * pWeights = filters.weights.data;
+    int weightStep = filters.weights.channelStep / sizeof(float);
+
+    for (int col = 0; col < cols; col += 2)
+    {
+        const float * pI0 = pIn + size_t(col) * inStep;
+        const float * pI1 = (col + 1 < cols) ? pI0 + inStep : pI0;
+        float * pO0 = pOut + size_t(col) * outStep;
+        float * pO1 = (col + 1 < cols) ? pO0 + outStep : pO0;
+
+        for (int f = 0; f < num_filters; f += 4)
+        {
+            const float * pW[4];
+            for (int i = 0; i < 4; i++)
+                pW[i] = pWeights + size_t(MIN(f + i, num_filters - 1)) * weightStep;
+
+            float s00 = 0.f, s01 = 0.f, s02 = 0.f, s03 = 0.f;
+            float s10 = 0.f, s11 = 0.f, s12 = 0.f, s13 = 0.f;
+            for (int ch = 0; ch < channels; ch++)
+            {
+                float x0 = pI0[ch], x1 = pI1[ch];
+                s00 += x0 * pW[0][ch]; s01 += x0 * pW[1][ch]; s02 += x0 * pW[2][ch]; s03 += x0 * pW[3][ch];
+                s10 += x1 * pW[0][ch]; s11 += x1 * pW[1][ch]; s12 += x1 * pW[2][ch]; s13 += x1 * pW[3][ch];
+            }
+
+            float s0[4] = {s00, s01, s02, s03};
+            float s1[4] = {s10, s11, s12, s13};
+            for (int i = 0; i < 4 && f + i < num_filters; i++)
+            {
+                pO1[f + i] = s1[i] + pBiases[f + i];
+                pO0[f + i] = s0[i] + pBiases[f + i];
+            }
+        }
+    }
+#endif
+}
+
+//columns of the row sparsifyFilters() times both paths on, the runs it takes
+//the best of, and how much faster the sparse path has to be. Around half the
+//inputs have to be 0 for it to break even, the margin keeps layers close to
+//that from flipping between runs.
+#define SPARSE_BENCH_COLS 32
+#define SPARSE_BENCH_RUNS 3
+#define SPARSE_MIN_GAIN 0.9
+
+/*
+Picks the sparse path for a 1x1 point wise layer if it runs faster than the
+dense tiles here, timing both on a row of inputs where a share zeros of the
+values is 0, like the layer's activations on sample images. Input channels
+whose weights are all 0 are left out of its list. The two paths give the
+same outputs, only the time changes.
+*/
+bool sparsifyFilters(Filters<float> & filters, float zeros)
+{
+    filters.use_sparse = false;
+    filters.live_s.setNULL();
+
+#if defined(PW_LANES)
+    if (!filters.is_pointwise || filters.is_depthwise || filters.weights_p.isEmpty() ||
+        filters.channels > PW_SPARSE_MAX_CHANNELS || zeros <= 0.f)
+        return false;
+
+    //the inputs are read in whole vectors up to 16 channels past the last
+    //one, a word of the mask more keeps their bits 0
+    filters.live_s.create(1, 1, filters.channels / 32 + 2);
+    filters.live_s.setZero();
+    for (int ch = 0; ch < filters.channels; ch++)
+    {
+        const float * pW = filters.weights_p.ptr(0, ch);
+        if (std::any_of(pW, pW + filters.num_filters, [](float w) { return w != 0.f; }))
+            filters.live_s.data[ch / 32] |= 1u << (ch % 32);
+    }
+
+    //the same pseudo random inputs every time
+    CDataBlob<float> input(1, SPARSE_BENCH_COLS, filters.channels);
+    CDataBlob<float> output(1, SPARSE_BENCH_COLS, filters.num_filters);
+    input.setZero();
+    unsigned int seed = 1;
+    for (int col = 0; col < SPARSE_BENCH_COLS; col++)
+    {
+        for (int ch = 0; ch < filters.channels; ch++)
+        {
+            seed = seed * 1103515245u + 12345u;
+            float r = (seed >> 8) / 16777216.f;
+            input.ptr(0, col)[ch] = (r < zeros) ? 0.f : r;
+        }
+    }
+
+    //the int8 kernels would take over the dense row
+    bool int8 = g_int8;
+    g_int8 = false;
+
+    double times[2] = {DBL_MAX, DBL_MAX};
+    for (int run = 0; run < SPARSE_BENCH_RUNS; run++)
+    {
+        for (int sparse = 0; sparse < 2; sparse++)
+        {
+            filters.use_sparse = (sparse != 0);
+            auto start = std::chrono::steady_clock::now();
+            convolution_1x1pointwiseRow(input.ptr(0, 0), input.channelStep / sizeof(float), filters,
+                                        output.ptr(0, 0), output.channelStep / sizeof(float), SPARSE_BENCH_COLS);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            times[sparse] = MIN(times[sparse], elapsed.count());
+        }
+    }
+
+    g_int8 = int8;
+    filters.use_sparse = times[1] < times[0] * SPARSE_MIN_GAIN;
+    return filters.use_sparse;
+#else
+    return false;
+#endif
+}
+
+bool convolution_1x1pointwise(const CDataBlob<float> & inputData, const Filters<float> & filters, CDataBlob<float> & outputData)
+{
+    parallelRows(outputData.rows, size_t(outputData.cols) * filters.channels * filters.num_filters, [&](int begin, int end) {
+        for (int row = begin; row < end; row++)
+        {
+            convolution_1x1pointwiseRow(inputData.ptr(row, 0), inputData.channelStep / sizeof(float), filters,
+                                        outputData.ptr(row, 0), outputData.channelStep / sizeof(float), outputData.cols);
+        }
+    });
+    return true;
+}
+
+#if defined(PW_LANES)
+//PIXELS output pixels of the first layer, see convolution3x3S2FromImage().
+//pTaps holds every pixel's 9 taps, NULL where they are padding.
+template<int PIXELS, int VECTORS>
+static inline void imageConvTile(const unsigned char * pTaps[][9], const float * pW, int wStep, const float * pB, float * pOut, int outStep)
 {
-#if defined(_ENABLE_AVX512)
-    __m512 a_float_x16, b_float_x16;
-    for (int i = 0; i < num; i += 16)
-    {
-        a_float_x16 = _mm512_load_ps(p1 + i);
-        b_float_x16 = _mm512_load_ps(p2 + i);
-        b_float_x16 = _mm512_add_ps(a_float_x16, b_float_x16);
-        _mm512_store_ps(p2 + i, b_float_x16);
-    }
-#elif defined(_ENABLE_AVX2)
-    __m256 a_float_x8, b_float_x8;
-    for (int i = 0; i < num; i += 8)
+    pw_float acc[PIXELS][VECTORS];
+    for (int v = 0; v < VECTORS; v++)
     {
-        a_float_x8 = _mm256_load_ps(p1 + i);
-        b_float_x8 = _mm256_load_ps(p2 + i);
-        b_float_x8 = _mm256_add_ps(a_float_x8, b_float_x8);
-        _mm256_store_ps(p2 + i, b_float_x8);
+        pw_float b = pwLoad(pB + v * PW_LANES);
+        for (int p = 0; p < PIXELS; p++)
+            acc[p][v] = b;
     }
-#elif defined(_ENABLE_NEON)
-    float32x4_t a_float_x4, b_float_x4, c_float_x4;
-    for (int i = 0; i < num; i+=4)
+
+    for (int t = 0; t < 9; t++)
     {
-        a_float_x4 = vld1q_f32(p1 + i);
-        b_float_x4 = vld1q_f32(p2 + i);
-        c_float_x4 = vaddq_f32(a_float_x4, b_float_x4);
-        vst1q_f32(p2 + i, c_float_x4);
+        for (int k = 0; k < 3; k++)
+        {
+            pw_float w[VECTORS];
+            for (int v = 0; v < VECTORS; v++)
+                w[v] = pwLoad(pW + size_t(t * 3 + k) * wStep + v * PW_LANES);
+
+            for (int p = 0; p < PIXELS; p++)
+            {
+                if (!pTaps[p][t])
+                    continue; //padding, adds nothing
+                pw_float x = pwSet1(pTaps[p][t][k]);
+                for (int v = 0; v < VECTORS; v++)
+                    acc[p][v] = pwFmadd(x, w[v], acc[p][v]);
+            }
+        }
     }
-#else
-    for(int i = 0; i < num; i++)
+
+    for (int p = 0; p < PIXELS; p++)
+        for (int v = 0; v < VECTORS; v++)
+            pwStore(pOut + size_t(p) * outStep + v * PW_LANES, acc[p][v]);
+}
+
+template<int PIXELS>
+static inline void imageConvTile(int vectors, const unsigned char * pTaps[][9], const float * pW, int wStep, const float * pB, float * pOut, int outStep)
+{
+    switch (vectors)
     {
-        p2[i] += p1[i];
+    case 1: imageConvTile<PIXELS, 1>(pTaps, pW, wStep, pB, pOut, outStep); break;
+    case 2: imageConvTile<PIXELS, 2>(pTaps, pW, wStep, pB, pOut, outStep); break;
+    case 3: imageConvTile<PIXELS, 3>(pTaps, pW, wStep, pB, pOut, outStep); break;
+#if PW_TILE_VECTORS >= 4
+    case 4: imageConvTile<PIXELS, 4>(pTaps, pW, wStep, pB, pOut, outStep); break;
+#endif
     }
+}
 #endif
-    return true;
+
+//the 9 taps of a 3x3 window centered on column x of the rows in pRows,
+//NULL outside the image
+static inline void imageTaps(const unsigned char * pRows[3], int x, int imgWidth, int imgChannels, const unsigned char * pTaps[9])
+{
+    for (int fy = 0; fy < 3; fy++) {
+        for (int fx = -1; fx <= 1; fx++) {
+            int srcx = x + fx;
+            bool inside = pRows[fy] && srcx >= 0 && srcx < imgWidth;
+            pTaps[fy * 3 + fx + 1] = inside ? pRows[fy] + imgChannels * srcx : NULL;
+        }
+    }
 }
 
-inline bool vecAdd(const float * p1, const float * p2, float* p3, int num)
+//The first layer, a 3x3 stride 2 conv, straight from the 8-bit image. The
+//pixels are converted to float as they are read, instead of expanding every
+//output pixel's 27 taps into a 32-channel float blob first. filters is the
+//layer in its 1x1 point wise form, with the 3 channels of the 9 taps in row
+//major order and in the image's channel order, see facedetect_set_rgb().
+CDataBlob<float> convolution3x3S2FromImage(const unsigned char* inputData, int imgWidth, int imgHeight, int imgChannels, int imgWidthStep,
+                const Filters<float>& filters, bool do_relu, int padDivisor)
 {
-#if defined(_ENABLE_AVX512)
-    __m512 a_float_x16, b_float_x16;
-    for (int i = 0; i < num; i += 16)
-    {
-        a_float_x16 = _mm512_load_ps(p1 + i);
-        b_float_x16 = _mm512_load_ps(p2 + i);
-        b_float_x16 = _mm512_add_ps(a_float_x16, b_float_x16);
-        _mm512_store_ps(p3 + i, b_float_x16);
+    if (imgChannels != 3) {
+        std::cerr << __FUNCTION__ << ": The input image must be a 3-channel RGB image." << std::endl;
+        exit(1);
     }
-#elif defined(_ENABLE_AVX2)
-    __m256 a_float_x8, b_float_x8;
-    for (int i = 0; i < num; i += 8)
-    {
-        a_float_x8 = _mm256_load_ps(p1 + i);
-        b_float_x8 = _mm256_load_ps(p2 + i);
-        b_float_x8 = _mm256_add_ps(a_float_x8, b_float_x8);
-        _mm256_store_ps(p3 + i, b_float_x8);
+    if (padDivisor != 32) {
+        std::cerr << __FUNCTION__ << ": This version need pad of 32" << std::endl;
+        exit(1);
     }
-#elif defined(_ENABLE_NEON)
-    float32x4_t a_float_x4, b_float_x4, c_float_x4;
-    for (int i = 0; i < num; i+=4)
-    {
-        a_float_x4 = vld1q_f32(p1 + i);
-        b_float_x4 = vld1q_f32(p2 + i);
-        c_float_x4 = vaddq_f32(a_float_x4, b_float_x4);
-        vst1q_f32(p3 + i, c_float_x4);
+    if (!filters.is_pointwise || filters.is_depthwise || filters.channels < 27) {
+        std::cerr << __FUNCTION__ << ": The filters must be a 3x3x3 conv in point wise form." << std::endl;
+        exit(1);
     }
+    int rows = ((imgHeight - 1) / padDivisor + 1) * padDivisor / 2;
+    int cols = ((imgWidth - 1) / padDivisor + 1 ) * padDivisor / 2;
+    int num_filters = filters.num_filters;
+    CDataBlob<float> outBlob(rows, cols, num_filters);
+
+    int tasks = parallelTasks(rows, size_t(cols) * 27 * num_filters);
+#if defined(PW_LANES)
+    const float * pWeights = filters.weights_p.data;
+    const float * pBiases = filters.biases.data;
+    int weightStep = filters.weights_p.channelStep / sizeof(float);
+    int vectors = (num_filters + PW_LANES - 1) / PW_LANES;
 #else
-    for(int i = 0; i < num; i++)
-    {
-        p3[i] = p1[i] + p2[i];
-    }
+    //without SIMD the taps of a row are expanded into a line buffer per task
+    //for the point wise conv, which beats going filter by filter per pixel
+    CDataBlob<float> tapRows(tasks, cols, filters.channels);
+    tapRows.setZero();
 #endif
-    return true;
+
+    parallelFor(tasks, [&](int task) {
+        int begin = int(int64_t(rows) * task / tasks);
+        int end = int(int64_t(rows) * (task + 1) / tasks);
+
+        for (int r = begin; r < end; r++) {
+            //the 3 image rows under output row r, NULL outside the image
+            const unsigned char * pRows[3];
+            for (int fy = -1; fy <= 1; fy++) {
+                int srcy = r * 2 + fy;
+                pRows[fy + 1] = (srcy >= 0 && srcy < imgHeight) ? inputData + size_t(imgWidthStep) * srcy : NULL;
+            }
+
+#if defined(PW_LANES)
+            int outStep = outBlob.channelStep / sizeof(float);
+            for (int c = 0; c < cols; c += PW_TILE_PIXELS) {
+                int pixels = MIN(PW_TILE_PIXELS, cols - c);
+                const unsigned char * pTaps[PW_TILE_PIXELS][9];
+                for (int p = 0; p < pixels; p++)
+                    imageTaps(pRows, (c + p) * 2, imgWidth, imgChannels, pTaps[p]);
+
+                if (pixels == PW_TILE_PIXELS)
+                    imageConvTile<PW_TILE_PIXELS>(vectors, pTaps, pWeights, weightStep, pBiases, outBlob.ptr(r, c), outStep);
+                else
+                    for (int p = 0; p < pixels; p++)
+                        imageConvTile<1>(vectors, &pTaps[p], pWeights, weightStep, pBiases, outBlob.ptr(r, c + p), outStep);
+            }
+#else
+            for (int c = 0; c < cols; c++) {
+                const unsigned char * pTaps[9];
+                imageTaps(pRows, c * 2, imgWidth, imgChannels, pTaps);
+
+                float * pData = tapRows.ptr(task, c);
+                for (int t = 0; t < 9; t++)
+                    for (int k = 0; k < 3; k++)
+                        pData[t * 3 + k] = pTaps[t] ? pTaps[t][k] : 0.f;
+            }
+
+            convolution_1x1pointwiseRow(tapRows.ptr(task, 0), tapRows.channelStep / sizeof(float), filters,
+                                        outBlob.ptr(r, 0), outBlob.channelStep / sizeof(float), cols);
+#endif
+            if (do_relu)
+                vecRelu(outBlob.ptr(r, 0), cols * outBlob.channelStep / sizeof(float));
+        }
+    });
+    return outBlob;
 }
 
-bool convolution_1x1pointwise(const CDataBlob<float> & inputData, const Filters<float> & filters, CDataBlob<float> & outputData)
+//3x3 depth wise conv of one output row. pInRows holds the input rows
+//row-1, row and row+1, NULL where they are outside the input.
+inline void convolution_3x3depthwiseRow(const float * pInRows[3], int inStep, const Filters<float> & filters, float * pOut, int outStep, int cols, bool do_relu)
 {
-#if defined(_OPENMP)
-#pragma omp parallel for
-#endif
-    for (int row = 0; row < outputData.rows; row++)
+    for (int col = 0; col < cols; col++)
     {
-        for (int col = 0; col < outputData.cols; col++)
+        float * pO = pOut + size_t(col) * outStep;
+        memset(pO, 0, outStep * sizeof(float));
+
+        int srcx_start = MAX(0, col - 1);
+        int srcx_end = MIN(col + 2, cols);
+
+        for (int filter_r = 0; filter_r < 3; filter_r++)
         {
-            float * pOut = outputData.ptr(row, col);
-            const float * pIn = inputData.ptr(row, col);            
-            for (int ch = 0; ch < outputData.channels; ch++)
+            if (!pInRows[filter_r])
+                continue;
+            for (int c = srcx_start; c < srcx_end; c++)
             {
-                const float * pF = filters.weights.ptr(0, ch);
-                pOut[ch] = dotProduct(pIn, pF, inputData.channels);
-                pOut[ch] += filters.biases.data[ch];
+                int filter_idx = filter_r * 3 + (c - col + 1);
+                vecMulAdd(pInRows[filter_r] + size_t(c) * inStep, filters.weights.ptr(0, filter_idx), pO, filters.num_filters);
             }
         }
+        vecAdd(filters.biases.ptr(0,0), pO, filters.num_filters);
+
+        if (do_relu)
+            vecRelu(pO, outStep);
     }
-    return true;
 }
 
 bool convolution_3x3depthwise(const CDataBlob<float> & inputData, const Filters<float> & filters, CDataBlob<float> & outputData)
 {
-    //set all elements in outputData to zeros
-    outputData.setZero();
-#if defined(_OPENMP)
-#pragma omp parallel for
-#endif
-    for (int row = 0; row < outputData.rows; row++) 
-    {  
-        int srcy_start = row - 1;
-        int srcy_end = srcy_start + 3;
-        srcy_start = MAX(0, srcy_start);
-        srcy_end = MIN(srcy_end, inputData.rows);
-
-        for (int col = 0; col < outputData.cols; col++)
-        { 
-            float * pOut = outputData.ptr(row, col);
-            int srcx_start = col - 1;
-            int srcx_end = srcx_start + 3;
-            srcx_start = MAX(0, srcx_start);
-            srcx_end = MIN(srcx_end, inputData.cols);
-
-
-            for ( int r = srcy_start; r < srcy_end; r++)
-                for( int c = srcx_start; c < srcx_end; c++)
-                {
-                    int filter_r = r - row + 1;
-                    int filter_c = c - col + 1;
-                    int filter_idx = filter_r * 3 + filter_c;
-                    vecMulAdd(inputData.ptr(r, c), filters.weights.ptr(0, filter_idx), pOut, filters.num_filters);
-                }
-            vecAdd(filters.biases.ptr(0,0), pOut, filters.num_filters);
+    parallelRows(outputData.rows, size_t(outputData.cols) * filters.num_filters * 9, [&](int begin, int end) {
+        for (int row = begin; row < end; row++) 
+        {  
+            const float * pInRows[3];
+            for (int i = 0; i < 3; i++)
+                pInRows[i] = inputData.ptr(row - 1 + i, 0); //NULL outside the input
+
+            convolution_3x3depthwiseRow(pInRows, inputData.channelStep / sizeof(float), filters,
+                                        outputData.ptr(row, 0), outputData.channelStep / sizeof(float), outputData.cols, false);
         }
-    }
-     return true;
+    });
+    return true;
 }
 
 bool relu(CDataBlob<float> & inputoutputData)
@@ -358,31 +1620,35 @@ bool relu(CDataBlob<float> & inputoutputData)
         return false;
     }
     
-    int len = inputoutputData.cols * inputoutputData.rows * inputoutputData.channelStep / sizeof(float);
+    int rowLen = inputoutputData.cols * inputoutputData.channelStep / sizeof(float);
 
+    parallelRows(inputoutputData.rows, rowLen, [&](int begin, int end) {
+        float * pData = inputoutputData.data + size_t(begin) * rowLen;
+        int len = (end - begin) * rowLen;
 
-#if defined(_ENABLE_AVX512)
-    __m512 a, bzeros;
-    bzeros = _mm512_setzero_ps(); //zeros
-    for( int i = 0; i < len; i+=16)
-    {
-        a = _mm512_load_ps(inputoutputData.data + i);
-        a = _mm512_max_ps(a, bzeros);
-        _mm512_store_ps(inputoutputData.data + i, a);
-    }
-#elif defined(_ENABLE_AVX2)
-    __m256 a, bzeros;
-    bzeros = _mm256_setzero_ps(); //zeros
-    for( int i = 0; i < len; i+=8)
-    {
-        a = _mm256_load_ps(inputoutputData.data + i);
-        a = _mm256_max_ps(a, bzeros);
-        _mm256_store_ps(inputoutputData.data + i, a);
-    }
-#else    
-    for( int i = 0; i < len; i++)
-        inputoutputData.data[i] *= (inputoutputData.data[i] >0);
-#endif
+    #if defined(_ENABLE_AVX512)
+        __m512 a, bzeros;
+        bzeros = _mm512_setzero_ps(); //zeros
+        for( int i = 0; i < len; i+=16)
+        {
+            a = _mm512_load_ps(pData + i);
+            a = _mm512_max_ps(a, bzeros);
+            _mm512_store_ps(pData + i, a);
+        }
+    #elif defined(_ENABLE_AVX2)
+        __m256 a, bzeros;
+        bzeros = _mm256_setzero_ps(); //zeros
+        for( int i = 0; i < len; i+=8)
+        {
+            a = _mm256_load_ps(pData + i);
+            a = _mm256_max_ps(a, bzeros);
+            _mm256_store_ps(pData + i, a);
+        }
+    #else    
+        for( int i = 0; i < len; i++)
+            pData[i] *= (pData[i] >0);
+    #endif
+    });
 
     return true;
 }
@@ -435,47 +1701,65 @@ bool SortScoreBBoxPairDescend(const std::pair<float, NormalizedBBox>& pair1,   c
 }
 
 
-CDataBlob<float> upsampleX2(const CDataBlob<float>& inputData) {
+template<typename T>
+CDataBlob<T> upsampleX2(const CDataBlob<T>& inputData) {
     if (inputData.isEmpty()) {
         std::cerr << __FUNCTION__ << ": The input data is empty." << std::endl;
         exit(1);
     }
 
-    CDataBlob<float> outData(inputData.rows * 2, inputData.cols * 2, inputData.channels);
-
-    for (int r = 0; r < inputData.rows; r++) {
-        for (int c = 0; c < inputData.cols; c++) {
-            const float * pIn = inputData.ptr(r, c);
-            int outr = r * 2;
-            int outc = c * 2;
-            for (int ch = 0; ch < inputData.channels; ++ch) {
-                outData.ptr(outr, outc)[ch] = pIn[ch];
-                outData.ptr(outr, outc + 1)[ch] = pIn[ch];
-                outData.ptr(outr + 1, outc)[ch] = pIn[ch];
-                outData.ptr(outr + 1, outc + 1)[ch] = pIn[ch];
+    CDataBlob<T> outData(inputData.rows * 2, inputData.cols * 2, inputData.channels);
+
+    parallelRows(inputData.rows, size_t(inputData.cols) * inputData.channels * 4, [&](int begin, int end) {
+        for (int r = begin; r < end; r++) {
+            for (int c = 0; c < inputData.cols; c++) {
+                const T * pIn = inputData.ptr(r, c);
+                int outr = r * 2;
+                int outc = c * 2;
+                for (int ch = 0; ch < inputData.channels; ++ch) {
+                    outData.ptr(outr, outc)[ch] = pIn[ch];
+                    outData.ptr(outr, outc + 1)[ch] = pIn[ch];
+                    outData.ptr(outr + 1, outc)[ch] = pIn[ch];
+                    outData.ptr(outr + 1, outc + 1)[ch] = pIn[ch];
+                }
             }
         }
-    }
+    });
     return outData;
 }
 
-CDataBlob<float> elementAdd(const CDataBlob<float>& inputData1, const CDataBlob<float>& inputData2) {
+template CDataBlob<float> upsampleX2(const CDataBlob<float>& inputData);
+template CDataBlob<fp16_t> upsampleX2(const CDataBlob<fp16_t>& inputData);
+
+template<typename T>
+CDataBlob<T> elementAdd(const CDataBlob<T>& inputData1, const CDataBlob<T>& inputData2) {
     if (inputData1.rows != inputData2.rows || inputData1.cols != inputData2.cols || inputData1.channels != inputData2.channels) {
         std::cerr << __FUNCTION__ << ": The two input datas must be in the same shape." << std::endl;
         exit(1);
     }
-    CDataBlob<float> outData(inputData1.rows, inputData1.cols, inputData1.channels);
-    for (int r = 0; r < inputData1.rows; r++) {
-        for (int c = 0; c < inputData1.cols; c++) {
-            const float * pIn1 = inputData1.ptr(r, c);
-            const float * pIn2 = inputData2.ptr(r, c);
-            float* pOut = outData.ptr(r, c);
-            vecAdd(pIn1, pIn2, pOut, inputData1.channels);
+    CDataBlob<T> outData(inputData1.rows, inputData1.cols, inputData1.channels);
+    parallelRows(inputData1.rows, size_t(inputData1.cols) * inputData1.channels, [&](int begin, int end) {
+        alignas(64) float buffers[3][FP16_CHUNK];
+        for (int r = begin; r < end; r++) {
+            for (int c = 0; c < inputData1.cols; c++) {
+                const T * pIn1 = inputData1.ptr(r, c);
+                const T * pIn2 = inputData2.ptr(r, c);
+                T* pOut = outData.ptr(r, c);
+                for (int ch = 0; ch < inputData1.channels; ch += FP16_CHUNK) {
+                    int num = MIN(FP16_CHUNK, inputData1.channels - ch);
+                    float * pSum = floatTarget(pOut + ch, buffers[2]);
+                    vecAdd(floatValues(pIn1 + ch, buffers[0], num), floatValues(pIn2 + ch, buffers[1], num), pSum, num);
+                    storeValues(pSum, pOut + ch, num);
+                }
+            }
         }
-    }
+    });
     return outData;
 }
 
+template CDataBlob<float> elementAdd(const CDataBlob<float>& inputData1, const CDataBlob<float>& inputData2);
+template CDataBlob<fp16_t> elementAdd(const CDataBlob<fp16_t>& inputData1, const CDataBlob<fp16_t>& inputData2);
+
 CDataBlob<float> convolution(const CDataBlob<float>& inputData, const Filters<float>& filters, bool do_relu)
 {
     if( inputData.isEmpty() || filters.weights.isEmpty() || filters.biases.isEmpty())
@@ -505,23 +1789,103 @@ CDataBlob<float> convolution(const CDataBlob<float>& inputData, const Filters<fl
     return outputData;
 }
 
-CDataBlob<float> convolutionDP(const CDataBlob<float>& inputData, 
+//1x1 point wise conv followed by 3x3 depth wise conv. The point wise rows are
+//computed into a 3-row line buffer right before the depth wise conv needs
+//them, so the intermediate result never goes through memory as a whole blob,
+//and ReLU is applied while the output is still in cache. fp16_t input and
+//output rows go through a float row per task.
+template<typename TO, typename TI>
+CDataBlob<TO> convolutionDP(const CDataBlob<TI>& inputData, 
                 const Filters<float>& filtersP, const Filters<float>& filtersD, bool do_relu)
 {
-    CDataBlob<float> tmp = convolution(inputData, filtersP, false);
-    CDataBlob<float> out = convolution(tmp, filtersD, do_relu);
-    return out;
+    if( inputData.isEmpty() || filtersP.weights.isEmpty() || filtersD.weights.isEmpty())
+    {
+        std::cerr << __FUNCTION__ << ": The input data or filter data is empty" << std::endl;
+        exit(1);
+    }
+    if( inputData.channels != filtersP.channels || filtersP.num_filters != filtersD.channels ||
+        !filtersP.is_pointwise || filtersP.is_depthwise || filtersD.is_pointwise || !filtersD.is_depthwise)
+    {
+        std::cerr << __FUNCTION__ << ": The filters must be a 1x1 point wise conv and a 3x3 depth wise conv that fit the input: "
+            << inputData.channels << " vs " << filtersP.channels << std::endl;
+        exit(1);
+    }
+
+    int rows = inputData.rows;
+    int cols = inputData.cols;
+
+    //every task runs its range of rows with its own 3 lines, and computes
+    //the point wise row above its range again
+    int tasks = parallelTasks(rows, size_t(cols) * filtersP.num_filters * (filtersP.channels + 9));
+
+    CDataBlob<float> lines(3 * tasks, cols, filtersP.num_filters);
+    CDataBlob<TO> outputData(rows, cols, filtersD.num_filters);
+
+    CDataBlob<float> inRows, outRows;
+    if (sizeof(TI) != sizeof(float))
+        inRows.create(tasks, cols, inputData.channels);
+    if (sizeof(TO) != sizeof(float))
+        outRows.create(tasks, cols, filtersD.num_filters);
+
+    int lineStep = lines.channelStep / sizeof(float);
+
+    parallelFor(tasks, [&](int task) {
+        int begin = int(int64_t(rows) * task / tasks);
+        int end = int(int64_t(rows) * (task + 1) / tasks);
+
+        //input row r goes to line r % 3
+        auto line = [&](int r) { return lines.ptr(3 * task + r % 3, 0); };
+        auto pointwise = [&](int r) {
+            int inStep;
+            const float * pIn = floatRow(inputData, r, inRows, task, inStep);
+            convolution_1x1pointwiseRow(pIn, inStep, filtersP, line(r), lineStep, cols);
+        };
+
+        if (begin > 0)
+            pointwise(begin - 1);
+        pointwise(begin);
+
+        for (int row = begin; row < end; row++)
+        {
+            if (row + 1 < rows)
+                pointwise(row + 1);
+
+            const float * pInRows[3];
+            pInRows[0] = (row > 0) ? line(row - 1) : nullptr;
+            pInRows[1] = line(row);
+            pInRows[2] = (row + 1 < rows) ? line(row + 1) : nullptr;
+
+            int outStep;
+            float * pOut = floatTargetRow(outputData, row, outRows, task, outStep);
+            convolution_3x3depthwiseRow(pInRows, lineStep, filtersD, pOut, outStep, cols, do_relu);
+            storeRow(outputData, row, outRows, task);
+        }
+    });
+
+    return outputData;
 }
 
-CDataBlob<float> convolution4layerUnit(const CDataBlob<float>& inputData, 
+template CDataBlob<float> convolutionDP(const CDataBlob<float>& inputData, const Filters<float>& filtersP, const Filters<float>& filtersD, bool do_relu);
+template CDataBlob<fp16_t> convolutionDP(const CDataBlob<float>& inputData, const Filters<float>& filtersP, const Filters<float>& filtersD, bool do_relu);
+template CDataBlob<fp16_t> convolutionDP(const CDataBlob<fp16_t>& inputData, const Filters<float>& filtersP, const Filters<float>& filtersD, bool do_relu);
+template CDataBlob<float> convolutionDP(const CDataBlob<fp16_t>& inputData, const Filters<float>& filtersP, const Filters<float>& filtersD, bool do_relu);
+
+template<typename T>
+CDataBlob<T> convolution4layerUnit(const CDataBlob<T>& inputData, 
                 const Filters<float>& filtersP1, const Filters<float>& filtersD1, 
                 const Filters<float>& filtersP2, const Filters<float>& filtersD2, bool do_relu)
 {
-    CDataBlob<float> tmp = convolutionDP(inputData, filtersP1, filtersD1, true);
-    CDataBlob<float> out = convolutionDP(tmp, filtersP2, filtersD2, do_relu);
+    CDataBlob<T> tmp = convolutionDP<T>(inputData, filtersP1, filtersD1, true);
+    CDataBlob<T> out = convolutionDP<T>(tmp, filtersP2, filtersD2, do_relu);
     return out;
 }
 
+template CDataBlob<float> convolution4layerUnit(const CDataBlob<float>& inputData, 
+                const Filters<float>& filtersP1, const Filters<float>& filtersD1, 
+                const Filters<float>& filtersP2, const Filters<float>& filtersD2, bool do_relu);
+template CDataBlob<fp16_t> convolution4layerUnit(const CDataBlob<fp16_t>& inputData, 
+                const Filters<float>& filtersP1, const Filters<float>& filtersD1, 
+                const Filters<float>& filtersP2, const Filters<float>& filtersD2, bool do_relu);
 
 //only 2X2 S2 is supported
 CDataBlob<float> maxpooling2x2S2(const CDataBlob<float>&inputData)
@@ -542,284 +1906,270 @@ CDataBlob<float> maxpooling2x2S2(const CDataBlob<float>&inputData)
     }
 
     CDataBlob<float> outputData(outputR, outputC, outputCH);
-    outputData.setZero();
 
-    for (int row = 0; row < outputData.rows; row++)
-    {
-        for (int col = 0; col < outputData.cols; col++)
+    parallelRows(outputData.rows, size_t(outputData.cols) * outputCH * 4, [&](int begin, int end) {
+        for (int row = begin; row < end; row++)
         {
-            size_t inputMatOffsetsInElement[4];
-            int elementCount = 0;
+            for (int col = 0; col < outputData.cols; col++)
+            {
+                size_t inputMatOffsetsInElement[4];
+                int elementCount = 0;
 
-            int rstart = row * 2;
-            int cstart = col * 2;
-            int rend = MIN(rstart + 2, inputData.rows);
-            int cend = MIN(cstart + 2, inputData.cols);
+                int rstart = row * 2;
+                int cstart = col * 2;
+                int rend = MIN(rstart + 2, inputData.rows);
+                int cend = MIN(cstart + 2, inputData.cols);
 
-            for (int fr = rstart; fr < rend; fr++)
-            {
-                for (int fc = cstart; fc < cend; fc++)
+                for (int fr = rstart; fr < rend; fr++)
                 {
-                    inputMatOffsetsInElement[elementCount++] = (size_t(fr) * inputData.cols + fc) * inputData.channelStep / sizeof(float);
+                    for (int fc = cstart; fc < cend; fc++)
+                    {
+                        inputMatOffsetsInElement[elementCount++] = (size_t(fr) * inputData.cols + fc) * inputData.channelStep / sizeof(float);
+                    }
                 }
-            }
 
-            float * pOut = outputData.ptr(row, col);
-            float * pIn = inputData.data;
+                float * pOut = outputData.ptr(row, col);
+                float * pIn = inputData.data;
 
-#if defined(_ENABLE_NEON)
-            for (int ch = 0; ch < outputData.channels; ch += 4)
-            {
-                float32x4_t tmp;
-                float32x4_t maxVal = vld1q_f32(pIn + ch + inputMatOffsetsInElement[0]);
-                for (int ec = 1; ec < elementCount; ec++)
+    #if defined(_ENABLE_NEON)
+                for (int ch = 0; ch < outputData.channels; ch += 4)
                 {
-                    tmp = vld1q_f32(pIn + ch + inputMatOffsetsInElement[ec]);
-                    maxVal = vmaxq_f32(maxVal, tmp);
+                    float32x4_t tmp;
+                    float32x4_t maxVal = vld1q_f32(pIn + ch + inputMatOffsetsInElement[0]);
+                    for (int ec = 1; ec < elementCount; ec++)
+                    {
+                        tmp = vld1q_f32(pIn + ch + inputMatOffsetsInElement[ec]);
+                        maxVal = vmaxq_f32(maxVal, tmp);
+                    }
+                    vst1q_f32(pOut + ch, maxVal);
                 }
-                vst1q_f32(pOut + ch, maxVal);
-            }
-#elif defined(_ENABLE_AVX512)
-            for (int ch = 0; ch < outputData.channels; ch += 16)
-            {
-                __m512 tmp;
-                __m512 maxVal = _mm512_load_ps((__m512 const*)(pIn + ch + inputMatOffsetsInElement[0]));
-                for (int ec = 1; ec < elementCount; ec++)
+    #elif defined(_ENABLE_AVX512)
+                for (int ch = 0; ch < outputData.channels; ch += 16)
                 {
-                    tmp = _mm512_load_ps((__m512 const*)(pIn + ch + inputMatOffsetsInElement[ec]));
-                    maxVal = _mm512_max_ps(maxVal, tmp);
+                    __m512 tmp;
+                    __m512 maxVal = _mm512_load_ps((__m512 const*)(pIn + ch + inputMatOffsetsInElement[0]));
+                    for (int ec = 1; ec < elementCount; ec++)
+                    {
+                        tmp = _mm512_load_ps((__m512 const*)(pIn + ch + inputMatOffsetsInElement[ec]));
+                        maxVal = _mm512_max_ps(maxVal, tmp);
+                    }
+                    _mm512_store_ps((__m512*)(pOut + ch), maxVal);
                 }
-                _mm512_store_ps((__m512*)(pOut + ch), maxVal);
-            }
-#elif defined(_ENABLE_AVX2)
-            for (int ch = 0; ch < outputData.channels; ch += 8)
-            {
-                __m256 tmp;
-                __m256 maxVal = _mm256_load_ps((float const*)(pIn + ch + inputMatOffsetsInElement[0]));
-                for (int ec = 1; ec < elementCount; ec++)
+    #elif defined(_ENABLE_AVX2)
+                for (int ch = 0; ch < outputData.channels; ch += 8)
                 {
-                    tmp = _mm256_load_ps((float const*)(pIn + ch + inputMatOffsetsInElement[ec]));
-                    maxVal = _mm256_max_ps(maxVal, tmp);
+                    __m256 tmp;
+                    __m256 maxVal = _mm256_load_ps((float const*)(pIn + ch + inputMatOffsetsInElement[0]));
+                    for (int ec = 1; ec < elementCount; ec++)
+                    {
+                        tmp = _mm256_load_ps((float const*)(pIn + ch + inputMatOffsetsInElement[ec]));
+                        maxVal = _mm256_max_ps(maxVal, tmp);
+                    }
+                    _mm256_store_ps(pOut + ch, maxVal);
                 }
-                _mm256_store_ps(pOut + ch, maxVal);
-            }
-#else
-            for (int ch = 0; ch < outputData.channels; ch++)
-            {
-                float maxVal = pIn[ch + inputMatOffsetsInElement[0]];
-                for (int ec = 1; ec < elementCount; ec++)
+    #else
+                for (int ch = 0; ch < outputData.channels; ch++)
                 {
-                    maxVal = MAX(maxVal, pIn[ch + inputMatOffsetsInElement[ec]]);
+                    float maxVal = pIn[ch + inputMatOffsetsInElement[0]];
+                    for (int ec = 1; ec < elementCount; ec++)
+                    {
+                        maxVal = MAX(maxVal, pIn[ch + inputMatOffsetsInElement[ec]]);
+                    }
+                    pOut[ch] = maxVal;
                 }
-                pOut[ch] = maxVal;
+    #endif
             }
-#endif
         }
-    }
+    });
     return outputData;
 }
 
-CDataBlob<float> meshgrid(int feature_width, int feature_height, int stride, float offset) {
-    CDataBlob<float> out(feature_height, feature_width, 2);
-    for(int r = 0; r < feature_height; ++r) {
-        float rx = (float)(r * stride) + offset;
-        for(int c = 0; c < feature_width; ++c) {
-            float* p = out.ptr(r, c);
-            p[0] = (float)(c * stride) + offset;
-            p[1] = rx;
-        }
-    }
-    return out;
-}
-
-void bbox_decode(CDataBlob<float>& bbox_pred, const CDataBlob<float>& priors, int stride) {
-    if(bbox_pred.cols != priors.cols || bbox_pred.rows != priors.rows) {
-        std::cerr << __FUNCTION__ << ": Mismatch between feature map and anchor size. (" \
-        << (bbox_pred.rows) << ", " << (bbox_pred.cols) << ") vs (" \
-        << (priors.rows) << ", " << (priors.cols) << ")." << std::endl;
-    }
-    if(bbox_pred.channels != 4) {
-        std::cerr << __FUNCTION__ << ": The bbox dim must be 4."  << std::endl;
-    }
-    float fstride = (float)stride;
-    for(int r = 0; r < bbox_pred.rows; ++r) {
-        for(int c = 0; c < bbox_pred.cols; ++c) {
-            float* pb = bbox_pred.ptr(r, c);
-            const float* pp = priors.ptr(r, c);
-            float cx = pb[0] * fstride + pp[0];
-            float cy = pb[1] * fstride + pp[1];
-            float w = std::exp(pb[2]) * fstride;
-            float h = std::exp(pb[3]) * fstride;
-            pb[0] = cx - w / 2.f;
-            pb[1] = cy - h / 2.f;
-            pb[2] = cx + w / 2.f;
-            pb[3] = cy + h / 2.f;
-        }
-    }
-}
-
-void kps_decode(CDataBlob<float>& kps_pred, const CDataBlob<float>& priors, int stride) {
-    if(kps_pred.cols != priors.cols || kps_pred.rows != priors.rows) {
-        std::cerr << __FUNCTION__ << ": Mismatch between feature map and anchor size." << std::endl;
-        exit(1);
-    }
-    if(kps_pred.channels & 1) {
-        std::cerr << __FUNCTION__ << ": The kps dim must be even." << std::endl;
-        exit(1);
-    }
-    float fstride = (float)stride;
-    int num_points = kps_pred.channels >> 1;
-
-    for(int r = 0; r < kps_pred.rows; ++r) {
-        for(int c = 0; c < kps_pred.cols; ++c) {
-            float* pb = kps_pred.ptr(r, c);
-            const float* pp = priors.ptr(r, c);
-            for(int n = 0; n < num_points; ++n) {
-                pb[2 * n] = pb[2 * n] * fstride + pp[0];
-                pb[2 * n + 1] = pb[2 * n + 1] * fstride + pp[1];           
-            }
-        }
-    }
-}
-
-template<typename T>
-CDataBlob<T> concat3(const CDataBlob<T>& inputData1, const CDataBlob<T>& inputData2, const CDataBlob<T>& inputData3)
+//the fp16_t blobs are pooled in float, converting is exact both ways
+CDataBlob<fp16_t> maxpooling2x2S2(const CDataBlob<fp16_t>&inputData)
 {
-    if ((inputData1.isEmpty()) || (inputData2.isEmpty()) || (inputData3.isEmpty()))
+    if (inputData.isEmpty())
     {
         std::cerr << __FUNCTION__ << ": The input data is empty." << std::endl;
         exit(1);
     }
+    int outputR = static_cast<int>(ceil((inputData.rows - 3.0f) / 2)) + 1;
+    int outputC = static_cast<int>(ceil((inputData.cols - 3.0f) / 2)) + 1;
+    int outputCH = inputData.channels;
 
-    if ((inputData1.cols != inputData2.cols) ||
-        (inputData1.rows != inputData2.rows) ||
-        (inputData1.cols != inputData3.cols) ||
-        (inputData1.rows != inputData3.rows))
-    {
-        std::cerr << __FUNCTION__ << ": The three inputs must have the same size." << std::endl;
-        exit(1);
-    }
-    int outputR = inputData1.rows;
-    int outputC = inputData1.cols;
-    int outputCH = inputData1.channels + inputData2.channels + inputData3.channels;
-
-    if (outputR < 1 || outputC < 1 || outputCH < 1)
+    if (outputR < 1 || outputC < 1)
     {
-        std::cerr << __FUNCTION__ << ": The size of the output is not correct. (" << outputR << ", " << outputC << ", " << outputCH << ")." << std::endl;
-        exit(1);
+        std::cerr << __FUNCTION__ << ": The size of the output is not correct. (" << outputR << ", " << outputC << ")." << std::endl;
+        exit(1);        
     }
 
-    CDataBlob<T> outputData(outputR, outputC, outputCH);
+    CDataBlob<fp16_t> outputData(outputR, outputC, outputCH);
 
-    for (int row = 0; row < outputData.rows; row++)
-    {
-        for (int col = 0; col < outputData.cols; col++)
+    parallelRows(outputData.rows, size_t(outputData.cols) * outputCH * 4, [&](int begin, int end) {
+        alignas(64) float maxVal[FP16_CHUNK], tmp[FP16_CHUNK];
+        for (int row = begin; row < end; row++)
         {
-            T * pOut = outputData.ptr(row, col);
-            const T * pIn1 = inputData1.ptr(row, col);
-            const T * pIn2 = inputData2.ptr(row, col);
-            const T * pIn3 = inputData3.ptr(row, col);
+            for (int col = 0; col < outputData.cols; col++)
+            {
+                const fp16_t * pIns[4];
+                int elementCount = 0;
+
+                int rstart = row * 2;
+                int cstart = col * 2;
+                int rend = MIN(rstart + 2, inputData.rows);
+                int cend = MIN(cstart + 2, inputData.cols);
+
+                for (int fr = rstart; fr < rend; fr++)
+                    for (int fc = cstart; fc < cend; fc++)
+                        pIns[elementCount++] = inputData.ptr(fr, fc);
 
-            memcpy(pOut, pIn1, sizeof(T)* inputData1.channels);
-            memcpy(pOut + inputData1.channels, pIn2, sizeof(T)* inputData2.channels);
-            memcpy(pOut + inputData1.channels + inputData2.channels, pIn3, sizeof(T)* inputData3.channels);
+                fp16_t * pOut = outputData.ptr(row, col);
+                for (int ch = 0; ch < outputCH; ch += FP16_CHUNK)
+                {
+                    int num = MIN(FP16_CHUNK, outputCH - ch);
+                    vecFromHalf(pIns[0] + ch, maxVal, num);
+                    for (int ec = 1; ec < elementCount; ec++)
+                    {
+                        vecFromHalf(pIns[ec] + ch, tmp, num);
+                        vecMax(tmp, maxVal, num);
+                    }
+                    vecToHalf(maxVal, pOut + ch, num);
+                }
+            }
         }
-    }
+    });
     return outputData;
 }
-template CDataBlob<float> concat3(const CDataBlob<float>& inputData1, const CDataBlob<float>& inputData2, const CDataBlob<float>& inputData3);
 
-template<typename T>
-CDataBlob<T> blob2vector(const CDataBlob<T> &inputData)
+static inline float sigmoid(float v)
 {
-    if (inputData.isEmpty())
+    v = std::min(v, 88.3762626647949f);
+    v = std::max(v, -88.3762626647949f);
+    return static_cast<float>(1.f / (1.f + exp(-v)));
+}
+
+/*
+Detection heads
+
+Every head is read in place. sqrt(sigmoid(cls) * sigmoid(obj)) can only reach
+the threshold t if both sigmoids reach t*t, so anchors with a cls or obj logit
+below logit(t*t) are dropped with a compare on the raw values, 16 or 8 anchors
+at a time. That is nearly all of them. Only the rest get their exact score,
+and their box and landmarks decoded, before going to NMS.
+*/
+static void head_candidates(const CDataBlob<float>& cls, const CDataBlob<float>& reg,
+                            const CDataBlob<float>& kps, const CDataBlob<float>& obj,
+                            int stride, float confidence_threshold,
+                            std::vector<std::pair<float, NormalizedBBox> >& candidates)
+{
+    if (cls.rows != obj.rows || cls.cols != obj.cols || cls.rows != reg.rows || cls.cols != reg.cols ||
+        cls.rows != kps.rows || cls.cols != kps.cols)
     {
-        std::cerr << __FUNCTION__ << ": The input data is empty." << std::endl;
+        std::cerr << __FUNCTION__ << ": The heads must have the same size." << std::endl;
+        exit(1);
+    }
+    if (cls.channels != 1 || obj.channels != 1 || reg.channels != 4 || kps.channels != 10)
+    {
+        std::cerr << __FUNCTION__ << ": Only support 1 class, a box and 5 keypoints per anchor." << std::endl;
         exit(1);
     }
 
-    CDataBlob<T> outputData(1, 1, inputData.cols * inputData.rows * inputData.channels);
+    float t2 = confidence_threshold * confidence_threshold;
+    float minLogit = (t2 >= 1.f) ? FLT_MAX : std::log(t2 / (1.f - t2)) - 1e-3f; //a little low for rounding
+    float fstride = (float)stride;
+    int clsStep = cls.channelStep / sizeof(float);
+    int objStep = obj.channelStep / sizeof(float);
+
+    auto candidate = [&](int r, int c) {
+        float conf = std::sqrt(sigmoid(cls.ptr(r, c)[0]) * sigmoid(obj.ptr(r, c)[0]));
+        if (conf < confidence_threshold)
+            return;
+
+        const float * pReg = reg.ptr(r, c);
+        const float * pKps = kps.ptr(r, c);
+        float px = (float)(c * stride);
+        float py = (float)(r * stride);
+
+        float cx = pReg[0] * fstride + px;
+        float cy = pReg[1] * fstride + py;
+        float w = std::exp(pReg[2]) * fstride;
+        float h = std::exp(pReg[3]) * fstride;
+
+        NormalizedBBox bb;
+        bb.xmin = cx - w / 2.f;
+        bb.ymin = cy - h / 2.f;
+        bb.xmax = cx + w / 2.f;
+        bb.ymax = cy + h / 2.f;
+        for (int n = 0; n < 5; n++)
+        {
+            bb.lm[2 * n] = pKps[2 * n] * fstride + px;
+            bb.lm[2 * n + 1] = pKps[2 * n + 1] * fstride + py;
+        }
+        candidates.push_back(std::make_pair(conf, bb));
+    };
 
-    int bytesOfAChannel = inputData.channels * sizeof(T);
-    T * pOut = outputData.ptr(0,0);
-    for (int row = 0; row < inputData.rows; row++)
+    for (int r = 0; r < cls.rows; r++)
     {
-        for (int col = 0; col < inputData.cols; col++)
+        const float * pCls = cls.ptr(r, 0);
+        const float * pObj = obj.ptr(r, 0);
+        int c = 0;
+
+#if defined(_ENABLE_AVX512)
+        __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        __m512i clsIndex = _mm512_mullo_epi32(lanes, _mm512_set1_epi32(clsStep));
+        __m512i objIndex = _mm512_mullo_epi32(lanes, _mm512_set1_epi32(objStep));
+        __m512 threshold = _mm512_set1_ps(minLogit);
+        for (; c + 16 <= cls.cols; c += 16)
         {
-            const T * pIn = inputData.ptr(row, col);
-            memcpy(pOut, pIn, bytesOfAChannel);
-            pOut += inputData.channels;
+            __m512 vCls = _mm512_i32gather_ps(clsIndex, pCls + size_t(c) * clsStep, 4);
+            __m512 vObj = _mm512_i32gather_ps(objIndex, pObj + size_t(c) * objStep, 4);
+            unsigned int mask = _mm512_cmp_ps_mask(vCls, threshold, _CMP_GE_OQ) & _mm512_cmp_ps_mask(vObj, threshold, _CMP_GE_OQ);
+            for (; mask; mask &= mask - 1)
+                candidate(r, c + __builtin_ctz(mask));
         }
-    }
-
-    return outputData;
-}
-template CDataBlob<float> blob2vector(const CDataBlob<float>& inputData);
-
-void sigmoid(CDataBlob<float>& inputData) {
-    for(int r = 0; r < inputData.rows; ++r) {
-        for(int c = 0; c < inputData.cols; ++c) {
-            float* pIn = inputData.ptr(r, c);
-            for(int ch = 0; ch < inputData.channels; ++ch) {
-                float v = pIn[ch];
-                v = std::min(v, 88.3762626647949f);
-                v = std::max(v, -88.3762626647949f);
-                pIn[ch] = static_cast<float>(1.f / (1.f + exp(-v)));
-            }
+#elif defined(_ENABLE_AVX2)
+        __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i clsIndex = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(clsStep));
+        __m256i objIndex = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(objStep));
+        __m256 threshold = _mm256_set1_ps(minLogit);
+        for (; c + 8 <= cls.cols; c += 8)
+        {
+            __m256 vCls = _mm256_i32gather_ps(pCls + size_t(c) * clsStep, clsIndex, 4);
+            __m256 vObj = _mm256_i32gather_ps(pObj + size_t(c) * objStep, objIndex, 4);
+            __m256 pass = _mm256_and_ps(_mm256_cmp_ps(vCls, threshold, _CMP_GE_OQ), _mm256_cmp_ps(vObj, threshold, _CMP_GE_OQ));
+            for (unsigned int mask = _mm256_movemask_ps(pass); mask; mask &= mask - 1)
+                candidate(r, c + __builtin_ctz(mask));
+        }
+#endif
+        for (; c < cls.cols; c++)
+        {
+            if (pCls[size_t(c) * clsStep] >= minLogit && pObj[size_t(c) * objStep] >= minLogit)
+                candidate(r, c);
         }
     }
 }
 
-std::vector<FaceRect> detection_output(const CDataBlob<float>& cls,
-                      const CDataBlob<float>& reg,
-                      const CDataBlob<float>& kps,
-                      const CDataBlob<float>& obj,
+std::vector<FaceRect> detection_output(const CDataBlob<float> * cls[],
+                      const CDataBlob<float> * reg[],
+                      const CDataBlob<float> * kps[],
+                      const CDataBlob<float> * obj[],
+                      const int strides[], int num_heads,
                       float overlap_threshold,
                       float confidence_threshold,
                       int top_k,
                       int keep_top_k)
 {
-    if (reg.isEmpty() || cls.isEmpty() || kps.isEmpty() || obj.isEmpty())//|| iou.isEmpty())
-    {
-        std::cerr << __FUNCTION__ << ": The input data is null." << std::endl;
-        exit(1);
-    }
-    if(reg.cols != 1 || reg.rows!= 1 || cls.cols != 1 || cls.rows!= 1 || kps.cols != 1 || kps.rows!= 1 || obj.cols != 1 || obj.rows!= 1) {
-        std::cerr << __FUNCTION__ << ": Only support vector format." << std::endl;
-        exit(1);
-    }
-
-    if((int)(kps.channels / obj.channels) != 10) {
-        std::cerr << __FUNCTION__ << ": Only support 5 keypoints. (" << kps.channels << ")" << std::endl;
-        exit(1);
-    }
-
-    const float* pCls = cls.ptr(0, 0);
-    const float* pReg = reg.ptr(0, 0);
-    const float* pObj = obj.ptr(0, 0);
-    const float* pKps = kps.ptr(0, 0);
-
     std::vector<std::pair<float, NormalizedBBox> > score_bbox_vec;
     std::vector<std::pair<float, NormalizedBBox> > final_score_bbox_vec;
 
     //get the candidates those are > confidence_threshold
-    for(int i = 0; i < cls.channels; ++i)
+    for (int i = 0; i < num_heads; i++)
     {
-        float conf = std::sqrt(pCls[i] * pObj[i]);
-        // float conf = pCls[i] * pObj[i];
-
-        if(conf >= confidence_threshold)
+        if (cls[i]->isEmpty() || reg[i]->isEmpty() || kps[i]->isEmpty() || obj[i]->isEmpty())
         {
-            NormalizedBBox bb;
-            bb.xmin = pReg[4 * i];
-            bb.ymin = pReg[4 * i + 1];
-            bb.xmax = pReg[4 * i + 2];
-            bb.ymax = pReg[4 * i + 3];
-
-            //store the five landmarks
-            memcpy(bb.lm, pKps + 10 * i, 10 * sizeof(float));
-            score_bbox_vec.push_back(std::make_pair(conf, bb));
+            std::cerr << __FUNCTION__ << ": The input data is null." << std::endl;
+            exit(1);
         }
+        head_candidates(*cls[i], *reg[i], *kps[i], *obj[i], strides[i], confidence_threshold, score_bbox_vec);
     }
 
 #if 1
@@ -882,3 +2232,5 @@ std::vector<FaceRect> detection_output(const CDataBlob<float>& cls,
 
     return facesInfo;
 }
+
+} //namespace FACEDETECT_ISA
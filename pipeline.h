@@ -0,0 +1,669 @@
+#pragma once
+
+#include <pthread.h>
+
+#include "base.h"
+#include "detect.h"
+#include "ffmpeg.h"
+#include "threadpool.h"
+#include "tracker.h"
+#include "transform.h"
+
+// Streaming video pipeline
+//
+// Frames move through a fixed ring of slots:
+//
+//   decoder thread -> DECODED -> pool task (detect + transform) -> READY -> encoder (caller) -> FREE
+//
+// All stages run at the same time and the memory in flight is bounded by the
+// ring size, no matter how long the clip is.
+//
+// The decoded frame stays in its native (YUV) format. Detection gets its
+// own small RGB image made with one swscale pass straight from the YUV
+// planes, and transforms work on the YUV planes in place, so the frame goes
+// to the encoder without ever being converted to full-res RGB. Only pixel
+// formats the planar transforms can't handle fall back to an RGB copy.
+//
+// Tracking and ROI mode need the frames in order between full detections:
+// the tracks, or the previous frame's faces to detect around. The encoder
+// only does that ordered part and queues the CNN and the transforms of those
+// frames on the pool (QUEUED), for the frames after the one it's encoding
+// as soon as they can be, so they run while it encodes.
+
+#define PIPELINE_MAX_RECTS 256
+
+// Detections of one frame, see VideoDetections
+typedef struct
+{
+    i64 pts;
+    int first_rect; // index into VideoDetections.rects
+    int num_rects;
+} FrameDetections;
+
+// Rects found in every frame of a clip, in presentation order
+typedef struct
+{
+    FrameDetections* frames;
+    int frame_count;
+    int frame_cap;
+
+    Rect* rects;
+    int rect_count;
+    int rect_cap;
+} VideoDetections;
+
+void video_detections_add(VideoDetections* d, i64 pts, Rect* rects, int num_rects)
+{
+    if(d->frame_count == d->frame_cap)
+    {
+        d->frame_cap = MAX(1024, d->frame_cap*2);
+        d->frames = (FrameDetections*)realloc(d->frames, d->frame_cap*sizeof(FrameDetections));
+    }
+
+    while(d->rect_count + num_rects > d->rect_cap)
+    {
+        d->rect_cap = MAX(1024, d->rect_cap*2);
+        d->rects = (Rect*)realloc(d->rects, d->rect_cap*sizeof(Rect));
+    }
+
+    FrameDetections* f = &d->frames[d->frame_count++];
+    f->pts = pts;
+    f->first_rect = d->rect_count;
+    f->num_rects = num_rects;
+
+    memcpy(&d->rects[d->rect_count], rects, num_rects*sizeof(Rect));
+    d->rect_count += num_rects;
+}
+
+// Frame with the given pts, NULL if there is none
+FrameDetections* video_detections_find(VideoDetections* d, i64 pts)
+{
+    int lo = 0;
+    int hi = d->frame_count - 1;
+
+    while(lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(d->frames[mid].pts == pts) return &d->frames[mid];
+        if(d->frames[mid].pts < pts) lo = mid + 1;
+        else hi = mid - 1;
+    }
+
+    // pts aren't guaranteed to be sorted if the source is odd, fall back to a scan
+    for(int i = 0; i < d->frame_count; ++i)
+    {
+        if(d->frames[i].pts == pts)
+            return &d->frames[i];
+    }
+
+    return NULL;
+}
+
+void video_detections_free(VideoDetections* d)
+{
+    free(d->frames);
+    free(d->rects);
+    memset(d, 0, sizeof(VideoDetections));
+}
+
+typedef enum
+{
+    SLOT_FREE = 0,
+    SLOT_DECODED,
+    SLOT_QUEUED,          // detection or transform queued by the encoder side
+    SLOT_READY,
+} FrameSlotState;
+
+typedef struct VideoPipeline VideoPipeline;
+
+typedef struct
+{
+    VideoPipeline* pipeline;
+    FrameSlotState state;
+
+    AVFrame* frame;       // decoded frame, native pixel format
+    Image image;          // full-res RGB for the fallback path, allocated on first use
+    Image image_detect;   // detection input
+    u8* detect_buffer;
+    Arena* arena;
+
+    struct SwsContext* sws_detect; // frame -> detection size RGB
+    struct SwsContext* sws_full;   // frame -> full-res RGB
+
+    Rect rects[PIPELINE_MAX_RECTS];
+    int num_rects;
+    bool detected;        // the CNN ran on this frame
+    bool converted;       // image_detect and histogram hold this frame, not an older one
+    u32 histogram[SCENE_HISTOGRAM_BINS];
+    bool transformed_rgb; // image holds the frame to encode, not frame
+
+    // tracking and ROI mode, set in frame order by pipeline_track_queue
+    // and pipeline_roi_queue
+    bool queued;
+    bool scene_cut;
+    Rect roi_rects[PIPELINE_MAX_RECTS]; // previous frame's faces, in detection image pixels
+    int roi_count;
+} FrameSlot;
+
+struct VideoPipeline
+{
+    VideoReader* reader;
+    VideoWriter* writer;         // NULL to only run detection
+    VideoDetections* detections; // optional, records every frame's rects
+    VideoDetections* cached;     // optional, rects to use instead of detecting
+
+    FrameSlot* slots;
+    int slot_count;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    u32 decoded_count; // frames handed over by the decoder
+    bool decode_done;
+    bool aborted;      // encoder failed, remaining stages stop early
+
+    // only used on the encoder side, see pipeline_track_queue and pipeline_roi_queue
+    Tracker tracker;
+    u32 histogram[SCENE_HISTOGRAM_BINS]; // previous frame's
+    bool has_histogram;
+    Rect roi_rects[PIPELINE_MAX_RECTS];  // previous frame's faces, in detection image pixels
+    int roi_count;
+    u32 tracked_count; // frames the tracker has taken in
+};
+
+// Runs the CNN on the slot's detection image
+static void pipeline_detect(FrameSlot* slot)
+{
+    Image* image_detect = &slot->image_detect;
+
+    detect_faces(image_detect);
+    slot->num_rects = detect_get_rects(image_detect, slot->image.w, slot->image.h, slot->rects, PIPELINE_MAX_RECTS);
+    slot->detected = true;
+}
+
+// Applies the transforms to the slot's rects, on the YUV planes when the
+// pixel format allows it
+static void pipeline_transform(FrameSlot* slot)
+{
+    Image* image = &slot->image;
+
+    if(slot->num_rects == 0 || settings.transform_count == 0 || !slot->pipeline->writer)
+        return;
+
+    PlanarImage planar = {};
+    if(ffmpeg_frame_to_planar(slot->frame, &planar))
+    {
+        // Apply transformations
+        for(int j = 0; j < settings.transform_count; ++j)
+        {
+            Transform* t = &settings.transforms[j];
+            transform_apply_planar(&planar, slot->num_rects, slot->rects, t->type);
+        }
+    }
+    else
+    {
+        if(!image->data)
+            image->data = (u8*)malloc((u64)image->step*image->h);
+
+        if(ffmpeg_frame_to_rgb(&slot->sws_full, slot->frame, image->data, image->w, image->h))
+        {
+            for(int j = 0; j < settings.transform_count; ++j)
+            {
+                Transform* t = &settings.transforms[j];
+                transform_apply(image, slot->num_rects, slot->rects, t->type);
+            }
+            slot->transformed_rgb = true;
+        }
+    }
+}
+
+// Hands the slot over to the encoder
+static void pipeline_slot_ready(FrameSlot* slot)
+{
+    VideoPipeline* p = slot->pipeline;
+    pthread_mutex_lock(&p->mutex);
+    slot->state = SLOT_READY;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// TaskFunc, runs on the pool once a frame has been decoded into its slot
+static void pipeline_frame_task(void* arg)
+{
+    FrameSlot* slot = (FrameSlot*)arg;
+    Image* image_detect = &slot->image_detect;
+
+    arena_reset(slot->arena);
+    image_detect->arena = slot->arena;
+    image_detect->detect_buffer = slot->detect_buffer;
+    image_detect->result = NULL;
+
+    slot->num_rects = 0;
+    slot->detected = false;
+    slot->converted = false;
+    slot->transformed_rgb = false;
+    slot->queued = false;
+
+    VideoPipeline* p = slot->pipeline;
+
+    if(p->cached)
+    {
+        // detected in an earlier run, no detection image or CNN needed
+        FrameDetections* f = video_detections_find(p->cached, slot->frame->best_effort_timestamp);
+        if(f)
+        {
+            slot->num_rects = MIN(f->num_rects, PIPELINE_MAX_RECTS);
+            memcpy(slot->rects, &p->cached->rects[f->first_rect], slot->num_rects*sizeof(Rect));
+        }
+        pipeline_transform(slot);
+        pipeline_slot_ready(slot);
+        return;
+    }
+
+    bool converted = ffmpeg_frame_to_rgb(&slot->sws_detect, slot->frame, image_detect->data, image_detect->w, image_detect->h);
+    slot->converted = converted;
+
+    if(settings.detect_interval > 1 || settings.roi_interval > 1)
+    {
+        // tracking or ROI: only the scheduled frames are detected here, the
+        // rest are filled in in order on the encoder side
+        int interval = (settings.detect_interval > 1) ? settings.detect_interval : settings.roi_interval;
+        if(converted)
+        {
+            scene_histogram(image_detect, slot->histogram);
+            if(image_detect->frame_number % interval == 0)
+            {
+                pipeline_detect(slot);
+                if(settings.detect_interval <= 1)
+                    pipeline_transform(slot); // ROI keeps the rects of full detections
+            }
+        }
+    }
+    else
+    {
+        if(converted)
+            pipeline_detect(slot);
+        pipeline_transform(slot);
+    }
+
+    pipeline_slot_ready(slot);
+}
+
+// Waits until the task the encoder side queued for the slot is done
+static void pipeline_wait_ready(VideoPipeline* p, FrameSlot* slot)
+{
+    pthread_mutex_lock(&p->mutex);
+    while(slot->state != SLOT_READY)
+        pthread_cond_wait(&p->cond, &p->mutex);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// Hands the slot to func on the pool, it's READY again once func is done
+static void pipeline_slot_queue(VideoPipeline* p, FrameSlot* slot, TaskFunc func)
+{
+    pthread_mutex_lock(&p->mutex);
+    slot->state = SLOT_QUEUED;
+    pthread_mutex_unlock(&p->mutex);
+
+    threadpool_submit(&thread_pool, NULL, func, slot);
+}
+
+// TaskFunc, runs the CNN on a frame the tracker or a scene cut asked for
+static void pipeline_detect_task(void* arg)
+{
+    FrameSlot* slot = (FrameSlot*)arg;
+    pipeline_detect(slot);
+    pipeline_slot_ready(slot);
+}
+
+// TaskFunc, transforms a tracked frame once its rects are known
+static void pipeline_transform_task(void* arg)
+{
+    FrameSlot* slot = (FrameSlot*)arg;
+    pipeline_transform(slot);
+    pipeline_slot_ready(slot);
+}
+
+// Runs in frame order on the encoder side when tracking, once the previous
+// frame is in the tracker. Carries the tracks forward and queues a
+// detection if the tracker or a scene cut asks for one. Returns true if it
+// did.
+static bool pipeline_track_queue(VideoPipeline* p, FrameSlot* slot)
+{
+    Tracker* tracker = &p->tracker;
+
+    slot->queued = true;
+    slot->scene_cut = false;
+    if(slot->converted)
+    {
+        slot->scene_cut = p->has_histogram && scene_is_cut(p->histogram, slot->histogram);
+        memcpy(p->histogram, slot->histogram, sizeof(p->histogram));
+        p->has_histogram = true;
+    }
+    else
+    {
+        LOGW("[Frame %u]: Could not convert the frame for detection, carrying the tracks forward", slot->image.frame_number);
+    }
+
+    tracker_predict(tracker);
+
+    if(slot->detected || !slot->converted || !(slot->scene_cut || tracker_needs_detection(tracker)))
+        return false;
+
+    tracker->forced++;
+    pipeline_slot_queue(p, slot, pipeline_detect_task);
+    return true;
+}
+
+// Runs in frame order on the encoder side when tracking, once the slot's
+// detection is done. Feeds it to the tracker, swaps the slot's rects for
+// the tracked ones and queues the transform.
+static void pipeline_track_merge(VideoPipeline* p, FrameSlot* slot)
+{
+    Tracker* tracker = &p->tracker;
+
+    if(slot->detected)
+    {
+        if(slot->scene_cut)
+            tracker_reset(tracker); // nothing to carry over from the last shot
+        tracker_update(tracker, slot->rects, slot->num_rects);
+    }
+
+    slot->num_rects = tracker_get_rects(tracker, slot->image.w, slot->image.h, slot->rects, PIPELINE_MAX_RECTS);
+
+    pipeline_slot_queue(p, slot, pipeline_transform_task);
+}
+
+// Runs the tracker on the encoder side. Takes in frame_number, waiting for
+// it, and every frame after it that is ready, so their detections and
+// transforms run on the pool while the encoder works through the ones
+// before. The slot is READY again once its transform is done.
+static void pipeline_track(VideoPipeline* p, u32 frame_number)
+{
+    for(;;)
+    {
+        u32 n = p->tracked_count;
+        FrameSlot* slot = &p->slots[n % p->slot_count];
+        bool wait = (n <= frame_number);
+
+        pthread_mutex_lock(&p->mutex);
+        while(wait && slot->state != SLOT_READY)
+            pthread_cond_wait(&p->cond, &p->mutex);
+        bool ready = (slot->state == SLOT_READY && slot->image.frame_number == n);
+        pthread_mutex_unlock(&p->mutex);
+
+        if(!ready)
+            return;
+
+        if(!slot->queued && pipeline_track_queue(p, slot))
+        {
+            if(!wait)
+                return; // its detection runs meanwhile
+            continue;   // waits for it above
+        }
+
+        pipeline_track_merge(p, slot);
+        p->tracked_count++;
+    }
+}
+
+// TaskFunc, runs on the pool for the frames of ROI mode the frame task
+// didn't detect. Detects on windows around the previous frame's faces, or
+// the whole frame after a scene cut.
+static void pipeline_roi_task(void* arg)
+{
+    FrameSlot* slot = (FrameSlot*)arg;
+    Image* image_detect = &slot->image_detect;
+
+    if(slot->scene_cut)
+        detect_faces(image_detect);
+    else
+        detect_faces_roi(image_detect, slot->roi_rects, slot->roi_count);
+
+    slot->num_rects = detect_get_rects(image_detect, slot->image.w, slot->image.h, slot->rects, PIPELINE_MAX_RECTS);
+    slot->detected = true;
+    pipeline_transform(slot);
+
+    pipeline_slot_ready(slot);
+}
+
+// Runs in frame order on the encoder side in ROI mode, once the previous
+// frame's faces are known. Hands them to the slot and queues its detection
+// if the frame task didn't detect it.
+static void pipeline_roi_queue(VideoPipeline* p, FrameSlot* slot)
+{
+    slot->queued = true;
+    if(!slot->converted)
+    {
+        // the slot still holds an older frame's pixels and histogram
+        LOGW("[Frame %u]: Could not convert the frame for detection, skipping it", slot->image.frame_number);
+        return;
+    }
+
+    // nothing to look around on a segment's first frame either
+    bool scene_cut = !p->has_histogram || scene_is_cut(p->histogram, slot->histogram);
+    memcpy(p->histogram, slot->histogram, sizeof(p->histogram));
+    p->has_histogram = true;
+
+    if(slot->detected)
+        return;
+
+    slot->scene_cut = scene_cut;
+    slot->roi_count = p->roi_count;
+    memcpy(slot->roi_rects, p->roi_rects, p->roi_count*sizeof(Rect));
+
+    pipeline_slot_queue(p, slot, pipeline_roi_task);
+}
+
+// Runs in frame order on the encoder side in ROI mode. Waits for the slot's
+// detection, keeps its faces for the next frame and queues that one's
+// detection right away, so it runs while this frame is encoded.
+static void pipeline_roi(VideoPipeline* p, FrameSlot* slot, FrameSlot* next)
+{
+    if(!slot->queued)
+    {
+        pipeline_roi_queue(p, slot);
+        pipeline_wait_ready(p, slot);
+    }
+
+    // a frame that couldn't be detected leaves the last faces for the next one
+    if(slot->converted)
+        p->roi_count = detect_get_image_rects(&slot->image_detect, p->roi_rects, PIPELINE_MAX_RECTS);
+
+    pthread_mutex_lock(&p->mutex);
+    bool next_ready = (next->state == SLOT_READY);
+    pthread_mutex_unlock(&p->mutex);
+
+    if(next_ready && !next->queued)
+        pipeline_roi_queue(p, next);
+}
+
+static void* pipeline_decode_thread(void* arg)
+{
+    VideoPipeline* p = (VideoPipeline*)arg;
+
+    for(u32 frame_number = 0;; ++frame_number)
+    {
+        FrameSlot* slot = &p->slots[frame_number % p->slot_count];
+
+        // wait for the encoder to release the slot
+        pthread_mutex_lock(&p->mutex);
+        while(slot->state != SLOT_FREE && !p->aborted)
+            pthread_cond_wait(&p->cond, &p->mutex);
+        bool aborted = p->aborted;
+        pthread_mutex_unlock(&p->mutex);
+
+        bool decoded = !aborted && ffmpeg_reader_read(p->reader, slot->frame);
+
+        pthread_mutex_lock(&p->mutex);
+        if(decoded)
+        {
+            slot->image.frame_number = frame_number;
+            slot->image_detect.frame_number = frame_number;
+            slot->state = SLOT_DECODED;
+            p->decoded_count++;
+        }
+        else
+        {
+            p->decode_done = true;
+        }
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+
+        if(!decoded)
+            break;
+
+        threadpool_submit(&thread_pool, NULL, pipeline_frame_task, slot);
+    }
+
+    return NULL;
+}
+
+// Runs decode -> detect -> transform -> encode over the whole clip. With
+// no writer only detection runs, which is only useful with detections set.
+// With cached set its rects are used and nothing is detected.
+// Returns the number of frames processed, or -1 on error
+int pipeline_run(VideoReader* reader, VideoWriter* writer, VideoDetections* detections, VideoDetections* cached = NULL)
+{
+    int worker_count = thread_pool.worker_count;
+
+    VideoPipeline p = {};
+    p.reader = reader;
+    p.writer = writer;
+    p.detections = detections;
+    p.cached = cached;
+
+    // a couple of frames per worker keeps everyone busy while the encoder
+    // works through the oldest one, segments running side by side share them
+    p.slot_count = worker_count*2 / MAX(1, settings.segment_count) + 2;
+    p.slots = (FrameSlot*)calloc(p.slot_count, sizeof(FrameSlot));
+
+    int detect_w = reader->w;
+    int detect_h = reader->h;
+    if(!settings.no_scale)
+        transform_scaled_size(reader->w, reader->h, DETECT_SCALED_SIZE, &detect_w, &detect_h);
+
+    pthread_mutex_init(&p.mutex, NULL);
+    pthread_cond_init(&p.cond, NULL);
+
+    for(int i = 0; i < p.slot_count; ++i)
+    {
+        FrameSlot* slot = &p.slots[i];
+        slot->pipeline = &p;
+        slot->image.w = reader->w;
+        slot->image.h = reader->h;
+        slot->image.n = 3;
+        slot->image.step = 3*reader->w;
+
+        slot->image_detect.w = detect_w;
+        slot->image_detect.h = detect_h;
+        slot->image_detect.n = 3;
+        slot->image_detect.step = 3*detect_w;
+        slot->image_detect.min_face = settings.min_face * detect_w / reader->w;
+        slot->image_detect.data = (u8*)malloc((u64)detect_w*detect_h*3);
+
+        slot->frame = av_frame_alloc();
+        slot->detect_buffer = (u8*)malloc(DETECT_BUFFER_SIZE);
+        slot->arena = arena_create(ARENA_SIZE_MEDIUM);
+    }
+
+    LOGI("Pipeline: %d frame slots, %d pool workers, detecting at %dx%d", p.slot_count, worker_count, detect_w, detect_h);
+
+    pthread_t decode_thread;
+    bool decoder_started = (pthread_create(&decode_thread, NULL, pipeline_decode_thread, &p) == 0);
+    if(!decoder_started)
+        LOGE("Failed to start decoder thread");
+
+    bool ok = decoder_started;
+
+    int frames_written = 0;
+
+    // encode frames in order as they become ready
+    for(u32 frame_number = 0; ok; ++frame_number)
+    {
+        FrameSlot* slot = &p.slots[frame_number % p.slot_count];
+
+        pthread_mutex_lock(&p.mutex);
+        while(slot->state != SLOT_READY && !(p.decode_done && frame_number >= p.decoded_count))
+            pthread_cond_wait(&p.cond, &p.mutex);
+        bool finished = (slot->state != SLOT_READY);
+        pthread_mutex_unlock(&p.mutex);
+
+        if(finished)
+            break;
+
+        if(settings.detect_interval > 1 && !cached)
+        {
+            pipeline_track(&p, frame_number);
+            pipeline_wait_ready(&p, slot);
+        }
+        else if(settings.roi_interval > 1 && !cached)
+            pipeline_roi(&p, slot, &p.slots[(frame_number + 1) % p.slot_count]);
+
+        if(slot->num_rects > 0)
+            LOGI("[Frame %u]: num_faces: %d", frame_number, slot->num_rects);
+
+        if(detections)
+            video_detections_add(detections, slot->frame->best_effort_timestamp, slot->rects, slot->num_rects);
+
+        if(!writer)
+            ok = true;
+        else if(slot->transformed_rgb)
+            ok = ffmpeg_writer_write(writer, slot->image.data, slot->frame->best_effort_timestamp);
+        else
+            ok = ffmpeg_writer_write_frame(writer, slot->frame);
+        av_frame_unref(slot->frame);
+        frames_written++;
+
+        pthread_mutex_lock(&p.mutex);
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.mutex);
+    }
+
+    if(!ok)
+    {
+        // stop the decoder so it can wind down
+        pthread_mutex_lock(&p.mutex);
+        p.aborted = true;
+        pthread_cond_broadcast(&p.cond);
+        pthread_mutex_unlock(&p.mutex);
+    }
+
+    if(decoder_started)
+        pthread_join(decode_thread, NULL);
+
+    // frame tasks still in flight reference the slots
+    pthread_mutex_lock(&p.mutex);
+    for(int i = 0; i < p.slot_count; ++i)
+    {
+        while(p.slots[i].state == SLOT_DECODED || p.slots[i].state == SLOT_QUEUED)
+            pthread_cond_wait(&p.cond, &p.mutex);
+    }
+    pthread_mutex_unlock(&p.mutex);
+
+    for(int i = 0; i < p.slot_count; ++i)
+    {
+        FrameSlot* slot = &p.slots[i];
+        free(slot->image_detect.data);
+        free(slot->image.data);
+        free(slot->detect_buffer);
+        av_frame_free(&slot->frame);
+        sws_freeContext(slot->sws_detect);
+        sws_freeContext(slot->sws_full);
+        arena_destroy(slot->arena);
+    }
+    free(p.slots);
+
+    pthread_mutex_destroy(&p.mutex);
+    pthread_cond_destroy(&p.cond);
+
+    if(settings.detect_interval > 1 && !cached)
+    {
+        Tracker* t = &p.tracker;
+        LOGI("Tracker: CNN ran on %u of %u frames (%u forced by tracks or scene cuts), %u invocations saved",
+             t->detections, t->frames, t->forced, t->frames - t->detections);
+    }
+
+    return ok ? frames_written : -1;
+}
@@ -0,0 +1,297 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "base.h"
+#include "ffmpeg.h"
+#include "pipeline.h"
+#include "util.h"
+
+// Segmented video processing
+//
+// One decoder and one encoder serialise a clip no matter how many detect
+// workers there are. In segmented mode the key frames are indexed first,
+// and the clip is split into up to settings.segment_count ranges of whole
+// GOPs. Every range runs its own decode -> detect -> transform -> encode
+// pipeline into a temporary MP4, all at the same time and sharing the
+// detect pool. The parts are then joined into the output file with their
+// timestamps lined up.
+
+#define SEGMENT_MAX_COUNT 64
+
+typedef struct
+{
+    const char* input_file;
+    char part_file[300];
+    int index;
+    int codec_threads;
+
+    PacketInfo start; // first key frame of the range
+    i64 start_pts;    // AV_NOPTS_VALUE for the first segment
+    i64 end_pts;      // AV_NOPTS_VALUE for the last segment
+
+    VideoDetections* cached; // shared, read only
+
+    // filled in by the segment
+    VideoDetections detections; // only recorded without a cache
+    AVRational encoder_time_base;
+    i64 first_pts; // first frame written, in encoder_time_base
+    int frame_count;
+    bool ok;
+} Segment;
+
+static void* segment_thread(void* arg)
+{
+    Segment* seg = (Segment*)arg;
+    seg->ok = false;
+
+    VideoReader reader = {};
+    if(!ffmpeg_reader_open(&reader, seg->input_file, seg->codec_threads))
+        return NULL;
+
+    if(seg->start_pts != AV_NOPTS_VALUE && !ffmpeg_reader_seek(&reader, &seg->start))
+    {
+        ffmpeg_reader_close(&reader);
+        return NULL;
+    }
+    reader.start_pts = seg->start_pts;
+    reader.end_pts = seg->end_pts;
+
+    VideoWriter writer = {};
+    if(!ffmpeg_writer_open(&writer, seg->part_file, reader.w, reader.h, reader.frame_rate, reader.time_base, seg->codec_threads))
+    {
+        ffmpeg_reader_close(&reader);
+        return NULL;
+    }
+
+    seg->frame_count = pipeline_run(&reader, &writer, seg->cached ? NULL : &seg->detections, seg->cached);
+    seg->encoder_time_base = writer.codec_ctx->time_base;
+    seg->first_pts = writer.first_pts;
+
+    bool encoded = ffmpeg_writer_close(&writer);
+    ffmpeg_reader_close(&reader);
+
+    seg->ok = (seg->frame_count >= 0) && encoded;
+    LOGI("Segment %d: %d frames", seg->index, seg->frame_count);
+    return NULL;
+}
+
+// Splits the clip at key frames into at most count ranges of roughly the
+// same number of packets. Returns the number of segments.
+static int segment_plan(VideoReader* index, Segment* segments, int count)
+{
+    int packet_count = index->packet_count;
+    int segment_count = 0;
+
+    int target = MAX(1, packet_count / count);
+    int next_split = 0;
+
+    for(int i = 0; i < packet_count && segment_count < count; ++i)
+    {
+        PacketInfo* p = &index->packets[i];
+        if(!p->key || i < next_split || p->pts == AV_NOPTS_VALUE)
+            continue;
+
+        Segment* seg = &segments[segment_count];
+        seg->index = segment_count;
+        seg->start = *p;
+        seg->start_pts = (segment_count == 0) ? AV_NOPTS_VALUE : p->pts;
+        seg->end_pts = AV_NOPTS_VALUE;
+
+        if(segment_count > 0)
+            segments[segment_count-1].end_pts = p->pts;
+
+        segment_count++;
+        next_split = i + target;
+    }
+
+    return segment_count;
+}
+
+// Copies the packets of every part into output_file, shifting each part so
+// its first frame lands where the source had it
+static bool segment_join(Segment* segments, int segment_count, const char* output_file)
+{
+    AVFormatContext* out_ctx = NULL;
+    AVStream* out_stream = NULL;
+    AVPacket* pkt = av_packet_alloc();
+    bool ok = (pkt != NULL);
+    i64 last_dts = AV_NOPTS_VALUE;
+
+    for(int i = 0; ok && i < segment_count; ++i)
+    {
+        Segment* seg = &segments[i];
+        if(seg->frame_count == 0)
+            continue;
+
+        AVFormatContext* in_ctx = NULL;
+        if(avformat_open_input(&in_ctx, seg->part_file, NULL, NULL) < 0 || avformat_find_stream_info(in_ctx, NULL) < 0)
+        {
+            LOGE("Could not open segment '%s'", seg->part_file);
+            avformat_close_input(&in_ctx);
+            ok = false;
+            break;
+        }
+        AVStream* in_stream = in_ctx->streams[0];
+
+        if(!out_ctx)
+        {
+            avformat_alloc_output_context2(&out_ctx, NULL, "mp4", output_file);
+            out_stream = out_ctx ? avformat_new_stream(out_ctx, NULL) : NULL;
+
+            ok = out_stream && avcodec_parameters_copy(out_stream->codecpar, in_stream->codecpar) >= 0;
+            if(ok)
+            {
+                out_stream->codecpar->codec_tag = 0;
+                out_stream->time_base = in_stream->time_base;
+            }
+
+            if(ok && !(out_ctx->oformat->flags & AVFMT_NOFILE))
+                ok = avio_open(&out_ctx->pb, output_file, AVIO_FLAG_WRITE) >= 0;
+
+            if(!ok || avformat_write_header(out_ctx, NULL) < 0)
+            {
+                LOGE("Could not open output file '%s'", output_file);
+                avformat_close_input(&in_ctx);
+                ok = false;
+                break;
+            }
+        }
+        else
+        {
+            AVCodecParameters* a = out_stream->codecpar;
+            AVCodecParameters* b = in_stream->codecpar;
+            if(a->extradata_size != b->extradata_size || memcmp(a->extradata, b->extradata, a->extradata_size) != 0)
+                LOGW("Segment %d has different codec headers, the output may not play everywhere", i);
+        }
+
+        // the first packet of a part is its first frame (an IDR), put it
+        // where the encoder was told it goes
+        i64 offset = 0;
+        bool first = true;
+
+        while(ok && av_read_frame(in_ctx, pkt) >= 0)
+        {
+            av_packet_rescale_ts(pkt, in_stream->time_base, out_stream->time_base);
+
+            if(first)
+            {
+                i64 expected = av_rescale_q(seg->first_pts, seg->encoder_time_base, out_stream->time_base);
+                offset = expected - pkt->pts;
+                first = false;
+            }
+
+            pkt->pts += offset;
+            pkt->dts += offset;
+            if(last_dts != AV_NOPTS_VALUE && pkt->dts <= last_dts)
+                pkt->dts = MIN(last_dts + 1, pkt->pts);
+            last_dts = pkt->dts;
+
+            pkt->stream_index = out_stream->index;
+            if(av_interleaved_write_frame(out_ctx, pkt) < 0)
+            {
+                LOGE("Error writing packet");
+                ok = false;
+            }
+            av_packet_unref(pkt);
+        }
+
+        avformat_close_input(&in_ctx);
+    }
+
+    if(ok && out_ctx && av_write_trailer(out_ctx) < 0)
+    {
+        LOGE("Error writing trailer");
+        ok = false;
+    }
+
+    if(out_ctx)
+    {
+        if(!(out_ctx->oformat->flags & AVFMT_NOFILE) && out_ctx->pb)
+            avio_closep(&out_ctx->pb);
+        avformat_free_context(out_ctx);
+    }
+    av_packet_free(&pkt);
+
+    return ok && out_stream;
+}
+
+// Processes input_file as up to segment_count independent parts at once.
+// If detections is empty it's filled with the rects of the whole clip,
+// otherwise they're used instead of detecting.
+// Returns the number of frames written, or -1 on error
+int segments_run(const char* input_file, const char* output_file, int segment_count, VideoDetections* detections)
+{
+    segment_count = CLAMP(segment_count, 1, SEGMENT_MAX_COUNT);
+
+    // index the key frames, demuxing only
+    VideoReader index = {};
+    if(!ffmpeg_reader_open(&index, input_file, 1))
+        return -1;
+
+    index.record_packets = true;
+    AVPacket* pkt = av_packet_alloc();
+    while(ffmpeg_reader_read_packet(&index, pkt))
+        av_packet_unref(pkt);
+    av_packet_free(&pkt);
+
+    Segment segments[SEGMENT_MAX_COUNT] = {};
+    segment_count = segment_plan(&index, segments, segment_count);
+    ffmpeg_reader_close(&index);
+
+    if(segment_count == 0)
+    {
+        LOGE("No key frames found");
+        return -1;
+    }
+
+    LOGI("Processing %d segments", segment_count);
+
+    // split the cores between the segments' codecs instead of every
+    // decoder and encoder starting one thread per core
+    int codec_threads = MAX(1, util_get_core_count() / segment_count);
+
+    pthread_t threads[SEGMENT_MAX_COUNT];
+    bool started[SEGMENT_MAX_COUNT] = {0};
+
+    for(int i = 0; i < segment_count; ++i)
+    {
+        Segment* seg = &segments[i];
+        seg->input_file = input_file;
+        seg->codec_threads = codec_threads;
+        seg->cached = (detections->frame_count > 0) ? detections : NULL;
+        snprintf(seg->part_file, sizeof(seg->part_file), "%s.part%02d.mp4", output_file, i);
+
+        started[i] = (pthread_create(&threads[i], NULL, segment_thread, seg) == 0);
+        if(!started[i])
+            LOGE("Failed to start segment thread");
+    }
+
+    bool ok = true;
+    int frame_count = 0;
+
+    for(int i = 0; i < segment_count; ++i)
+    {
+        if(started[i])
+            pthread_join(threads[i], NULL);
+
+        ok = ok && started[i] && segments[i].ok;
+        frame_count += MAX(0, segments[i].frame_count);
+    }
+
+    ok = ok && segment_join(segments, segment_count, output_file);
+
+    for(int i = 0; i < segment_count; ++i)
+    {
+        remove(segments[i].part_file);
+
+        // segments are in presentation order, so are their frames
+        VideoDetections* d = &segments[i].detections;
+        for(int j = 0; ok && j < d->frame_count; ++j)
+            video_detections_add(detections, d->frames[j].pts, &d->rects[d->frames[j].first_rect], d->frames[j].num_rects);
+        video_detections_free(d);
+    }
+
+    return ok ? frame_count : -1;
+}
@@ -0,0 +1,685 @@
+#pragma once
+
+#include "base.h"
+#include "ffmpeg.h"
+#include "pipeline.h"
+#include "transform.h"
+
+// Smart rendering
+//
+// Detection runs over the whole clip first. The source is then split at its
+// key frames: GOPs without a single rect are copied into the output packet
+// for packet, and only GOPs with detections are decoded, transformed and
+// re-encoded.
+//
+// Every re-encoded GOP gets a fresh x264 encoder, so it starts on an IDR
+// frame and carries its own SPS/PPS in band under id 1. The source's
+// parameter sets (id 0, in the avcC) stay valid for the copied GOPs around
+// it. Re-encoded GOPs have no B-frames, which lets them take over the dts
+// sequence of the source GOP they replace and keeps the timeline valid
+// across every boundary.
+
+typedef struct
+{
+    int first_packet;
+    int packet_count;
+    bool open;   // has leading frames that reference the previous GOP
+    bool encode; // re-encode instead of copying
+    bool decode; // needs decoding, either to encode it or as a reference for the next GOP
+} SmartGop;
+
+typedef struct
+{
+    i64 pts;
+    int gop;
+} SmartPts;
+
+typedef struct
+{
+    VideoReader* reader;
+    VideoDetections* detections;
+
+    SmartGop* gops;
+    int gop_count;
+    int* packet_gop;     // GOP of every packet, in decode order
+    int packet_count;
+    i64* packet_dts;     // source dts in decode order
+    SmartPts* pts_index; // packet pts -> GOP, sorted by pts
+
+    AVFormatContext* out_ctx;
+    AVStream* out_stream;
+    int nal_length_size;
+    i64 last_dts;
+
+    // GOP being re-encoded
+    AVCodecContext* enc_ctx;
+    AVPacket* enc_pkt;
+    int enc_gop;
+    int enc_frames;
+    int enc_packets;
+    int last_encoded_gop;
+
+    // copied packets held back until the GOP being encoded is written
+    AVPacket** queue;
+    int queue_count;
+    int queue_cap;
+
+    int frames_copied;
+    int frames_encoded;
+} SmartRender;
+
+// SPS/PPS id 0 is the first ue(v) field, a single set bit
+static inline bool smart_nal_id_is_zero(const u8* nal, int size, int offset, u8 mask)
+{
+    return size > offset && (nal[offset] & mask);
+}
+
+// Smart rendering needs an H.264 source with its parameter sets in an avcC
+// (MP4/MKV), using ids that don't collide with the ones the re-encoded GOPs
+// bring along, and a pixel format the planar transforms can handle.
+bool smart_render_supported(VideoReader* reader)
+{
+    AVCodecParameters* par = reader->stream->codecpar;
+
+    if(par->codec_id != AV_CODEC_ID_H264)
+    {
+        LOGW("Smart rendering needs an H.264 source");
+        return false;
+    }
+
+    switch(par->format)
+    {
+        case AV_PIX_FMT_YUV420P: case AV_PIX_FMT_YUVJ420P:
+        case AV_PIX_FMT_YUV422P: case AV_PIX_FMT_YUVJ422P:
+        case AV_PIX_FMT_YUV444P: case AV_PIX_FMT_YUVJ444P:
+            break;
+        default:
+            LOGW("Smart rendering doesn't support pixel format %s", av_get_pix_fmt_name((enum AVPixelFormat)par->format));
+            return false;
+    }
+
+    if(!avcodec_find_encoder_by_name("libx264"))
+    {
+        LOGW("Smart rendering needs libx264");
+        return false;
+    }
+
+    const u8* p = par->extradata;
+    int size = par->extradata_size;
+
+    if(!p || size < 7 || p[0] != 1)
+    {
+        LOGW("Smart rendering needs the parameter sets in an avcC");
+        return false;
+    }
+
+    int offset = 5;
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        if(offset >= size)
+            return false;
+
+        int count = p[offset++] & (pass == 0 ? 0x1f : 0xff);
+        for(int i = 0; i < count; ++i)
+        {
+            if(offset + 2 > size)
+                return false;
+
+            int len = (p[offset] << 8) | p[offset+1];
+            const u8* nal = p + offset + 2;
+            offset += 2 + len;
+
+            if(offset > size)
+                return false;
+
+            // SPS: header, profile, constraints, level, sps_id
+            // PPS: header, pps_id, sps_id
+            bool zero = (pass == 0) ? smart_nal_id_is_zero(nal, len, 4, 0x80)
+                                    : smart_nal_id_is_zero(nal, len, 1, 0x80) && smart_nal_id_is_zero(nal, len, 1, 0x40);
+            if(!zero)
+            {
+                LOGW("Smart rendering needs the source to use parameter set id 0");
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static int smart_gop_of_pts(SmartRender* sr, i64 pts)
+{
+    int lo = 0;
+    int hi = sr->packet_count - 1;
+
+    while(lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        if(sr->pts_index[mid].pts == pts) return sr->pts_index[mid].gop;
+        if(sr->pts_index[mid].pts < pts) lo = mid + 1;
+        else hi = mid - 1;
+    }
+
+    return -1;
+}
+
+static int smart_compare_pts(const void* a, const void* b)
+{
+    i64 pa = ((SmartPts*)a)->pts;
+    i64 pb = ((SmartPts*)b)->pts;
+    return (pa > pb) - (pa < pb);
+}
+
+// Splits the packets at key frames and decides what happens to every GOP
+static bool smart_plan(SmartRender* sr, PacketInfo* packets, int packet_count)
+{
+    if(packet_count == 0 || !packets[0].key)
+    {
+        LOGW("Smart rendering needs the stream to start on a key frame");
+        return false;
+    }
+
+    sr->packet_count = packet_count;
+    sr->packet_gop = (int*)malloc(packet_count*sizeof(int));
+    sr->packet_dts = (i64*)malloc(packet_count*sizeof(i64));
+    sr->pts_index  = (SmartPts*)malloc(packet_count*sizeof(SmartPts));
+    sr->gops = (SmartGop*)calloc(packet_count, sizeof(SmartGop));
+
+    for(int i = 0; i < packet_count; ++i)
+    {
+        if(packets[i].pts == AV_NOPTS_VALUE || packets[i].dts == AV_NOPTS_VALUE)
+        {
+            LOGW("Smart rendering needs timestamps on every packet");
+            return false;
+        }
+
+        if(packets[i].key)
+        {
+            SmartGop* g = &sr->gops[sr->gop_count++];
+            g->first_packet = i;
+        }
+
+        SmartGop* g = &sr->gops[sr->gop_count-1];
+        g->packet_count++;
+
+        if(packets[i].pts < packets[g->first_packet].pts)
+            g->open = true;
+
+        sr->packet_gop[i] = sr->gop_count-1;
+        sr->packet_dts[i] = packets[i].dts;
+        sr->pts_index[i].pts = packets[i].pts;
+        sr->pts_index[i].gop = sr->gop_count-1;
+    }
+
+    qsort(sr->pts_index, packet_count, sizeof(SmartPts), smart_compare_pts);
+
+    for(int g = 0; g < sr->gop_count; ++g)
+    {
+        SmartGop* gop = &sr->gops[g];
+        for(int i = gop->first_packet; i < gop->first_packet + gop->packet_count && !gop->encode; ++i)
+        {
+            FrameDetections* f = video_detections_find(sr->detections, packets[i].pts);
+            gop->encode = (f && f->num_rects > 0);
+        }
+
+        // leading frames of an open GOP reference the previous one, which
+        // won't match any more once that one is re-encoded
+        if(g > 0 && gop->open && sr->gops[g-1].encode)
+            gop->encode = true;
+    }
+
+    for(int g = 0; g < sr->gop_count; ++g)
+    {
+        bool next_needs_us = (g+1 < sr->gop_count) && sr->gops[g+1].encode && sr->gops[g+1].open;
+        sr->gops[g].decode = sr->gops[g].encode || next_needs_us;
+    }
+
+    return true;
+}
+
+static bool smart_open_output(SmartRender* sr, const char* filename)
+{
+    avformat_alloc_output_context2(&sr->out_ctx, NULL, "mp4", filename);
+    if(!sr->out_ctx)
+    {
+        LOGE("Could not deduce output format");
+        return false;
+    }
+
+    sr->out_stream = avformat_new_stream(sr->out_ctx, NULL);
+    if(!sr->out_stream || avcodec_parameters_copy(sr->out_stream->codecpar, sr->reader->stream->codecpar) < 0)
+    {
+        LOGE("Could not create stream");
+        return false;
+    }
+    sr->out_stream->codecpar->codec_tag = 0;
+    sr->out_stream->time_base = sr->reader->time_base;
+
+    if(!(sr->out_ctx->oformat->flags & AVFMT_NOFILE) && avio_open(&sr->out_ctx->pb, filename, AVIO_FLAG_WRITE) < 0)
+    {
+        LOGE("Could not open output file '%s'", filename);
+        return false;
+    }
+
+    if(avformat_write_header(sr->out_ctx, NULL) < 0)
+    {
+        LOGE("Error occurred writing header");
+        return false;
+    }
+
+    sr->nal_length_size = (sr->reader->stream->codecpar->extradata[4] & 3) + 1;
+    return true;
+}
+
+// Takes ownership of pkt's data. pkt's timestamps are in the source time base
+static bool smart_write_packet(SmartRender* sr, AVPacket* pkt)
+{
+    sr->last_dts = pkt->dts;
+
+    pkt->stream_index = sr->out_stream->index;
+    av_packet_rescale_ts(pkt, sr->reader->time_base, sr->out_stream->time_base);
+
+    if(av_interleaved_write_frame(sr->out_ctx, pkt) < 0)
+    {
+        LOGE("Error writing packet");
+        return false;
+    }
+    return true;
+}
+
+static bool smart_copy_packet(SmartRender* sr, AVPacket* pkt)
+{
+    sr->frames_copied++;
+
+    if(!sr->enc_ctx)
+        return smart_write_packet(sr, pkt);
+
+    // an encoded GOP is still in flight and has to be written first
+    if(sr->queue_count == sr->queue_cap)
+    {
+        sr->queue_cap = MAX(64, sr->queue_cap*2);
+        sr->queue = (AVPacket**)realloc(sr->queue, sr->queue_cap*sizeof(AVPacket*));
+    }
+    sr->queue[sr->queue_count++] = av_packet_clone(pkt);
+    av_packet_unref(pkt);
+    return true;
+}
+
+// x264 writes Annex B start codes, the MP4 track wants length prefixes
+static bool smart_annexb_to_avcc(SmartRender* sr, AVPacket* pkt)
+{
+    const u8* in = pkt->data;
+    const u8* end = pkt->data + pkt->size;
+
+    AVPacket* out = av_packet_alloc();
+    if(!out || av_new_packet(out, pkt->size*2 + 16) < 0)
+    {
+        av_packet_free(&out);
+        return false;
+    }
+
+    int out_size = 0;
+
+    const u8* nal = in;
+    while(nal + 3 <= end && !(nal[0] == 0 && nal[1] == 0 && nal[2] == 1)) nal++;
+
+    while(nal + 3 <= end)
+    {
+        nal += 3; // start code
+
+        const u8* next = nal;
+        while(next + 3 <= end && !(next[0] == 0 && next[1] == 0 && next[2] == 1)) next++;
+        if(next + 3 > end) next = end;
+
+        // trailing zeros belong to the next 4 byte start code
+        const u8* nal_end = next;
+        while(nal_end > nal && nal_end[-1] == 0) nal_end--;
+
+        int len = (int)(nal_end - nal);
+        for(int i = sr->nal_length_size - 1; i >= 0; --i)
+            out->data[out_size++] = (u8)(len >> (8*i));
+        memcpy(out->data + out_size, nal, len);
+        out_size += len;
+
+        nal = next;
+    }
+
+    av_shrink_packet(out, out_size);
+    av_packet_copy_props(out, pkt);
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, out);
+    av_packet_free(&out);
+    return true;
+}
+
+static bool smart_drain_encoder(SmartRender* sr)
+{
+    SmartGop* gop = &sr->gops[sr->enc_gop];
+
+    for(;;)
+    {
+        int ret = avcodec_receive_packet(sr->enc_ctx, sr->enc_pkt);
+        if(ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return true;
+        if(ret < 0)
+        {
+            LOGE("Error encoding frame");
+            return false;
+        }
+
+        // no B-frames, so packets come out in presentation order and the
+        // source GOP's dts sequence always lies at or before their pts
+        i64 dts = sr->enc_pkt->pts;
+        if(sr->enc_packets < gop->packet_count)
+            dts = MIN(dts, sr->packet_dts[gop->first_packet + sr->enc_packets]);
+        if(sr->last_dts != AV_NOPTS_VALUE && dts <= sr->last_dts)
+            dts = sr->last_dts + 1;
+
+        sr->enc_pkt->dts = dts;
+        sr->enc_packets++;
+
+        if(!smart_annexb_to_avcc(sr, sr->enc_pkt) || !smart_write_packet(sr, sr->enc_pkt))
+            return false;
+    }
+}
+
+static bool smart_start_gop(SmartRender* sr, int g, AVFrame* frame)
+{
+    const AVCodec* codec = avcodec_find_encoder_by_name("libx264");
+    AVCodecParameters* par = sr->reader->stream->codecpar;
+
+    AVCodecContext* ctx = avcodec_alloc_context3(codec);
+    if(!ctx)
+    {
+        LOGE("Could not allocate codec context");
+        return false;
+    }
+
+    ctx->width = frame->width;
+    ctx->height = frame->height;
+    ctx->pix_fmt = (enum AVPixelFormat)frame->format;
+    ctx->time_base = sr->reader->time_base;
+    ctx->framerate = sr->reader->frame_rate;
+    ctx->sample_aspect_ratio = frame->sample_aspect_ratio;
+    ctx->color_range = frame->color_range;
+    ctx->color_primaries = frame->color_primaries;
+    ctx->color_trc = frame->color_trc;
+    ctx->colorspace = frame->colorspace;
+    ctx->chroma_sample_location = frame->chroma_location;
+    ctx->level = par->level;
+    ctx->gop_size = sr->gops[g].packet_count + 1; // one key frame, at the start
+    ctx->max_b_frames = 0;
+    ctx->thread_count = 0;
+
+    AVDictionary* opts = NULL;
+    av_dict_set(&opts, "preset", "superfast", 0);
+    av_dict_set(&opts, "x264-params", "sps-id=1:repeat-headers=1", 0);
+    switch(par->profile)
+    {
+        case AV_PROFILE_H264_BASELINE:
+        case AV_PROFILE_H264_CONSTRAINED_BASELINE: av_dict_set(&opts, "profile", "baseline", 0); break;
+        case AV_PROFILE_H264_MAIN:                 av_dict_set(&opts, "profile", "main", 0);     break;
+        case AV_PROFILE_H264_HIGH:                 av_dict_set(&opts, "profile", "high", 0);     break;
+        default: break;
+    }
+
+    int ret = avcodec_open2(ctx, codec, &opts);
+    av_dict_free(&opts);
+    if(ret < 0)
+    {
+        LOGE("Could not open encoder");
+        avcodec_free_context(&ctx);
+        return false;
+    }
+
+    sr->enc_ctx = ctx;
+    sr->enc_gop = g;
+    sr->enc_frames = 0;
+    sr->enc_packets = 0;
+    return true;
+}
+
+static bool smart_finish_gop(SmartRender* sr)
+{
+    avcodec_send_frame(sr->enc_ctx, NULL);
+    bool ok = smart_drain_encoder(sr);
+
+    avcodec_free_context(&sr->enc_ctx);
+    sr->last_encoded_gop = sr->enc_gop;
+
+    for(int i = 0; i < sr->queue_count; ++i)
+    {
+        if(ok)
+            ok = smart_write_packet(sr, sr->queue[i]);
+        av_packet_free(&sr->queue[i]);
+    }
+    sr->queue_count = 0;
+
+    return ok;
+}
+
+static bool smart_handle_frame(SmartRender* sr, AVFrame* frame)
+{
+    i64 pts = frame->best_effort_timestamp;
+    int g = smart_gop_of_pts(sr, pts);
+
+    if(g < 0)
+    {
+        LOGW("Dropping frame with unknown pts %ld", (long)pts);
+        return true;
+    }
+
+    // frames come out in presentation order, so a frame from another GOP
+    // means the one being encoded is complete
+    if(sr->enc_ctx && g != sr->enc_gop && !smart_finish_gop(sr))
+        return false;
+
+    if(!sr->gops[g].encode)
+        return true; // only decoded as a reference
+
+    if(g <= sr->last_encoded_gop)
+    {
+        LOGW("Dropping late frame of GOP %d", g);
+        return true;
+    }
+
+    if(!sr->enc_ctx && !smart_start_gop(sr, g, frame))
+        return false;
+
+    FrameDetections* f = video_detections_find(sr->detections, pts);
+    if(f && f->num_rects > 0 && settings.transform_count > 0)
+    {
+        PlanarImage planar = {};
+        if(!ffmpeg_frame_to_planar(frame, &planar))
+        {
+            LOGE("Unsupported pixel format for transforms");
+            return false;
+        }
+
+        // Apply transformations
+        for(int j = 0; j < settings.transform_count; ++j)
+        {
+            Transform* t = &settings.transforms[j];
+            transform_apply_planar(&planar, f->num_rects, &sr->detections->rects[f->first_rect], t->type);
+        }
+    }
+
+    frame->pts = pts;
+    frame->pict_type = AV_PICTURE_TYPE_NONE;
+
+    if(avcodec_send_frame(sr->enc_ctx, frame) < 0)
+    {
+        LOGE("Error sending frame");
+        return false;
+    }
+    sr->frames_encoded++;
+
+    if(!smart_drain_encoder(sr))
+        return false;
+
+    if(++sr->enc_frames == sr->gops[g].packet_count)
+        return smart_finish_gop(sr);
+
+    return true;
+}
+
+// Sends pkt to the decoder (NULL drains it) and handles every frame that comes out
+static bool smart_decode(SmartRender* sr, AVPacket* pkt, AVFrame* frame)
+{
+    AVCodecContext* dec = sr->reader->codec_ctx;
+
+    int ret = avcodec_send_packet(dec, pkt);
+    if(ret < 0 && ret != AVERROR_EOF)
+    {
+        LOGE("Error sending packet for decoding");
+        return false;
+    }
+
+    for(;;)
+    {
+        ret = avcodec_receive_frame(dec, frame);
+        if(ret == AVERROR(EAGAIN))
+            return true;
+
+        if(ret == AVERROR_EOF)
+        {
+            // ready to start over at the next key frame
+            avcodec_flush_buffers(dec);
+            return true;
+        }
+
+        if(ret < 0)
+        {
+            LOGE("Error during decoding");
+            return false;
+        }
+
+        bool ok = smart_handle_frame(sr, frame);
+        av_frame_unref(frame);
+        if(!ok)
+            return false;
+    }
+}
+
+static void smart_free(SmartRender* sr)
+{
+    if(sr->enc_ctx) avcodec_free_context(&sr->enc_ctx);
+    if(sr->enc_pkt) av_packet_free(&sr->enc_pkt);
+
+    for(int i = 0; i < sr->queue_count; ++i)
+        av_packet_free(&sr->queue[i]);
+    free(sr->queue);
+
+    if(sr->out_ctx)
+    {
+        if(!(sr->out_ctx->oformat->flags & AVFMT_NOFILE) && sr->out_ctx->pb)
+            avio_closep(&sr->out_ctx->pb);
+        avformat_free_context(sr->out_ctx);
+    }
+
+    free(sr->gops);
+    free(sr->packet_gop);
+    free(sr->packet_dts);
+    free(sr->pts_index);
+}
+
+// Detects over the whole clip with reader (freshly opened) into detections,
+// then writes output_file copying every GOP without detections. If
+// detections already holds the clip's rects only the packets are indexed.
+// Returns the number of frames written, or -1 on error
+int smart_render(VideoReader* reader, const char* input_file, const char* output_file, VideoDetections* detections)
+{
+    // pass 1: detection only, remembering every packet
+    reader->record_packets = true;
+
+    if(detections->frame_count > 0)
+    {
+        AVPacket* pkt = av_packet_alloc();
+        while(ffmpeg_reader_read_packet(reader, pkt))
+            av_packet_unref(pkt);
+        av_packet_free(&pkt);
+    }
+    else if(pipeline_run(reader, NULL, detections) < 0)
+    {
+        return -1;
+    }
+
+    SmartRender sr = {};
+    sr.detections = detections;
+    sr.last_dts = AV_NOPTS_VALUE;
+    sr.last_encoded_gop = -1;
+
+    VideoReader source = {};
+    bool ok = ffmpeg_reader_open(&source, input_file);
+    sr.reader = &source;
+
+    ok = ok && smart_plan(&sr, reader->packets, reader->packet_count);
+    ok = ok && smart_open_output(&sr, output_file);
+
+    if(ok)
+    {
+        int encoded = 0;
+        for(int g = 0; g < sr.gop_count; ++g)
+            encoded += sr.gops[g].encode;
+        LOGI("Smart render: re-encoding %d of %d GOPs", encoded, sr.gop_count);
+    }
+
+    // pass 2: copy or re-encode GOP by GOP
+    sr.enc_pkt = av_packet_alloc();
+    AVPacket* pkt = av_packet_alloc();
+    AVFrame* frame = av_frame_alloc();
+    ok = ok && sr.enc_pkt && pkt && frame;
+
+    bool decoding = false;
+
+    for(int k = 0; ok && ffmpeg_reader_read_packet(&source, pkt); ++k)
+    {
+        if(k >= sr.packet_count)
+        {
+            LOGE("Source changed between passes");
+            ok = false;
+            break;
+        }
+
+        SmartGop* gop = &sr.gops[sr.packet_gop[k]];
+
+        if(decoding && !gop->decode)
+        {
+            // get the frames of the previous GOP out before copying on
+            ok = smart_decode(&sr, NULL, frame) && (!sr.enc_ctx || smart_finish_gop(&sr));
+            decoding = false;
+        }
+
+        if(ok && gop->decode)
+        {
+            ok = smart_decode(&sr, pkt, frame);
+            decoding = true;
+        }
+
+        if(ok && !gop->encode)
+            ok = smart_copy_packet(&sr, pkt);
+
+        av_packet_unref(pkt);
+    }
+
+    if(ok && decoding)
+        ok = smart_decode(&sr, NULL, frame);
+    if(ok && sr.enc_ctx)
+        ok = smart_finish_gop(&sr);
+
+    if(ok && av_write_trailer(sr.out_ctx) < 0)
+    {
+        LOGE("Error writing trailer");
+        ok = false;
+    }
+
+    if(ok)
+        LOGI("Smart render: %d frames copied, %d re-encoded", sr.frames_copied, sr.frames_encoded);
+
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    smart_free(&sr);
+    ffmpeg_reader_close(&source);
+
+    return ok ? sr.frames_copied + sr.frames_encoded : -1;
+}
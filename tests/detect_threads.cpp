@@ -0,0 +1,142 @@
+// Detection under a busy worker pool
+//
+// Runs many detections of the sample images on the pool at once, the way
+// image tiles and video frames are queued. A worker waiting on the tasks of a
+// CNN layer runs other queued work meanwhile, so whole detections end up
+// nested inside each other on one thread. Every detection has to find the
+// same rects as the same image detected on its own.
+//
+//   tests/run.sh [thread_count]
+
+#include "../base.h"
+#include "../threadpool.h"
+#include "../detect.h"
+
+#define TEST_REPEATS 8 // detections queued per image
+
+Arena* thread_arenas[MAX_ARENAS] = {0};
+Timer timer = {0};
+ProgramSettings settings = {};
+ThreadPool thread_pool = {};
+Image texture_image = {};
+
+static const char* test_images[] = {
+    "assets/boggs.png",
+    "assets/decker.png",
+    "assets/test1.jpg",
+    "assets/test1_small.jpg",
+    "assets/test2.jpg",
+};
+#define TEST_IMAGE_COUNT (int)(sizeof(test_images)/sizeof(test_images[0]))
+
+static Arena* run_arenas[TEST_IMAGE_COUNT*TEST_REPEATS];
+
+static bool same_rects(Image* a, Image* b)
+{
+    int na = *(int*)a->result;
+    int nb = *(int*)b->result;
+    return na == nb && memcmp(a->result + sizeof(int), b->result + sizeof(int), na*sizeof(Rect)) == 0;
+}
+
+// What threadpool_wait() does when another worker still holds a task of the
+// layer: run whatever is queued next. Done before every layer here, so the
+// detections nest on any machine instead of only when the timing allows.
+static void nesting_parallel_for(void* ctx, facedetect_task_func func, void* arg, int count)
+{
+    threadpool_run_one((ThreadPool*)ctx);
+    detect_parallel_for(ctx, func, arg, count);
+}
+
+// Queues TEST_REPEATS detections of every image at once with parallel
+// splitting the layers, returns how many found other rects than expected
+static int run_all(const char* name, facedetect_parallel_func parallel, Image* runs, Image* images, Image* expected, u8 (*buffers)[DETECT_BUFFER_SIZE])
+{
+    facedetect_set_parallel(parallel, &thread_pool, thread_pool.worker_count);
+
+    TaskGroup group = {};
+    for(int r = 0; r < TEST_REPEATS; ++r)
+    {
+        for(int i = 0; i < TEST_IMAGE_COUNT; ++i)
+        {
+            Image* run = &runs[r*TEST_IMAGE_COUNT + i];
+            *run = images[i];
+            run->arena = run_arenas[r*TEST_IMAGE_COUNT + i]; // results are stored from the worker
+            arena_reset(run_arenas[r*TEST_IMAGE_COUNT + i]);
+            run->detect_buffer = buffers[TEST_IMAGE_COUNT + r*TEST_IMAGE_COUNT + i];
+
+            // keep the queue short, detect_parallel_for() only hands out
+            // layer tasks (and waits on them) while the pool isn't backed up
+            while(__atomic_load_n(&thread_pool.queued, __ATOMIC_RELAXED) >= thread_pool.worker_count - 1)
+                sched_yield();
+
+            threadpool_submit(&thread_pool, &group, detect_faces, run);
+        }
+    }
+    threadpool_wait(&thread_pool, &group);
+
+    int failed = 0;
+    for(int r = 0; r < TEST_REPEATS; ++r)
+    {
+        for(int i = 0; i < TEST_IMAGE_COUNT; ++i)
+        {
+            if(!same_rects(&runs[r*TEST_IMAGE_COUNT + i], &expected[i]))
+            {
+                printf("FAIL %s %s, run %d: %d faces, expected %d\n", name, test_images[i], r,
+                       *(int*)runs[r*TEST_IMAGE_COUNT + i].result, *(int*)expected[i].result);
+                failed++;
+            }
+        }
+    }
+
+    printf("%s: %d detections, %d wrong\n", name, TEST_IMAGE_COUNT*TEST_REPEATS, failed);
+    return failed;
+}
+
+int main(int argc, char** argv)
+{
+    is_quiet = true;
+    int thread_count = (argc > 1) ? MAX(2, atoi(argv[1])) : 4;
+
+    if(!threadpool_init(&thread_pool, thread_count) || !detect_init())
+        return 1;
+
+    Image images[TEST_IMAGE_COUNT] = {};
+    Image expected[TEST_IMAGE_COUNT] = {};
+    Image runs[TEST_IMAGE_COUNT*TEST_REPEATS] = {};
+    static u8 buffers[TEST_IMAGE_COUNT*(TEST_REPEATS+1)][DETECT_BUFFER_SIZE];
+
+    Arena* arena = arena_create(ARENA_SIZE_MEDIUM);
+    for(int i = 0; i < TEST_IMAGE_COUNT*TEST_REPEATS; ++i)
+        run_arenas[i] = arena_create(ARENA_SIZE_TINY);
+
+    for(int i = 0; i < TEST_IMAGE_COUNT; ++i)
+    {
+        Image* image = &images[i];
+        image->data = stbi_load(test_images[i], &image->w, &image->h, &image->n, 3);
+        if(!image->data)
+        {
+            printf("Could not load %s\n", test_images[i]);
+            return 1;
+        }
+        image->n = 3;
+        image->step = image->w*3;
+        image->arena = arena;
+    }
+
+    // one at a time, with the layers on this thread only
+    facedetect_set_parallel(NULL, NULL, 1);
+    for(int i = 0; i < TEST_IMAGE_COUNT; ++i)
+    {
+        expected[i] = images[i];
+        expected[i].detect_buffer = buffers[i];
+        detect_faces(&expected[i]);
+    }
+
+    int failed = run_all("pool", detect_parallel_for, runs, images, expected, buffers);
+    failed += run_all("nested", nesting_parallel_for, runs, images, expected, buffers);
+
+    threadpool_destroy(&thread_pool);
+
+    printf("%s: %d threads, %d wrong\n", failed ? "FAIL" : "PASS", thread_count, failed);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,13 @@
+#!/bin/sh
+# Builds and runs the tests from the repository root. They only need the
+# detector, not ffmpeg.
+
+cd "$(dirname "$0")/.." || exit 1
+mkdir -p bin
+
+models="models/facedetectcnn-data.cpp models/facedetectcnn-model.cpp models/facedetectcnn.cpp models/facedetectcnn-avx2.cpp models/facedetectcnn-avx512.cpp models/facedetectcnn-avx512vnni.cpp"
+opts="-march=native -Ofast"
+includes="-Iinclude"
+
+g++ tests/detect_threads.cpp ${models} ${includes} ${opts} -lpthread -o ./bin/detect_threads || exit 1
+./bin/detect_threads "$@"
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // _mm_pause
+#endif
+
+#include "base.h"
+
+// Persistent worker pool
+//
+// Every worker owns a task queue. Workers pop their own queue from the back
+// and steal from the front of the others when it runs dry, so a worker that
+// finished early picks up whatever the slow ones still have queued. Idle
+// workers spin for a while before parking on a condition variable, which
+// keeps hand-off latency low while the pool is busy without burning cores
+// when it's not.
+
+#define THREADPOOL_MAX_WORKERS MAX_ARENAS
+#define THREADPOOL_QUEUE_SIZE  1024 // tasks per worker, must be a power of two
+#define THREADPOOL_SPIN_COUNT  4096 // idle iterations before a worker parks
+
+typedef void (*TaskFunc)(void* arg);
+
+// Counts outstanding tasks so a caller can wait on a batch of them
+typedef struct
+{
+    i32 pending;
+} TaskGroup;
+
+typedef struct
+{
+    TaskFunc func;
+    void* arg;
+    TaskGroup* group;
+} Task;
+
+typedef struct
+{
+    i32 lock; // spin lock, only held for a push/pop
+    u32 head; // thieves take from here
+    u32 tail; // owner pushes and pops here
+    Task tasks[THREADPOOL_QUEUE_SIZE];
+} TaskQueue;
+
+typedef struct
+{
+    pthread_t threads[THREADPOOL_MAX_WORKERS];
+    TaskQueue queues[THREADPOOL_MAX_WORKERS];
+    int worker_count;
+
+    i32 queued;      // tasks sitting in queues
+    i32 sleeping;    // workers parked on wake
+    u32 next_queue;  // round robin target for tasks submitted from outside the pool
+    bool quit;
+
+    pthread_mutex_t park_lock;
+    pthread_cond_t wake;
+} ThreadPool;
+
+extern ThreadPool thread_pool;
+
+// index of the pool worker running on this thread, -1 for any other thread
+static thread_local int threadpool_worker_id = -1;
+
+static inline void threadpool_cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#else
+    sched_yield();
+#endif
+}
+
+static inline void taskqueue_lock(TaskQueue* q)
+{
+    while(__atomic_exchange_n(&q->lock, 1, __ATOMIC_ACQUIRE))
+    {
+        while(__atomic_load_n(&q->lock, __ATOMIC_RELAXED))
+            threadpool_cpu_relax();
+    }
+}
+
+static inline void taskqueue_unlock(TaskQueue* q)
+{
+    __atomic_store_n(&q->lock, 0, __ATOMIC_RELEASE);
+}
+
+static bool taskqueue_push(TaskQueue* q, Task* task)
+{
+    taskqueue_lock(q);
+    bool pushed = (q->tail - q->head < THREADPOOL_QUEUE_SIZE);
+    if(pushed)
+    {
+        q->tasks[q->tail & (THREADPOOL_QUEUE_SIZE-1)] = *task;
+        __atomic_store_n(&q->tail, q->tail + 1, __ATOMIC_RELAXED);
+    }
+    taskqueue_unlock(q);
+    return pushed;
+}
+
+static bool taskqueue_pop(TaskQueue* q, Task* task, bool steal)
+{
+    if(__atomic_load_n(&q->tail, __ATOMIC_RELAXED) == __atomic_load_n(&q->head, __ATOMIC_RELAXED))
+        return false; // cheap early out, re-checked under the lock
+
+    taskqueue_lock(q);
+    bool popped = (q->tail != q->head);
+    if(popped)
+    {
+        if(steal)
+        {
+            *task = q->tasks[q->head & (THREADPOOL_QUEUE_SIZE-1)];
+            __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            *task = q->tasks[(q->tail - 1) & (THREADPOOL_QUEUE_SIZE-1)];
+            __atomic_store_n(&q->tail, q->tail - 1, __ATOMIC_RELAXED);
+        }
+    }
+    taskqueue_unlock(q);
+    return popped;
+}
+
+static void threadpool_execute(Task* task)
+{
+    task->func(task->arg);
+    if(task->group)
+        __atomic_sub_fetch(&task->group->pending, 1, __ATOMIC_RELEASE);
+}
+
+// Runs one queued task on the calling thread, if there is one.
+// Workers look at their own queue first, then steal from the others.
+static bool threadpool_run_one(ThreadPool* pool)
+{
+    int n = pool->worker_count;
+    int self = threadpool_worker_id;
+    Task task;
+
+    bool found = (self >= 0 && taskqueue_pop(&pool->queues[self], &task, false));
+
+    for(int i = 1; !found && i <= n; ++i)
+    {
+        int victim = ((self < 0 ? 0 : self) + i) % n;
+        found = taskqueue_pop(&pool->queues[victim], &task, true);
+    }
+
+    if(!found)
+        return false;
+
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+    threadpool_execute(&task);
+    return true;
+}
+
+typedef struct
+{
+    ThreadPool* pool;
+    int id;
+} ThreadPoolWorkerArgs;
+
+static void* threadpool_worker(void* arg)
+{
+    ThreadPoolWorkerArgs* args = (ThreadPoolWorkerArgs*)arg;
+    ThreadPool* pool = args->pool;
+    threadpool_worker_id = args->id;
+    free(args);
+
+    int spins = 0;
+
+    while(!__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE))
+    {
+        if(threadpool_run_one(pool))
+        {
+            spins = 0;
+            continue;
+        }
+
+        if(++spins < THREADPOOL_SPIN_COUNT)
+        {
+            threadpool_cpu_relax();
+            continue;
+        }
+
+        // nothing to do for a while, park until a task is submitted
+        pthread_mutex_lock(&pool->park_lock);
+        __atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        while(__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST) <= 0 && !__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE))
+            pthread_cond_wait(&pool->wake, &pool->park_lock);
+        __atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->park_lock);
+
+        spins = 0;
+    }
+
+    return NULL;
+}
+
+bool threadpool_init(ThreadPool* pool, int worker_count)
+{
+    memset(pool, 0, sizeof(ThreadPool));
+    pthread_mutex_init(&pool->park_lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+
+    // queues are sized up front, a worker that fails to start just leaves
+    // its queue to be drained by the others
+    pool->worker_count = CLAMP(worker_count, 1, THREADPOOL_MAX_WORKERS);
+
+    int started = 0;
+    for(int i = 0; i < pool->worker_count; ++i)
+    {
+        ThreadPoolWorkerArgs* args = (ThreadPoolWorkerArgs*)malloc(sizeof(ThreadPoolWorkerArgs));
+        args->pool = pool;
+        args->id = i;
+
+        if(pthread_create(&pool->threads[i], NULL, threadpool_worker, args) != 0)
+        {
+            LOGW("Failed to start worker thread");
+            free(args);
+            pool->threads[i] = 0;
+            continue;
+        }
+        started++;
+    }
+
+    return started > 0;
+}
+
+void threadpool_destroy(ThreadPool* pool)
+{
+    pthread_mutex_lock(&pool->park_lock);
+    __atomic_store_n(&pool->quit, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->park_lock);
+
+    for(int i = 0; i < pool->worker_count; ++i)
+    {
+        if(pool->threads[i])
+            pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&pool->park_lock);
+    pthread_cond_destroy(&pool->wake);
+    pool->worker_count = 0;
+}
+
+// Queues func(arg) on the pool. group may be NULL for fire-and-forget tasks
+void threadpool_submit(ThreadPool* pool, TaskGroup* group, TaskFunc func, void* arg)
+{
+    Task task = {func, arg, group};
+
+    if(group)
+        __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+
+    int self = threadpool_worker_id;
+    int target = (self >= 0) ? self : (int)(__atomic_fetch_add(&pool->next_queue, 1, __ATOMIC_RELAXED) % pool->worker_count);
+
+    if(!taskqueue_push(&pool->queues[target], &task))
+    {
+        // queue is full, don't block the submitter
+        threadpool_execute(&task);
+        return;
+    }
+
+    __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pool->park_lock);
+        pthread_cond_signal(&pool->wake);
+        pthread_mutex_unlock(&pool->park_lock);
+    }
+}
+
+// Blocks until every task in group has finished. The caller runs queued
+// tasks while it waits instead of sitting idle.
+void threadpool_wait(ThreadPool* pool, TaskGroup* group)
+{
+    int spins = 0;
+    while(__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) > 0)
+    {
+        if(threadpool_run_one(pool))
+        {
+            spins = 0;
+            continue;
+        }
+
+        if(++spins < THREADPOOL_SPIN_COUNT)
+            threadpool_cpu_relax();
+        else
+            sched_yield();
+    }
+}
+
+static inline bool threadpool_is_worker()
+{
+    return threadpool_worker_id >= 0;
+}
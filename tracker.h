@@ -0,0 +1,240 @@
+#pragma once
+
+#include "base.h"
+#include "transform.h"
+
+// Box tracker for sparse detection
+//
+// The CNN only runs every settings.detect_interval frames. In between, the
+// rects of the last detection are carried forward with a constant velocity
+// model. Detections are matched to tracks by IoU. A track's confidence
+// decays every frame it goes without a matching detection, and a track
+// that has faded (or was missed by a detection) asks for a fresh detection
+// ahead of schedule. Those extra detections come at most twice per
+// interval, a face that left the frame would otherwise have the CNN run on
+// every frame until its track is dropped. A track is dropped once it has
+// gone settings.track_max_age frames without a match.
+
+#define TRACKER_MAX_TRACKS       256
+#define TRACKER_MATCH_IOU        0.3f  // minimum overlap to associate a detection with a track
+#define TRACKER_DECAY            0.95f // confidence kept per frame without a match
+#define TRACKER_MISS_DECAY       0.5f  // confidence kept when a detection ran and missed the track
+#define TRACKER_REDETECT_RATIO   0.5f  // detect again once a track drops below this share of its matched confidence
+#define TRACKER_VELOCITY_SMOOTH  0.5f  // weight of the newest velocity measurement
+
+#define SCENE_HISTOGRAM_BINS     32
+#define SCENE_CUT_THRESHOLD      0.5f  // share of pixels that changed bins
+
+typedef struct
+{
+    float x, y, w, h;
+    float vx, vy;       // pixels per frame
+
+    float confidence;   // decays while unmatched
+    float matched_confidence;
+    int age;            // frames since the last matching detection
+    bool missed;        // the last detection didn't find it
+} Track;
+
+typedef struct
+{
+    Track tracks[TRACKER_MAX_TRACKS];
+    int track_count;
+
+    u32 frames;
+    u32 since_detection; // frames since the CNN last ran
+    u32 detections;      // frames the CNN ran on
+    u32 forced;          // detections asked for by the tracker or a scene cut
+} Tracker;
+
+// Coarse luma histogram of an RGB image, compared between frames to spot cuts
+void scene_histogram(Image* image, u32* hist)
+{
+    memset(hist, 0, SCENE_HISTOGRAM_BINS*sizeof(u32));
+
+    // every other pixel on every other row is plenty
+    for(int y = 0; y < image->h; y += 2)
+    {
+        u8* row = image->data + y*image->step;
+        for(int x = 0; x < image->w; x += 2)
+        {
+            u8* p = row + x*image->n;
+            int luma = (p[0] + 2*p[1] + p[2]) >> 2;
+            hist[luma * SCENE_HISTOGRAM_BINS / 256]++;
+        }
+    }
+}
+
+bool scene_is_cut(u32* prev, u32* curr)
+{
+    u32 total = 0;
+    u32 diff = 0;
+
+    for(int i = 0; i < SCENE_HISTOGRAM_BINS; ++i)
+    {
+        total += curr[i];
+        diff += (prev[i] > curr[i]) ? prev[i] - curr[i] : curr[i] - prev[i];
+    }
+
+    // every moved pixel is counted twice, once where it left and once where it arrived
+    return total > 0 && diff > 2*SCENE_CUT_THRESHOLD*total;
+}
+
+void tracker_reset(Tracker* t)
+{
+    t->track_count = 0;
+}
+
+// Moves every track one frame forward
+void tracker_predict(Tracker* t)
+{
+    t->frames++;
+    t->since_detection++;
+
+    int count = 0;
+    for(int i = 0; i < t->track_count; ++i)
+    {
+        Track* tr = &t->tracks[i];
+
+        tr->x += tr->vx;
+        tr->y += tr->vy;
+        tr->confidence *= TRACKER_DECAY;
+        tr->age++;
+
+        if(tr->age > settings.track_max_age)
+            continue; // lost for too long
+
+        t->tracks[count++] = *tr;
+    }
+    t->track_count = count;
+}
+
+// True if the frame just predicted should get a real detection
+bool tracker_needs_detection(Tracker* t)
+{
+    if(t->since_detection < (u32)MAX(1, settings.detect_interval/2))
+        return false; // asked for one too recently
+
+    for(int i = 0; i < t->track_count; ++i)
+    {
+        Track* tr = &t->tracks[i];
+        if(tr->missed || tr->confidence < tr->matched_confidence*TRACKER_REDETECT_RATIO)
+            return true;
+    }
+    return false;
+}
+
+static inline Rect track_rect(Track* tr)
+{
+    Rect r = {(u16)MAX(0.0f, roundf(tr->x)), (u16)MAX(0.0f, roundf(tr->y)), (u16)roundf(tr->w), (u16)roundf(tr->h), (u16)tr->confidence};
+    return r;
+}
+
+// Associates this frame's detections with the tracks, greedily by IoU
+void tracker_update(Tracker* t, Rect* rects, int num_rects)
+{
+    t->detections++;
+    t->since_detection = 0;
+
+    bool track_matched[TRACKER_MAX_TRACKS] = {0};
+    bool rect_matched[num_rects] = {0};
+
+    for(;;)
+    {
+        float best_iou = TRACKER_MATCH_IOU;
+        int best_track = -1;
+        int best_rect = -1;
+
+        for(int i = 0; i < t->track_count; ++i)
+        {
+            if(track_matched[i]) continue;
+            Rect tr = track_rect(&t->tracks[i]);
+
+            for(int j = 0; j < num_rects; ++j)
+            {
+                if(rect_matched[j]) continue;
+
+                float iou = calc_iou(&tr, &rects[j]);
+                if(iou > best_iou)
+                {
+                    best_iou = iou;
+                    best_track = i;
+                    best_rect = j;
+                }
+            }
+        }
+
+        if(best_track < 0)
+            break;
+
+        track_matched[best_track] = true;
+        rect_matched[best_rect] = true;
+
+        Track* tr = &t->tracks[best_track];
+        Rect* r = &rects[best_rect];
+
+        // position the model expected vs. what was found, spread over the
+        // frames since the last match
+        float frames = (float)MAX(1, tr->age);
+        float vx = tr->vx + (r->x - tr->x) / frames;
+        float vy = tr->vy + (r->y - tr->y) / frames;
+
+        tr->vx = TRACKER_VELOCITY_SMOOTH*vx + (1.0f - TRACKER_VELOCITY_SMOOTH)*tr->vx;
+        tr->vy = TRACKER_VELOCITY_SMOOTH*vy + (1.0f - TRACKER_VELOCITY_SMOOTH)*tr->vy;
+        tr->x = r->x;
+        tr->y = r->y;
+        tr->w = r->w;
+        tr->h = r->h;
+        tr->confidence = r->confidence;
+        tr->matched_confidence = r->confidence;
+        tr->age = 0;
+        tr->missed = false;
+    }
+
+    for(int i = 0; i < t->track_count; ++i)
+    {
+        if(track_matched[i]) continue;
+        t->tracks[i].confidence *= TRACKER_MISS_DECAY;
+        t->tracks[i].missed = true;
+    }
+
+    // new faces start new tracks
+    for(int j = 0; j < num_rects && t->track_count < TRACKER_MAX_TRACKS; ++j)
+    {
+        if(rect_matched[j]) continue;
+
+        Track* tr = &t->tracks[t->track_count++];
+        memset(tr, 0, sizeof(Track));
+        tr->x = rects[j].x;
+        tr->y = rects[j].y;
+        tr->w = rects[j].w;
+        tr->h = rects[j].h;
+        tr->confidence = rects[j].confidence;
+        tr->matched_confidence = rects[j].confidence;
+    }
+}
+
+// Current track boxes clipped to a w x h frame. Faded tracks are kept until
+// they're dropped, better to cover a face that's gone than to miss one.
+int tracker_get_rects(Tracker* t, int w, int h, Rect* rects, int max_rects)
+{
+    int num_rects = 0;
+
+    for(int i = 0; i < t->track_count && num_rects < max_rects; ++i)
+    {
+        Track* tr = &t->tracks[i];
+
+        int x0 = CLAMP((int)roundf(tr->x), 0, w);
+        int y0 = CLAMP((int)roundf(tr->y), 0, h);
+        int x1 = CLAMP((int)roundf(tr->x + tr->w), 0, w - 1);
+        int y1 = CLAMP((int)roundf(tr->y + tr->h), 0, h - 1);
+
+        if(x1 <= x0 || y1 <= y0)
+            continue; // moved out of the frame
+
+        Rect r = {(u16)x0, (u16)y0, (u16)(x1 - x0), (u16)(y1 - y0), (u16)tr->confidence};
+        rects[num_rects++] = r;
+    }
+
+    return num_rects;
+}
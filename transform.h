@@ -1,6 +1,7 @@
 #pragma once
 
 #include "base.h"
+#include "threadpool.h"
 
 inline Color get_pixel(Image* image, int x, int y)
 {
@@ -9,18 +10,6 @@ inline Color get_pixel(Image* image, int x, int y)
     return c;
 }
 
-inline void reverse_rgb_order(Image *image)
-{
-    LOGI("Reversing RGB Order... pixel count: %d", image->w*image->h);
-    for(int i = 0; i < image->w*image->h; ++i)
-    {
-        int n = i*image->n;
-        u8 temp = image->data[n+0];
-        image->data[n+0] = image->data[i*3+2]; // R -> B
-        image->data[n+2] = temp;               // B -> R
-    }
-}
-
 Color get_blended_color(u8* data, Color c, float opacity)
 {
     u8 r = data[0];
@@ -420,12 +409,13 @@ static inline float fast_lanczos(double x, int a) {
     return lanczos_table[idx];
 }
 
-void lanczos_downscale(Image *in, Image *out, int a)
+// Downscales output rows [y_begin, y_end)
+void lanczos_downscale(Image *in, Image *out, int a, int y_begin, int y_end)
 {
     double x_scale = (double)in->w / out->w;
     double y_scale = (double)in->h / out->h;
 
-    for (int y = 0; y < out->h; ++y)
+    for (int y = y_begin; y < y_end; ++y)
     {
         double source_y = (y + 0.5) * y_scale;
         int y_start = floor(source_y - a);
@@ -482,32 +472,59 @@ void lanczos_downscale(Image *in, Image *out, int a)
     }
 }
 
-bool transform_downscale(Arena* arena, Image* source, Image* result, int scaled_size)
+#define DOWNSCALE_LANCZOS_A 1 // lanczos_init() must be called with this once at startup
+
+typedef struct
 {
-    bool use_scaled_image = source->w > scaled_size || source->h > scaled_size;
+    Image* in;
+    Image* out;
+    int y_begin;
+    int y_end;
+} DownscaleBand;
 
-    if(use_scaled_image)
+static void downscale_band_task(void* arg)
+{
+    DownscaleBand* band = (DownscaleBand*)arg;
+    lanczos_downscale(band->in, band->out, DOWNSCALE_LANCZOS_A, band->y_begin, band->y_end);
+}
+
+// Size of a w x h image with its largest dimension brought down to
+// scaled_size. Returns false if the image is already small enough.
+bool transform_scaled_size(int w, int h, int scaled_size, int* width_scaled, int* height_scaled)
+{
+    *width_scaled = w;
+    *height_scaled = h;
+
+    if(w <= scaled_size && h <= scaled_size)
+        return false;
+
+    // downscale largest dimension 
+    float aspect = w / (float)h;
+
+    if(aspect > 1.0)
+    {
+        // width is larger than height (most common)
+        *width_scaled = scaled_size;
+        *height_scaled = *width_scaled / aspect;
+    }
+    else
     {
-        const int a = 1;
-        lanczos_init(a);
+        *height_scaled = scaled_size;
+        *width_scaled = *height_scaled * aspect;
+    }
 
-        // downscale largest dimension 
-        float aspect = source->w / (float)source->h;
+    return true;
+}
 
-        int width_scaled = 0;
-        int height_scaled = 0;
+bool transform_downscale(Arena* arena, Image* source, Image* result, int scaled_size)
+{
+    int width_scaled = 0;
+    int height_scaled = 0;
 
-        if(aspect > 1.0)
-        {
-            // width is larger than height (most common)
-            width_scaled = scaled_size;
-            height_scaled = width_scaled / aspect;
-        }
-        else
-        {
-            height_scaled = scaled_size;
-            width_scaled = height_scaled * aspect;
-        }
+    bool use_scaled_image = transform_scaled_size(source->w, source->h, scaled_size, &width_scaled, &height_scaled);
+
+    if(use_scaled_image)
+    {
 
         result->w = width_scaled;
         result->h = height_scaled;
@@ -526,12 +543,352 @@ bool transform_downscale(Arena* arena, Image* source, Image* result, int scaled_
             result->data = (u8*)arena_alloc(arena, width_scaled*height_scaled*result->n);
         }
 
-        lanczos_downscale(source, result, a);
+        if(threadpool_is_worker() || thread_pool.worker_count <= 1)
+        {
+            // already running as one of many pool tasks (e.g. a video frame)
+            lanczos_downscale(source, result, DOWNSCALE_LANCZOS_A, 0, result->h);
+        }
+        else
+        {
+            // single image, split the rows across the pool
+            DownscaleBand bands[THREADPOOL_MAX_WORKERS];
+            int band_count = thread_pool.worker_count;
+            int rows_per_band = (result->h + band_count - 1) / band_count;
+
+            TaskGroup group = {};
+            for(int i = 0; i < band_count; ++i)
+            {
+                bands[i].in = source;
+                bands[i].out = result;
+                bands[i].y_begin = MIN(i*rows_per_band, result->h);
+                bands[i].y_end = MIN((i+1)*rows_per_band, result->h);
+                threadpool_submit(&thread_pool, &group, downscale_band_task, &bands[i]);
+            }
+            threadpool_wait(&thread_pool, &group);
+        }
     }
 
     return use_scaled_image;
 }
 
+// Box blur of a w x h region in place, samples past the edges are clamped
+// to the region. n is the distance between neighbouring samples, so the same
+// code blurs a plane (n = 1) or one channel of an RGB image (n = 3).
+// Three passes come out close to a gaussian.
+static void box_blur_region(u8* data, int stride, int n, int w, int h, int radius)
+{
+    if(w <= 0 || h <= 0 || radius <= 0)
+        return;
+
+    int window = 2*radius + 1;
+    u8 line[MAX(w, h)];
+
+    for(int pass = 0; pass < 3; ++pass)
+    {
+        // horizontal
+        for(int y = 0; y < h; ++y)
+        {
+            u8* row = data + y*stride;
+            for(int i = 0; i < w; ++i)
+                line[i] = row[i*n];
+
+            int sum = 0;
+            for(int i = -radius; i <= radius; ++i)
+                sum += line[CLAMP(i, 0, w-1)];
+
+            for(int i = 0; i < w; ++i)
+            {
+                row[i*n] = (u8)((sum + radius) / window);
+                sum += line[MIN(i + radius + 1, w-1)] - line[MAX(i - radius, 0)];
+            }
+        }
+
+        // vertical
+        for(int x = 0; x < w; ++x)
+        {
+            u8* col = data + x*n;
+            for(int i = 0; i < h; ++i)
+                line[i] = col[i*stride];
+
+            int sum = 0;
+            for(int i = -radius; i <= radius; ++i)
+                sum += line[CLAMP(i, 0, h-1)];
+
+            for(int i = 0; i < h; ++i)
+            {
+                col[i*stride] = (u8)((sum + radius) / window);
+                sum += line[MIN(i + radius + 1, h-1)] - line[MAX(i - radius, 0)];
+            }
+        }
+    }
+}
+
+static inline int transform_blur_radius(Rect r, float block_scale)
+{
+    return MIN(r.w, r.h)*block_scale / 2;
+}
+
+void transform_blur(Image* image, Rect r, float block_scale)
+{
+    int radius = transform_blur_radius(r, block_scale);
+    u8* start = &image->data[r.y*image->step + r.x*image->n];
+
+    for(int c = 0; c < MIN(image->n, 3); ++c)
+        box_blur_region(start + c, image->step, image->n, r.w, r.h, radius);
+}
+
+// ---------------------------------------------------------------------------
+// YUV transforms
+//
+// These work on the planes of a decoded frame directly so a frame never has
+// to go through RGB just to change the pixels under a few rects. Rects are in
+// luma coordinates.
+
+// Rect covering r on the given plane, chroma rects are widened to whole
+// subsampled pixels
+static inline Rect planar_rect(PlanarImage* image, int plane, Rect r)
+{
+    if(plane == 0)
+        return r;
+
+    int sx = image->chroma_shift_x;
+    int sy = image->chroma_shift_y;
+
+    int x0 = r.x >> sx;
+    int y0 = r.y >> sy;
+    int x1 = (r.x + r.w + (1 << sx) - 1) >> sx;
+    int y1 = (r.y + r.h + (1 << sy) - 1) >> sy;
+
+    x1 = MIN(x1, (image->w + (1 << sx) - 1) >> sx);
+    y1 = MIN(y1, (image->h + (1 << sy) - 1) >> sy);
+
+    Rect pr = {(u16)x0, (u16)y0, (u16)(x1 - x0), (u16)(y1 - y0), r.confidence};
+    return pr;
+}
+
+static inline u8* planar_pixel(PlanarImage* image, int plane, int x, int y)
+{
+    return image->planes[plane] + y*image->stride[plane] + x;
+}
+
+static void rgb_to_yuv(PlanarImage* image, const u8* rgb, u8* y, u8* u, u8* v)
+{
+    int r = rgb[0], g = rgb[1], b = rgb[2];
+
+    // BT.601
+    if(image->full_range)
+    {
+        if(y) *y = (u8)CLAMP((( 77*r + 150*g +  29*b + 128) >> 8), 0, 255);
+        if(u) *u = (u8)CLAMP(((-43*r -  85*g + 128*b + 128) >> 8) + 128, 0, 255);
+        if(v) *v = (u8)CLAMP(((128*r - 107*g -  21*b + 128) >> 8) + 128, 0, 255);
+    }
+    else
+    {
+        if(y) *y = (u8)CLAMP((( 66*r + 129*g +  25*b + 128) >> 8) + 16, 0, 255);
+        if(u) *u = (u8)CLAMP(((-38*r -  74*g + 112*b + 128) >> 8) + 128, 0, 255);
+        if(v) *v = (u8)CLAMP(((112*r -  94*g -  18*b + 128) >> 8) + 128, 0, 255);
+    }
+}
+
+void transform_planar_fill(PlanarImage* image, Rect r, Color c)
+{
+    u8 yuv[3];
+    rgb_to_yuv(image, (u8*)&c, &yuv[0], &yuv[1], &yuv[2]);
+
+    for(int p = 0; p < 3; ++p)
+    {
+        Rect pr = planar_rect(image, p, r);
+        for(int j = 0; j < pr.h; ++j)
+            memset(planar_pixel(image, p, pr.x, pr.y + j), yuv[p], pr.w);
+    }
+}
+
+static void pixelate_plane(u8* start, int stride, int w, int h, int block_w, int block_h)
+{
+    for(int by = 0; by < h; by += block_h)
+    {
+        int bh = MIN(block_h, h - by);
+        for(int bx = 0; bx < w; bx += block_w)
+        {
+            int bw = MIN(block_w, w - bx);
+            u8* block = start + by*stride + bx;
+
+            int sum = 0;
+            for(int j = 0; j < bh; ++j)
+                for(int i = 0; i < bw; ++i)
+                    sum += block[j*stride + i];
+
+            int area = bw*bh;
+            u8 avg = (u8)((sum + area/2) / area);
+
+            for(int j = 0; j < bh; ++j)
+                memset(block + j*stride, avg, bw);
+        }
+    }
+}
+
+void transform_planar_pixelate(PlanarImage* image, Rect r, float block_scale)
+{
+    int sx = image->chroma_shift_x;
+    int sy = image->chroma_shift_y;
+
+    // whole chroma samples per block so the luma and chroma grids line up
+    int block_size = MIN(r.w, r.h)*block_scale;
+    block_size -= block_size % (1 << MAX(sx, sy));
+
+    if(block_size == 0 || block_size == 1)
+        return; // block_size match to pixel size
+
+    // start the grid on a chroma sample boundary too
+    int x0 = r.x & ~((1 << sx) - 1);
+    int y0 = r.y & ~((1 << sy) - 1);
+    r.w += r.x - x0;
+    r.h += r.y - y0;
+    r.x = x0;
+    r.y = y0;
+
+    for(int p = 0; p < 3; ++p)
+    {
+        Rect pr = planar_rect(image, p, r);
+        int bw = (p == 0) ? block_size : block_size >> sx;
+        int bh = (p == 0) ? block_size : block_size >> sy;
+        pixelate_plane(planar_pixel(image, p, pr.x, pr.y), image->stride[p], pr.w, pr.h, bw, bh);
+    }
+}
+
+void transform_planar_blur(PlanarImage* image, Rect r, float block_scale)
+{
+    int radius = transform_blur_radius(r, block_scale);
+
+    for(int p = 0; p < 3; ++p)
+    {
+        Rect pr = planar_rect(image, p, r);
+        int pradius = (p == 0) ? radius : MAX(1, radius >> image->chroma_shift_x);
+        box_blur_region(planar_pixel(image, p, pr.x, pr.y), image->stride[p], 1, pr.w, pr.h, pradius);
+    }
+}
+
+// Shuffles whole chroma blocks (2x2 luma pixels for 4:2:0) so luma and
+// chroma move together
+void transform_planar_scramble(PlanarImage* image, Rect r, u32 seed)
+{
+    int sx = image->chroma_shift_x;
+    int sy = image->chroma_shift_y;
+    int bw = 1 << sx;
+    int bh = 1 << sy;
+
+    int x0 = (r.x + bw - 1) >> sx;
+    int y0 = (r.y + bh - 1) >> sy;
+    int cols = ((r.x + r.w) >> sx) - x0;
+    int rows = ((r.y + r.h) >> sy) - y0;
+
+    if(cols <= 0 || rows <= 0)
+        return;
+
+    if(seed > 0)
+    {
+        // seed of 0 means "don't seed"
+        srand(seed);
+    }
+
+    // initialize unprocessed list
+    int num_blocks = cols*rows;
+    int unprocessed[num_blocks] = {0};
+    int unprocessed_count = num_blocks;
+
+    for(int i = 0; i < num_blocks; ++i)
+        unprocessed[i] = i;
+
+    for(;;)
+    {
+        if(unprocessed_count <= 1)
+            break;
+
+        int idx1 = rand() % unprocessed_count;
+        int idx2 = rand() % unprocessed_count;
+
+        // swap two blocks
+
+        int cx1 = x0 + unprocessed[idx1] % cols, cy1 = y0 + unprocessed[idx1] / cols;
+        int cx2 = x0 + unprocessed[idx2] % cols, cy2 = y0 + unprocessed[idx2] / cols;
+
+        for(int j = 0; j < bh; ++j)
+        {
+            u8 tmp[bw];
+            u8* a = planar_pixel(image, 0, cx1 << sx, (cy1 << sy) + j);
+            u8* b = planar_pixel(image, 0, cx2 << sx, (cy2 << sy) + j);
+            memcpy(tmp, a, bw);
+            memcpy(a, b, bw);
+            memcpy(b, tmp, bw);
+        }
+
+        for(int p = 1; p < 3; ++p)
+        {
+            u8* a = planar_pixel(image, p, cx1, cy1);
+            u8* b = planar_pixel(image, p, cx2, cy2);
+            u8 tmp = *a;
+            *a = *b;
+            *b = tmp;
+        }
+
+        // remove both indices from unprocessed
+        memcpy(&unprocessed[idx1],&unprocessed[unprocessed_count-1], sizeof(int));
+        unprocessed_count--;
+        memcpy(&unprocessed[idx2],&unprocessed[unprocessed_count-1], sizeof(int));
+        unprocessed_count--;
+    }
+}
+
+void transform_planar_stretch_image(PlanarImage* dst, Image* src, Rect r)
+{
+    // Scaling factors
+    float scaleX = (float)src->w / r.w;
+    float scaleY = (float)src->h / r.h;
+
+    for(int p = 0; p < 3; ++p)
+    {
+        int sx = (p == 0) ? 0 : dst->chroma_shift_x;
+        int sy = (p == 0) ? 0 : dst->chroma_shift_y;
+        Rect pr = planar_rect(dst, p, r);
+
+        for(int dy = 0; dy < pr.h; ++dy)
+        {
+            // position in the luma rect this sample sits on
+            int ly = ((pr.y + dy) << sy) - r.y;
+            int ty = MIN((int)(MAX(ly, 0) * scaleY), src->h - 1);
+
+            u8* row = planar_pixel(dst, p, pr.x, pr.y + dy);
+            for(int dx = 0; dx < pr.w; ++dx)
+            {
+                int lx = ((pr.x + dx) << sx) - r.x;
+                int tx = MIN((int)(MAX(lx, 0) * scaleX), src->w - 1);
+
+                const u8* rgb = src->data + ty*src->step + tx*src->n;
+                rgb_to_yuv(dst, rgb, p == 0 ? &row[dx] : NULL, p == 1 ? &row[dx] : NULL, p == 2 ? &row[dx] : NULL);
+            }
+        }
+    }
+}
+
+void transform_apply_planar(PlanarImage* image, int num_rects, Rect* rects, TransformType transform)
+{
+    for(int i = 0; i < num_rects; ++i)
+    {
+        Rect r = rects[i];
+
+        switch(transform)
+        {
+            case TRANSFORM_TYPE_BLACKOUT:       transform_planar_fill(image, r, (Color){0,0,0,255}); break;
+            case TRANSFORM_TYPE_PIXELATE:       transform_planar_pixelate(image, r, settings.block_scale); break;
+            case TRANSFORM_TYPE_SCRAMBLE:       transform_planar_scramble(image, r, 0);    break;
+            case TRANSFORM_TYPE_SCRAMBLE_FIXED: transform_planar_scramble(image, r, 409);  break; // @TODO
+            case TRANSFORM_TYPE_TEXTURE:        if(settings.has_texture) transform_planar_stretch_image(image, &texture_image, r); break;
+            case TRANSFORM_TYPE_BLUR:           transform_planar_blur(image, r, settings.block_scale); break;
+            default: break;
+        }
+    }
+}
+
 void transform_apply(Image* image, int num_rects, Rect* rects, TransformType transform)
 {
     // apply transformation
@@ -548,7 +905,7 @@ void transform_apply(Image* image, int num_rects, Rect* rects, TransformType tra
             case TRANSFORM_TYPE_SCRAMBLE:       transform_scramble(image, r, 0);    break;
             case TRANSFORM_TYPE_SCRAMBLE_FIXED: transform_scramble(image, r, 409);  break; // @TODO
             case TRANSFORM_TYPE_TEXTURE:        if(settings.has_texture) transform_stretch_image(image, &texture_image, r); break;
-            case TRANSFORM_TYPE_BLUR: break;
+            case TRANSFORM_TYPE_BLUR:           transform_blur(image, r, settings.block_scale); break;
             default: break;
         }
     }